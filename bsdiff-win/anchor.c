@@ -0,0 +1,307 @@
+/*
+ * Content-defined anchors (see anchor.h).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "hash.h"
+#include "anchor.h"
+
+/* The top bits of the gear hash tested for a cut before ANCHOR_AVG
+   bytes and after: two more and two fewer than the 13 of an even
+   8 KB, which keeps most chunks near that size */
+#define GEAR_SHORT	15
+#define GEAR_LONG	11
+#define GEAR_MASK(bits)	(~0ULL << (64 - (bits)))
+
+/* A chunk of the old data */
+typedef struct chunk {
+	unsigned long long h;
+	long pos, len;
+} chunk;
+
+/* A fixed random value for each byte, from splitmix64 */
+static void gearinit(unsigned long long g[256])
+{
+	unsigned long long x, z;
+	int i;
+
+	for (x = 0, i = 0;i < 256;i++) {
+		z = (x += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		g[i] = z ^ (z >> 31);
+	};
+}
+
+/* The length of the chunk the n bytes at p start with */
+static long cut(const unsigned long long g[256], const unsigned char *p,
+	long n)
+{
+	unsigned long long h;
+	long i, avg, max;
+
+	if (n <= ANCHOR_MIN)
+		return n;
+	avg = (n < ANCHOR_AVG) ? n : ANCHOR_AVG;
+	max = (n < ANCHOR_MAX) ? n : ANCHOR_MAX;
+
+	/* Each byte is shifted out of the hash 64 bytes on */
+	for (h = 0, i = ANCHOR_MIN - 64;i < ANCHOR_MIN;i++)
+		h = (h << 1) + g[p[i]];
+	for (;i < avg;i++) {
+		h = (h << 1) + g[p[i]];
+		if (!(h & GEAR_MASK(GEAR_SHORT)))
+			return i + 1;
+	};
+	for (;i < max;i++) {
+		h = (h << 1) + g[p[i]];
+		if (!(h & GEAR_MASK(GEAR_LONG)))
+			return i + 1;
+	};
+
+	return max;
+}
+
+static unsigned long long chunkhash(const unsigned char *p, long len)
+{
+	xxh64_state xs;
+
+	xxh64_init(&xs);
+	xxh64_update(&xs, p, len);
+	return xxh64_final(&xs);
+}
+
+long anchor_find(const unsigned char *pold, long oldsize,
+	const unsigned char *pnew, long newsize, anchor **ap)
+{
+	unsigned long long g[256], h;
+	chunk *c;
+	anchor *a;
+	long *tab;
+	long size, nc, na, pos, len, end, lo, hi, n, i, j, k;
+
+	/* Every chunk but the last is longer than ANCHOR_MIN, and the table
+	   is kept at most half full */
+	*ap = NULL;
+	for (size = 2;size < 2 * (oldsize / ANCHOR_MIN + 1);size *= 2);
+	c = (chunk *)malloc((oldsize / ANCHOR_MIN + 1) * sizeof(chunk));
+	a = (anchor *)malloc((newsize / ANCHOR_MIN + 1) * sizeof(anchor));
+	tab = (long *)malloc(size * sizeof(long));
+	if ((c == NULL) || (a == NULL) || (tab == NULL)) {
+		free(c);
+		free(a);
+		free(tab);
+		return -1;
+	};
+	gearinit(g);
+
+	/* The old data's chunks, but for repeats of one already in */
+	for (i = 0;i < size;i++) tab[i] = -1;
+	for (nc = 0, pos = 0;pos < oldsize;pos += len, nc++) {
+		len = cut(g, pold + pos, oldsize - pos);
+		c[nc].h = chunkhash(pold + pos, len);
+		c[nc].pos = pos;
+		c[nc].len = len;
+		for (j = (long)(c[nc].h & (size - 1));((k = tab[j]) != -1) &&
+			!((c[k].h == c[nc].h) && (c[k].len == len));j = (j + 1) & (size - 1));
+		if (k == -1)
+			tab[j] = nc;
+	};
+
+	/* Each of the new data's chunks runs on from the anchor before, as
+	   a repeated chunk or a run does, or is looked up */
+	for (na = 0, pos = 0;pos < newsize;pos += len) {
+		len = cut(g, pnew + pos, newsize - pos);
+		if ((na > 0) && (a[na - 1].newpos + a[na - 1].len == pos) &&
+			((end = a[na - 1].oldpos + a[na - 1].len) <= oldsize - len) &&
+			(memcmp(pold + end, pnew + pos, len) == 0)) {
+			a[na - 1].len += len;
+			continue;
+		};
+		h = chunkhash(pnew + pos, len);
+		for (j = (long)(h & (size - 1));((k = tab[j]) != -1) &&
+			!((c[k].h == h) && (c[k].len == len));j = (j + 1) & (size - 1));
+		if ((k != -1) && (memcmp(pold + c[k].pos, pnew + pos, len) == 0)) {
+			a[na].newpos = pos;
+			a[na].oldpos = c[k].pos;
+			a[na].len = len;
+			na++;
+		};
+	};
+	free(c);
+	free(tab);
+
+	/* Stretch each into the gaps either side, as far as the bytes
+	   agree, and join those that then run on into one another */
+	for (i = 0;i < na;i++) {
+		lo = (i > 0) ? a[i - 1].newpos + a[i - 1].len : 0;
+		for (n = 0;(a[i].newpos - n > lo) && (a[i].oldpos - n > 0) &&
+			(pnew[a[i].newpos - n - 1] == pold[a[i].oldpos - n - 1]);n++);
+		a[i].newpos -= n;
+		a[i].oldpos -= n;
+		a[i].len += n;
+
+		hi = (i + 1 < na) ? a[i + 1].newpos : newsize;
+		end = a[i].newpos + a[i].len;
+		for (n = 0;(end + n < hi) && (a[i].oldpos + a[i].len + n < oldsize) &&
+			(pnew[end + n] == pold[a[i].oldpos + a[i].len + n]);n++);
+		a[i].len += n;
+	};
+	for (k = 0, i = 0;i < na;i++) {
+		if ((k > 0) && (a[k - 1].newpos + a[k - 1].len == a[i].newpos) &&
+			(a[k - 1].oldpos + a[k - 1].len == a[i].oldpos))
+			a[k - 1].len += a[i].len;
+		else
+			a[k++] = a[i];
+	};
+
+	*ap = a;
+	return k;
+}
+
+/* The seed hash: SEED_LEN bytes as the digits of a number in base
+   SEED_BASE, so that it can be rolled a byte on */
+#define SEED_BASE	0x100000001b3ULL
+
+static unsigned long long seedhash(const unsigned char *p)
+{
+	unsigned long long h;
+	int i;
+
+	for (h = 0, i = 0;i < SEED_LEN;i++)
+		h = h * SEED_BASE + p[i];
+	return h;
+}
+
+/* The slot of the table of size slots at which to start looking for h */
+#define SEEDSLOT(h, size)	((long)(((h) * 0x9e3779b97f4a7c15ULL) >> 32) & \
+				((size) - 1))
+
+/* Make room in *a, which has n of *alloc anchors, for one more;
+   returns 0, or -1 if out of memory */
+static int grow(anchor **a, long n, long *alloc)
+{
+	anchor *p;
+
+	if (n < *alloc)
+		return 0;
+	if ((p = (anchor *)realloc(*a, 2 * *alloc * sizeof(anchor))) == NULL)
+		return -1;
+	*a = p;
+	*alloc *= 2;
+
+	return 0;
+}
+
+/* Add the matches in the new data from lo to hi to *a, which has *n of
+   *alloc anchors; returns 0, or -1 if out of memory */
+static int seedgap(const unsigned char *pold, long oldsize,
+	const unsigned char *pnew, long lo, long hi, const long *tab,
+	const unsigned long long *th, long size, anchor **a, long *n,
+	long *alloc)
+{
+	unsigned long long h, top;
+	long pos, j, k, b, e, o;
+	int i;
+
+	/* Before the table is looked at, the bytes are tried at the offset
+	   of the anchor before, if any, so that where the data repeats the
+	   seeds keep to one copy of it */
+	for (top = 1, i = 1;i < SEED_LEN;i++) top *= SEED_BASE;
+	for (pos = lo;pos + SEED_LEN <= hi;) {
+		o = (*n > 0) ? (*a)[*n - 1].oldpos - (*a)[*n - 1].newpos : -hi;
+		h = seedhash(pnew + pos);
+		for (;pos + SEED_LEN <= hi;pos++) {
+			if ((pos + o >= 0) && (pos + o <= oldsize - SEED_LEN) &&
+				(pold[pos + o] == pnew[pos]) &&
+				(memcmp(pold + pos + o, pnew + pos, SEED_LEN) == 0)) {
+				k = pos + o;
+				break;
+			};
+			for (j = SEEDSLOT(h, size);((k = tab[j]) != -1) && (th[j] != h);
+				j = (j + 1) & (size - 1));
+			if ((k != -1) && (memcmp(pold + k, pnew + pos, SEED_LEN) == 0))
+				break;
+			if (pos + SEED_LEN < hi)
+				h = (h - pnew[pos] * top) * SEED_BASE + pnew[pos + SEED_LEN];
+		};
+		if (pos + SEED_LEN > hi)
+			break;
+
+		/* Stretch it either side as far as the bytes agree, and keep it
+		   if that is far enough not to be chance */
+		for (b = 0;(pos - b > lo) && (k - b > 0) &&
+			(pnew[pos - b - 1] == pold[k - b - 1]);b++);
+		for (e = SEED_LEN;(pos + e < hi) && (k + e < oldsize) &&
+			(pnew[pos + e] == pold[k + e]);e++);
+		if (b + e < SEED_MIN) {
+			pos++;
+			continue;
+		};
+		if (grow(a, *n, alloc))
+			return -1;
+		(*a)[*n].newpos = pos - b;
+		(*a)[*n].oldpos = k - b;
+		(*a)[*n].len = b + e;
+		(*n)++;
+		lo = pos += e;
+	};
+
+	return 0;
+}
+
+long anchor_seed(const unsigned char *pold, long oldsize,
+	const unsigned char *pnew, long newsize, anchor **ap, long na)
+{
+	unsigned long long *th, h;
+	anchor *a;
+	long *tab;
+	long size, n, alloc, pos, lo, hi, i, j;
+
+	/* The old data's seeds, but for repeats of one already in, in a
+	   table kept at most half full */
+	for (size = 2;size < 2 * (oldsize / SEED_STEP + 1);size *= 2);
+	alloc = na + 16;
+	tab = (long *)malloc(size * sizeof(long));
+	th = (unsigned long long *)malloc(size * sizeof(unsigned long long));
+	a = (anchor *)malloc(alloc * sizeof(anchor));
+	if ((tab == NULL) || (th == NULL) || (a == NULL)) {
+		free(tab);
+		free(th);
+		free(a);
+		return -1;
+	};
+	for (i = 0;i < size;i++) tab[i] = -1;
+	for (pos = 0;pos + SEED_LEN <= oldsize;pos += SEED_STEP) {
+		h = seedhash(pold + pos);
+		for (j = SEEDSLOT(h, size);(tab[j] != -1) && (th[j] != h);
+			j = (j + 1) & (size - 1));
+		if (tab[j] == -1) {
+			tab[j] = pos;
+			th[j] = h;
+		};
+	};
+
+	/* Each gap's seeds, then the anchor after it */
+	for (n = 0, i = 0;i <= na;i++) {
+		lo = (i > 0) ? (*ap)[i - 1].newpos + (*ap)[i - 1].len : 0;
+		hi = (i < na) ? (*ap)[i].newpos : newsize;
+		if (seedgap(pold, oldsize, pnew, lo, hi, tab, th, size, &a, &n,
+			&alloc) || ((i < na) && grow(&a, n, &alloc)))
+			break;
+		if (i < na)
+			a[n++] = (*ap)[i];
+	};
+	free(tab);
+	free(th);
+	if (i <= na) {
+		free(a);
+		return -1;
+	};
+
+	free(*ap);
+	*ap = a;
+	return n;
+}
+
@@ -0,0 +1,47 @@
+#pragma once
+/*
+ * Anchors: stretches of the new data found whole in the old data by
+ * content-defined chunking, so that only what lies between them needs
+ * bsdiff's suffix sort and scan.
+ *
+ * Both are cut into chunks where a gear hash of the last 64 bytes has
+ * its top bits clear, as FastCDC does: from ANCHOR_MIN bytes in, with
+ * more bits tested up to ANCHOR_AVG bytes and fewer after, and at most
+ * ANCHOR_MAX.  The cuts depend only on the bytes around them, so
+ * content that moved, or that has inserts and deletes around it, is cut
+ * the same in both.  The new data's chunks are looked up in a hash table
+ * of the old data's, then joined where they run on in both and
+ * stretched byte by byte into the gaps either side.
+ */
+
+#include <stddef.h>
+
+#define ANCHOR_MIN	2048
+#define ANCHOR_AVG	8192
+#define ANCHOR_MAX	65536
+
+/* Seeds are matches of SEED_LEN bytes of the new data with the old
+   data at a multiple of SEED_STEP, kept if they stretch to SEED_MIN */
+#define SEED_LEN	32
+#define SEED_STEP	512
+#define SEED_MIN	128
+
+/* newpos to newpos + len in the new data is oldpos on in the old */
+typedef struct anchor {
+	long newpos, oldpos, len;
+} anchor;
+
+/* Find the anchors between the oldsize bytes at pold and the newsize
+   at pnew, in a malloc'ed array at *ap in order of newpos, without
+   overlaps in the new data; returns how many, or -1 if out of memory */
+long anchor_find(const unsigned char *pold, long oldsize,
+	const unsigned char *pnew, long newsize, anchor **ap);
+
+/* Add to the na anchors at *ap the seeds found in the gaps between
+   them, looking up every SEED_LEN bytes of the new data in a table of
+   the old data's at each SEED_STEP; it finds where data with changes
+   too close together for any chunk to survive came from.  Returns how
+   many anchors there are then, in a new *ap, or -1 if out of memory,
+   with *ap as it was */
+long anchor_seed(const unsigned char *pold, long oldsize,
+	const unsigned char *pnew, long newsize, anchor **ap, long na);
@@ -25,15 +25,18 @@
  */
 
 #include <io.h>
-#include <bzlib.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdarg.h>
 #include "bsdiff.h"
-
-#define MIN(x,y) (((x)<(y)) ? (x) : (y))
+#include "codec.h"
+#include "mapfile.h"
+#include "bsdifflib.h"
+#include "parsesize.h"
 
 typedef unsigned char u_char;
 
@@ -62,835 +65,272 @@ void dllerr(int exitcode, const char* fmt, ...)
 }
 
 
-static void split(long *I, long *V, long start, long len, long h)
+/* Read all of name into a malloc()ed buffer; returns 0, or the step
+   that failed, from 1 for opening to 5 for closing */
+static int readfile(const char *name, u_char **pp, long *sizep)
 {
-	long i, j, k, x, tmp, jj, kk;
+	FILE *fs;
+	u_char *p;
+	long size;
 
-	if (len < 16) {
-		for (k = start;k < start + len;k += j) {
-			j = 1;x = V[I[k] + h];
-			for (i = 1;k + i < start + len;i++) {
-				if (V[I[k + i] + h] < x) {
-					x = V[I[k + i] + h];
-					j = 0;
-				};
-				if (V[I[k + i] + h] == x) {
-					tmp = I[k + j];I[k + j] = I[k + i];I[k + i] = tmp;
-					j++;
-				};
-			};
-			for (i = 0;i < j;i++) V[I[k + i]] = k + j - 1;
-			if (j == 1) I[k] = -1;
-		};
-		return;
+	if ((fs = fopen(name, "rb")) == NULL) {
+		dllerr(1, "Open failed :%s", name);
+		return 1;
 	};
-
-	x = V[I[start + len / 2] + h];
-	jj = 0;kk = 0;
-	for (i = start;i < start + len;i++) {
-		if (V[I[i] + h] < x) jj++;
-		if (V[I[i] + h] == x) kk++;
+	if ((fseek(fs, 0, SEEK_END) != 0) || ((size = ftell(fs)) == -1) ||
+		(fseek(fs, 0, SEEK_SET) != 0)) {
+		fclose(fs);
+		dllerr(1, "Seek failed :%s", name);
+		return 2;
 	};
-	jj += start;kk += jj;
 
-	i = start;j = 0;k = 0;
-	while (i < jj) {
-		if (V[I[i] + h] < x) {
-			i++;
-		}
-		else if (V[I[i] + h] == x) {
-			tmp = I[i];I[i] = I[jj + j];I[jj + j] = tmp;
-			j++;
-		}
-		else {
-			tmp = I[i];I[i] = I[kk + k];I[kk + k] = tmp;
-			k++;
-		};
+	/* Allocate size+1 bytes instead of size bytes to ensure
+		that we never try to malloc(0) and get a NULL pointer */
+	if ((p = (u_char *)malloc(size + 1)) == NULL) {
+		fclose(fs);
+		dllerr(1, "Malloc failed :%s", name);
+		return 3;
 	};
-
-	while (jj + j < kk) {
-		if (V[I[jj + j] + h] == x) {
-			j++;
-		}
-		else {
-			tmp = I[jj + j];I[jj + j] = I[kk + k];I[kk + k] = tmp;
-			k++;
-		};
+	if (fread(p, 1, size, fs) != (size_t)size) {
+		fclose(fs);
+		free(p);
+		dllerr(1, "Read failed :%s", name);
+		return 4;
+	};
+	if (fclose(fs) == -1) {
+		free(p);
+		dllerr(1, "Close failed :%s", name);
+		return 5;
 	};
 
-	if (jj > start) split(I, V, start, jj - start, h);
-
-	for (i = 0;i < kk - jj;i++) V[I[jj + i]] = kk - 1;
-	if (jj == kk - 1) I[jj] = -1;
-
-	if (start + len > kk) split(I, V, kk, start + len - kk, h);
+	*pp = p;
+	*sizep = size;
+	return 0;
 }
 
-static void qsufsort(long *I, long *V, u_char *pold, long oldsize)
+/* Map name if map is set, or read it; returns as readfile does */
+static int loadfile(const char *name, int map, mapfile *m)
 {
-	long buckets[256];
-	long i, h, len;
-
-	for (i = 0;i < 256;i++) buckets[i] = 0;
-	for (i = 0;i < oldsize;i++) buckets[pold[i]]++;
-	for (i = 1;i < 256;i++) buckets[i] += buckets[i - 1];
-	for (i = 255;i > 0;i--) buckets[i] = buckets[i - 1];
-	buckets[0] = 0;
-
-	for (i = 0;i < oldsize;i++) I[++buckets[pold[i]]] = i;
-	I[0] = oldsize;
-	for (i = 0;i < oldsize;i++) V[i] = buckets[pold[i]];
-	V[oldsize] = 0;
-	for (i = 1;i < 256;i++) if (buckets[i] == buckets[i - 1] + 1) I[buckets[i]] = -1;
-	I[0] = -1;
-
-	for (h = 1;I[0] != -(oldsize + 1);h += h) {
-		len = 0;
-		for (i = 0;i < oldsize + 1;) {
-			if (I[i] < 0) {
-				len -= I[i];
-				i -= I[i];
-			}
-			else {
-				if (len) I[i - len] = -len;
-				len = V[I[i]] + 1 - i;
-				split(I, V, i, len, h);
-				i += len;
-				len = 0;
-			};
-		};
-		if (len) I[i - len] = -len;
+	if (!map) {
+		m->mapped = 0;
+		return readfile(name, &m->p, &m->size);
+	};
+	if (map_open(m, name, 1)) {
+		dllerr(1, "Open failed :%s", name);
+		return 1;
 	};
 
-	for (i = 0;i < oldsize + 1;i++) I[V[i]] = i;
+	return 0;
 }
 
-static long matchlen(u_char *pold, long oldsize, u_char *pnew, long newsize)
+static int filewrite(void *arg, const void *buf, long len)
 {
-	long i;
-
-	for (i = 0;(i < oldsize) && (i < newsize);i++)
-		if (pold[i] != pnew[i]) break;
-
-	return i;
+	return fwrite(buf, 1, len, (FILE *)arg) != (size_t)len;
 }
 
-static long search(long *I, u_char *pold, long oldsize,
-	u_char *pnew, long newsize, long st, long en, long *pos)
+/* Diff oldfile against newfile into patchfile with o; returns 0, 1-5
+   or 7-11 if reading oldfile or newfile failed (see readfile), 12 if
+   diffing did, or 13 or 14 if creating or writing patchfile did.
+   Under a memory limit or with an index file the files are mapped
+   rather than read, so that they are page cache the system can drop
+   rather than memory of ours, and under a limit the plan picked is
+   told on stderr. */
+static int difffiles(const char *oldfile, const char *newfile,
+	const char *patchfile, const bsdiff_opts *o, bsdiff_stats *st)
 {
-	long x, y;
-
-	if (en - st < 2) {
-		x = matchlen(pold + I[st], oldsize - I[st], pnew, newsize);
-		y = matchlen(pold + I[en], oldsize - I[en], pnew, newsize);
-
-		if (x > y) {
-			*pos = I[st];
-			return x;
-		}
-		else {
-			*pos = I[en];
-			return y;
-		}
+	FILE *pf;
+	mapfile om, nm;
+	bsdiff_ctx *ctx;
+	bsdiff_plan plan;
+	char text[256];
+	int rc, limit, map;
+
+	limit = (o != NULL) && (o->maxmemory != 0);
+	map = limit || ((o != NULL) && (o->indexfile != NULL));
+	if ((rc = loadfile(oldfile, map, &om)) != 0)
+		return rc;
+	if ((rc = loadfile(newfile, map, &nm)) != 0) {
+		map_close(&om);
+		return rc + 6;
 	};
-
-	x = st + (en - st) / 2;
-	if (memcmp(pold + I[x], pnew, MIN(oldsize - I[x], newsize)) < 0) {
-		return search(I, pold, oldsize, pnew, newsize, x, en, pos);
-	}
-	else {
-		return search(I, pold, oldsize, pnew, newsize, st, x, pos);
+	if (limit) {
+		/* Trimmed or anchored, the diff plans for less of oldfile than
+		   this, and is left to find out if it fits; windows are
+		   planned for here as they are there */
+		rc = bsdiff_getplan(o, om.size, nm.size, &plan);
+		bsdiff_plantext(&plan, text, sizeof(text));
+		fprintf(stderr, "%s: %s\n", (o->trim || o->anchors) ?
+			"plan for all of oldfile" : (rc == BSDIFF_OK) ? "plan" :
+			"smallest plan", text);
+		if ((rc != BSDIFF_OK) && !o->trim && !o->anchors) {
+			map_close(&om);
+			map_close(&nm);
+			dllerr(1, "%s :%s", bsdiff_strerror(rc), patchfile);
+			return 12;
+		};
+	};
+	if ((pf = fopen(patchfile, "wb")) == NULL) {
+		map_close(&om);
+		map_close(&nm);
+		dllerr(1, "Open failed :%s", patchfile);
+		return 13;
 	};
-}
-
-static void offtout(long x, u_char *buf)
-{
-	long y;
-
-	if (x < 0) y = -x; else y = x;
-
-	buf[0] = y % 256;y -= buf[0];
-	y = y / 256;buf[1] = y % 256;y -= buf[1];
-	y = y / 256;buf[2] = y % 256;y -= buf[2];
-	y = y / 256;buf[3] = y % 256;y -= buf[3];
-	y = y / 256;buf[4] = y % 256;y -= buf[4];
-	y = y / 256;buf[5] = y % 256;y -= buf[5];
-	y = y / 256;buf[6] = y % 256;y -= buf[6];
-	y = y / 256;buf[7] = y % 256;
 
-	if (x < 0) buf[7] |= 0x80;
+	if ((ctx = bsdiff_new()) == NULL)
+		rc = BSDIFF_ENOMEM;
+	else
+		rc = bsdiff_diff(ctx, om.p, om.size, nm.p, nm.size, o, filewrite, pf,
+			st);
+	bsdiff_free(ctx);
+	map_close(&om);
+	map_close(&nm);
+	if ((fclose(pf) != 0) && (rc == BSDIFF_OK))
+		rc = BSDIFF_EWRITE;
+	if (rc == BSDIFF_OK)
+		return 0;
+
+	dllerr(1, "%s :%s", bsdiff_strerror(rc), patchfile);
+	return (rc == BSDIFF_EWRITE) ? 14 : 12;
 }
 
+/* The DLL's bsdiff() writes BSDIFF40, as it always has, for callers
+   that ship its patches to older bspatch builds; bsdiff_diff takes
+   options */
 __declspec(dllexport) int __cdecl bsdiff(const char* oldfile, const char* newfile, const char* patchfile)
 {
-	FILE* fs;
-	u_char* pold, * pnew;
-	long oldsize, newsize;
-	long* I, * V;
-	long scan, pos, len;
-	long lastscan, lastpos, lastoffset;
-	long oldscore, scsc;
-	long s, Sf, lenf, Sb, lenb;
-	long overlap, Ss, lens;
-	long i;
-	long dblen, eblen;
-	u_char* db, * eb;
-	u_char buf[8];
-	u_char header[32];
-	FILE* pf;
-	BZFILE* pfbz2;
-	int bz2err;
-
-	//if (argc != 4) errx(1, "usage: %s oldfile newfile patchfile\n", argv[0]);
-
-	/* Allocate oldsize+1 bytes instead of oldsize bytes to ensure
-		that we never try to malloc(0) and get a NULL pointer */
-	fs = fopen(oldfile, "rb");
-	if (fs == NULL)
-	{
-		//fclose(fs);
-		dllerr(1, "Open failed :%s", oldfile);
-		return 1;
-	}
-	if (fseek(fs, 0, SEEK_END) != 0)
-	{
-		fclose(fs);
-		dllerr(1, "Seek failed :%s", oldfile);
-		return 2;
-	}
-	oldsize = ftell(fs);
-	pold = (u_char*)malloc(oldsize + 1);
-	if (pold == NULL)
-	{
-		dllerr(1, "Malloc failed :%s", oldfile);
-		return 3;
-	}
-	fseek(fs, 0, SEEK_SET);
-	if (fread(pold, 1, oldsize, fs) == -1)
-	{
-		fclose(fs);
-		free(pold);
-		dllerr(1, "Read failed :%s", oldfile);
-		return 4;
-	}
-	if (fclose(fs) == -1)
-	{
-		free(pold);
-		dllerr(1, "Close failed :%s", oldfile);
-		return 5;
-	}
-
-	if (((I = (long*)malloc((oldsize + 1) * sizeof(long))) == NULL) ||
-		((V = (long*)malloc((oldsize + 1) * sizeof(long))) == NULL))
-	{
-		free(pold);
-		dllerr(1, NULL);
-		free(I);
-		free(V);
-		return 6;
-	}
-
-	//I = (long*)malloc((oldsize + 1) * sizeof(long));
-	//V = (long*)malloc((oldsize + 1) * sizeof(long));
-	qsufsort(I, V, pold, oldsize);
-
-	free(V);
-
-	/* Allocate newsize+1 bytes instead of newsize bytes to ensure
-		that we never try to malloc(0) and get a NULL pointer */
-	fs = fopen(newfile, "rb");
-	if (fs == NULL)
-	{
-		free(pold);
-		free(I);
-		dllerr(1, "Open failed :%s", newfile);
-		return 7;
-	}
-	if (fseek(fs, 0, SEEK_END) != 0)
-	{
-		fclose(fs);
-		free(pold);
-		free(I);
-		dllerr(1, "Seek failed :%s", newfile);
-		return 8;
-	}
-	newsize = ftell(fs);
-	pnew = (u_char*)malloc(newsize + 1);
-	if (pnew == NULL)
-	{
-		fclose(fs);
-		free(pold);
-		free(I);
-		dllerr(1, "Malloc failed :%s", newfile);
-		return 9;
-	}
-	fseek(fs, 0, SEEK_SET);
-	if (fread(pnew, 1, newsize, fs) == -1)
-	{
-		fclose(fs);
-		free(pold);
-		free(I);
-		free(pnew);
-		dllerr(1, "Read failed :%s", newfile);
-		return 10;
-	}
-	if (fclose(fs) == -1)
-	{
-		free(pold);
-		free(I);
-		free(pnew);
-		dllerr(1, "Close failed :%s", newfile);
-		return 11;
-	}
-
-	if (((db = (u_char*)malloc(newsize + 1)) == NULL) ||
-		((eb = (u_char*)malloc(newsize + 1)) == NULL))
-	{
-		free(pold);
-		free(I);
-		free(pnew);
-		free(db);
-		free(eb);
-		dllerr(1, NULL);
-		return 12;
-	}
-	dblen = 0;
-	eblen = 0;
-
-	/* Create the patch file */
-	if ((pf = fopen(patchfile, "wb")) == NULL)
-	{
-		free(pold);
-		free(I);
-		free(pnew);
-		free(db);
-		free(eb);
-		dllerr(1, "Open failed %s", patchfile);
-		return 13;
-	}
-
-
-	/* Header is
-		0	8	 "BSDIFF40"
-		8	8	length of bzip2ed ctrl block
-		16	8	length of bzip2ed diff block
-		24	8	length of pnew file */
-		/* File is
-			0	32	Header
-			32	??	Bzip2ed ctrl block
-			??	??	Bzip2ed diff block
-			??	??	Bzip2ed extra block */
-	memcpy(header, "BSDIFF40", 8);
-	offtout(0, header + 8);
-	offtout(0, header + 16);
-	offtout(newsize, header + 24);
-	if (fwrite(header, 32, 1, pf) != 1)
-	{
-		free(db);
-		free(eb);
-		free(I);
-		free(pold);
-		free(pnew);
-		fclose(pf);
-		dllerr(1, "fwrite(%s)", patchfile);
-		return 14;
-	}
+	bsdiff_opts o;
 
-	/* Compute the differences, writing ctrl as we go */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-	{
-		free(db);
-		free(eb);
-		free(I);
-		free(pold);
-		free(pnew);
-		fclose(pf);
-		dllerr(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-		return 15;
-	}
-	scan = 0; len = 0;
-	lastscan = 0; lastpos = 0; lastoffset = 0;
-	while (scan < newsize) {
-		oldscore = 0;
-
-		for (scsc = scan += len; scan < newsize; scan++) {
-			len = search(I, pold, oldsize, pnew + scan, newsize - scan,
-				0, oldsize, &pos);
-
-			for (; scsc < scan + len; scsc++)
-				if ((scsc + lastoffset < oldsize) &&
-					(pold[scsc + lastoffset] == pnew[scsc]))
-					oldscore++;
-
-			if (((len == oldscore) && (len != 0)) ||
-				(len > oldscore + 8)) break;
-
-			if ((scan + lastoffset < oldsize) &&
-				(pold[scan + lastoffset] == pnew[scan]))
-				oldscore--;
-		};
-
-		if ((len != oldscore) || (scan == newsize)) {
-			s = 0; Sf = 0; lenf = 0;
-			for (i = 0; (lastscan + i < scan) && (lastpos + i < oldsize);) {
-				if (pold[lastpos + i] == pnew[lastscan + i]) s++;
-				i++;
-				if (s * 2 - i > Sf * 2 - lenf) { Sf = s; lenf = i; };
-			};
-
-			lenb = 0;
-			if (scan < newsize) {
-				s = 0; Sb = 0;
-				for (i = 1; (scan >= lastscan + i) && (pos >= i); i++) {
-					if (pold[pos - i] == pnew[scan - i]) s++;
-					if (s * 2 - i > Sb * 2 - lenb) { Sb = s; lenb = i; };
-				};
-			};
-
-			if (lastscan + lenf > scan - lenb) {
-				overlap = (lastscan + lenf) - (scan - lenb);
-				s = 0; Ss = 0; lens = 0;
-				for (i = 0; i < overlap; i++) {
-					if (pnew[lastscan + lenf - overlap + i] ==
-						pold[lastpos + lenf - overlap + i]) s++;
-					if (pnew[scan - lenb + i] ==
-						pold[pos - lenb + i]) s--;
-					if (s > Ss) { Ss = s; lens = i + 1; };
-				};
-
-				lenf += lens - overlap;
-				lenb -= lens;
-			};
-
-			for (i = 0; i < lenf; i++)
-				db[dblen + i] = pnew[lastscan + i] - pold[lastpos + i];
-			for (i = 0; i < (scan - lenb) - (lastscan + lenf); i++)
-				eb[eblen + i] = pnew[lastscan + lenf + i];
-
-			dblen += lenf;
-			eblen += (scan - lenb) - (lastscan + lenf);
-
-			offtout(lenf, buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-			{
-				free(db);
-				free(eb);
-				free(I);
-				free(pold);
-				free(pnew);
-				fclose(pf);
-				dllerr(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-				return 16;
-			}
-
-			offtout((scan - lenb) - (lastscan + lenf), buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-			{
-				free(db);
-				free(eb);
-				free(I);
-				free(pold);
-				free(pnew);
-				fclose(pf);
-				dllerr(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-				return 17;
-			}
-
-			offtout((pos - lenb) - (lastpos + lenf), buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-			{
-				free(db);
-				free(eb);
-				free(I);
-				free(pold);
-				free(pnew);
-				fclose(pf);
-				dllerr(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-				return 18;
-			}
-
-			lastscan = scan - lenb;
-			lastpos = pos - lenb;
-			lastoffset = pos - scan;
-		};
-	};
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-	{
-		free(db);
-		free(eb);
-		free(I);
-		free(pold);
-		free(pnew);
-		fclose(pf);
-		dllerr(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
-		return 19;
-	}
-
-	/* Compute size of compressed ctrl data */
-	if ((len = ftell(pf)) == -1)
-	{
-		free(db);
-		free(eb);
-		free(I);
-		free(pold);
-		free(pnew);
-		fclose(pf);
-		dllerr(1, "ftello");
-		return 20;
-	}
-	offtout(len - 32, header + 8);
-
-	/* Write compressed diff data */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-	{
-		free(db);
-		free(eb);
-		free(I);
-		free(pold);
-		free(pnew);
-		fclose(pf);
-		dllerr(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-		return 21;
-	}
-	BZ2_bzWrite(&bz2err, pfbz2, db, dblen);
-	if (bz2err != BZ_OK)
-	{
-		free(db);
-		free(eb);
-		free(I);
-		free(pold);
-		free(pnew);
-		fclose(pf);
-		dllerr(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-		return 22;
-	}
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-	{
-		free(db);
-		free(eb);
-		free(I);
-		free(pold);
-		free(pnew);
-		fclose(pf);
-		dllerr(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
-		return 23;
-	}
-
-	/* Compute size of compressed diff data */
-	if ((newsize = ftell(pf)) == -1)
-	{
-		free(db);
-		free(eb);
-		free(I);
-		free(pold);
-		free(pnew);
-		fclose(pf);
-		dllerr(1, "ftello");
-		return 24;
-	}
-	offtout(newsize - len, header + 16);
-
-	/* Write compressed extra data */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-	{
-		free(db);
-		free(eb);
-		free(I);
-		free(pold);
-		free(pnew);
-		fclose(pf);
-		dllerr(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-		return 25;
-	}
-	BZ2_bzWrite(&bz2err, pfbz2, eb, eblen);
-	if (bz2err != BZ_OK)
-	{
-		free(db);
-		free(eb);
-		free(I);
-		free(pold);
-		free(pnew);
-		fclose(pf);
-		dllerr(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-		return 26;
-	}
-
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-	{
-		free(db);
-		free(eb);
-		free(I);
-		free(pold);
-		free(pnew);
-		fclose(pf);
-		dllerr(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
-		return 27;
-	}
-
-	/* Seek to the beginning, write the header, and close the file */
-	if (fseek(pf, 0, SEEK_SET))
-	{
-		free(db);
-		free(eb);
-		free(I);
-		free(pold);
-		free(pnew);
-		fclose(pf);
-		dllerr(1, "fseeko");
-		return 28;
-	}
-	if (fwrite(header, 32, 1, pf) != 1)
-	{
-		free(db);
-		free(eb);
-		free(I);
-		free(pold);
-		free(pnew);
-		fclose(pf);
-		dllerr(1, "fwrite(%s)", patchfile);
-		return 29;
-	}
-	if (fclose(pf))
-	{
-		free(db);
-		free(eb);
-		free(I);
-		free(pold);
-		free(pnew);
-		fclose(pf);
-		dllerr(1, "fclose");
-		return 30;
-	}
-
-	/* Free the memory we used */
-	free(db);
-	free(eb);
-	free(I);
-	free(pold);
-	free(pnew);
-	return 0;
+	bsdiff_defaults(&o);
+	o.legacy = 1;
+	return difffiles(oldfile, newfile, patchfile, &o, NULL);
 }
 
 int main(int argc, char *argv[])
 {
-	FILE * fs;
-	u_char *pold, *pnew;
-	long oldsize, newsize;
-	long *I, *V;
-	long scan, pos, len;
-	long lastscan, lastpos, lastoffset;
-	long oldscore, scsc;
-	long s, Sf, lenf, Sb, lenb;
-	long overlap, Ss, lens;
-	long i;
-	long dblen, eblen;
-	u_char *db, *eb;
-	u_char buf[8];
-	u_char header[32];
-	FILE * pf;
-	BZFILE * pfbz2;
-	int bz2err;
-
-	if (argc != 4) errx(1, "usage: %s oldfile newfile patchfile\n", argv[0]);
-
-	/* Allocate oldsize+1 bytes instead of oldsize bytes to ensure
-		that we never try to malloc(0) and get a NULL pointer */
-	fs = fopen(argv[1], "rb");
-	if (fs == NULL)err(1, "Open failed :%s", argv[1]);
-	if (fseek(fs, 0, SEEK_END) != 0)err(1, "Seek failed :%s", argv[1]);
-	oldsize = ftell(fs);
-	pold = (u_char *)malloc(oldsize + 1);
-	if (pold == NULL)	err(1, "Malloc failed :%s", argv[1]);
-	fseek(fs, 0, SEEK_SET);
-	if (fread(pold, 1, oldsize, fs) == -1)	err(1, "Read failed :%s", argv[1]);
-	if (fclose(fs) == -1)	err(1, "Close failed :%s", argv[1]);
-
-	if (((I = (long *)malloc((oldsize + 1) * sizeof(long))) == NULL) ||
-		((V = (long *)malloc((oldsize + 1) * sizeof(long))) == NULL)) err(1, NULL);
-
-	//I = (long*)malloc((oldsize + 1) * sizeof(long));
-	//V = (long*)malloc((oldsize + 1) * sizeof(long));
-	qsufsort(I, V, pold, oldsize);
-
-	free(V);
-
-	/* Allocate newsize+1 bytes instead of newsize bytes to ensure
-		that we never try to malloc(0) and get a NULL pointer */
-	fs = fopen(argv[2], "rb");
-	if (fs == NULL)	err(1, "Open failed :%s", argv[2]);
-	if (fseek(fs, 0, SEEK_END) != 0)err(1, "Seek failed :%s", argv[2]);
-	newsize = ftell(fs);
-	pnew = (u_char *)malloc(newsize + 1);
-	if (pnew == NULL)	err(1, "Malloc failed :%s", argv[2]);
-	fseek(fs, 0, SEEK_SET);
-	if (fread(pnew, 1, newsize, fs) == -1)	err(1, "Read failed :%s", argv[2]);
-	if (fclose(fs) == -1)	err(1, "Close failed :%s", argv[2]);
-
-	if (((db = (u_char *)malloc(newsize + 1)) == NULL) ||
-		((eb = (u_char *)malloc(newsize + 1)) == NULL)) err(1, NULL);
-	dblen = 0;
-	eblen = 0;
-
-	/* Create the patch file */
-	if ((pf = fopen(argv[3], "wb")) == NULL)
-		err(1, "Open failed %s", argv[3]);
-
-	/* Header is
-		0	8	 "BSDIFF40"
-		8	8	length of bzip2ed ctrl block
-		16	8	length of bzip2ed diff block
-		24	8	length of pnew file */
-		/* File is
-			0	32	Header
-			32	??	Bzip2ed ctrl block
-			??	??	Bzip2ed diff block
-			??	??	Bzip2ed extra block */
-	memcpy(header, "BSDIFF40", 8);
-	offtout(0, header + 8);
-	offtout(0, header + 16);
-	offtout(newsize, header + 24);
-	if (fwrite(header, 32, 1, pf) != 1)
-		err(1, "fwrite(%s)", argv[3]);
-
-	/* Compute the differences, writing ctrl as we go */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-	scan = 0;len = 0;
-	lastscan = 0;lastpos = 0;lastoffset = 0;
-	while (scan < newsize) {
-		oldscore = 0;
-
-		for (scsc = scan += len;scan < newsize;scan++) {
-			len = search(I, pold, oldsize, pnew + scan, newsize - scan,
-				0, oldsize, &pos);
-
-			for (;scsc < scan + len;scsc++)
-				if ((scsc + lastoffset < oldsize) &&
-					(pold[scsc + lastoffset] == pnew[scsc]))
-					oldscore++;
-
-			if (((len == oldscore) && (len != 0)) ||
-				(len > oldscore + 8)) break;
-
-			if ((scan + lastoffset < oldsize) &&
-				(pold[scan + lastoffset] == pnew[scan]))
-				oldscore--;
-		};
-
-		if ((len != oldscore) || (scan == newsize)) {
-			s = 0;Sf = 0;lenf = 0;
-			for (i = 0;(lastscan + i < scan) && (lastpos + i < oldsize);) {
-				if (pold[lastpos + i] == pnew[lastscan + i]) s++;
-				i++;
-				if (s * 2 - i > Sf * 2 - lenf) { Sf = s; lenf = i; };
-			};
-
-			lenb = 0;
-			if (scan < newsize) {
-				s = 0;Sb = 0;
-				for (i = 1;(scan >= lastscan + i) && (pos >= i);i++) {
-					if (pold[pos - i] == pnew[scan - i]) s++;
-					if (s * 2 - i > Sb * 2 - lenb) { Sb = s; lenb = i; };
-				};
-			};
-
-			if (lastscan + lenf > scan - lenb) {
-				overlap = (lastscan + lenf) - (scan - lenb);
-				s = 0;Ss = 0;lens = 0;
-				for (i = 0;i < overlap;i++) {
-					if (pnew[lastscan + lenf - overlap + i] ==
-						pold[lastpos + lenf - overlap + i]) s++;
-					if (pnew[scan - lenb + i] ==
-						pold[pos - lenb + i]) s--;
-					if (s > Ss) { Ss = s; lens = i + 1; };
-				};
-
-				lenf += lens - overlap;
-				lenb -= lens;
-			};
-
-			for (i = 0;i < lenf;i++)
-				db[dblen + i] = pnew[lastscan + i] - pold[lastpos + i];
-			for (i = 0;i < (scan - lenb) - (lastscan + lenf);i++)
-				eb[eblen + i] = pnew[lastscan + lenf + i];
-
-			dblen += lenf;
-			eblen += (scan - lenb) - (lastscan + lenf);
-
-			offtout(lenf, buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-
-			offtout((scan - lenb) - (lastscan + lenf), buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-
-			offtout((pos - lenb) - (lastpos + lenf), buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-
-			lastscan = scan - lenb;
-			lastpos = pos - lenb;
-			lastoffset = pos - scan;
-		};
+	const codec *c;
+	bsdiff_opts o;
+	bsdiff_stats st;
+	char *end;
+	double x;
+	int i;
+
+	/* --legacy writes BSDIFF40 patches for older bspatch builds;
+	   --sha256 adds SHA-256 hashes to the XXH64 ones in the header;
+	   --in-place writes a patch bspatch can apply over the old file,
+	   with up to scratch bytes (default INPLACE_DEFSCRATCH) of extra
+	   space for breaking cycles;
+	   --codec picks the compressor for all three blocks, and
+	   --diff-codec and --extra-codec override it for one block;
+	   --huge-pages asks for large pages for the suffix array;
+	   --max-memory picks a plan that keeps the diff within that many
+	   bytes, k, m or g;
+	   --sparse indexes only every k-th suffix of oldfile, for k times
+	   less memory at some cost in time and patch size;
+	   --fm-index finds matches with an FM-index of oldfile, which
+	   leaves the strings the suffix array's memory at some cost in
+	   time;
+	   --index keeps the suffix array in a file, and maps it for the
+	   next diff of the same oldfile instead of sorting again;
+	   --trim leaves the start and end oldfile and newfile have in
+	   common out of the suffix sort and the scan;
+	   --anchors copies the chunks of newfile found whole in oldfile,
+	   and sorts and scans only the gaps between them;
+	   --window diffs newfile that many bytes, k, m or g, at a time,
+	   each against the part of oldfile its anchors point to, and
+	   --threads diffs that many windows at once */
+	bsdiff_defaults(&o);
+	for (i = 1;(i < argc) && (argv[i][0] == '-');i++) {
+		if (strcmp(argv[i], "--legacy") == 0)
+			o.legacy = 1;
+		else if (strcmp(argv[i], "--sha256") == 0)
+			o.sha = 1;
+		else if (strcmp(argv[i], "--huge-pages") == 0)
+			o.hugepages = 1;
+		else if (strcmp(argv[i], "--trim") == 0)
+			o.trim = 1;
+		else if (strcmp(argv[i], "--anchors") == 0)
+			o.anchors = 1;
+		else if (strcmp(argv[i], "--fm-index") == 0)
+			o.fmindex = 1;
+		else if (strcmp(argv[i], "--in-place") == 0)
+			o.inplace = 1;
+		else if (strncmp(argv[i], "--in-place=", 11) == 0) {
+			o.inplace = 1;
+			if ((x = parsesize(argv[i] + 11, LONG_MAX)) < 0)
+				errx(1, "Bad scratch size %s\n", argv[i] + 11);
+			o.scratch = (long)x;
+		}
+		else if (strncmp(argv[i], "--max-memory=", 13) == 0) {
+			if ((x = parsesize(argv[i] + 13, (double)SIZE_MAX)) < 1)
+				errx(1, "Bad memory size %s\n", argv[i] + 13);
+			o.maxmemory = (size_t)x;
+		}
+		else if (strncmp(argv[i], "--window=", 9) == 0) {
+			if ((x = parsesize(argv[i] + 9, LONG_MAX)) < 1)
+				errx(1, "Bad window size %s\n", argv[i] + 9);
+			o.window = (long)x;
+		}
+		else if (strncmp(argv[i], "--threads=", 10) == 0) {
+			o.threads = (int)strtol(argv[i] + 10, &end, 10);
+			if ((end == argv[i] + 10) || (*end != 0) || (o.threads < 1))
+				errx(1, "Bad thread count %s\n", argv[i] + 10);
+		}
+		else if (strncmp(argv[i], "--index=", 8) == 0)
+			o.indexfile = argv[i] + 8;
+		else if (strncmp(argv[i], "--sparse=", 9) == 0) {
+			o.sparse = strtol(argv[i] + 9, &end, 10);
+			if ((end == argv[i] + 9) || (*end != 0) || (o.sparse < 1))
+				errx(1, "Bad spacing %s\n", argv[i] + 9);
+		}
+		else if (strncmp(argv[i], "--codec=", 8) == 0) {
+			if ((c = codec_byname(argv[i] + 8)) == NULL)
+				errx(1, "Unknown codec %s\n", argv[i] + 8);
+			o.codecs[0] = o.codecs[1] = o.codecs[2] = c->id;
+		}
+		else if (strncmp(argv[i], "--diff-codec=", 13) == 0) {
+			if ((c = codec_byname(argv[i] + 13)) == NULL)
+				errx(1, "Unknown codec %s\n", argv[i] + 13);
+			o.codecs[1] = c->id;
+		}
+		else if (strncmp(argv[i], "--extra-codec=", 14) == 0) {
+			if ((c = codec_byname(argv[i] + 14)) == NULL)
+				errx(1, "Unknown codec %s\n", argv[i] + 14);
+			o.codecs[2] = c->id;
+		}
+		else
+			break;
 	};
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
-
-	/* Compute size of compressed ctrl data */
-	if ((len = ftell(pf)) == -1)
-		err(1, "ftello");
-	offtout(len - 32, header + 8);
-
-	/* Write compressed diff data */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-	BZ2_bzWrite(&bz2err, pfbz2, db, dblen);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
-
-	/* Compute size of compressed diff data */
-	if ((newsize = ftell(pf)) == -1)
-		err(1, "ftello");
-	offtout(newsize - len, header + 16);
-
-	/* Write compressed extra data */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-	BZ2_bzWrite(&bz2err, pfbz2, eb, eblen);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
-
-	/* Seek to the beginning, write the header, and close the file */
-	if (fseek(pf, 0, SEEK_SET))
-		err(1, "fseeko");
-	if (fwrite(header, 32, 1, pf) != 1)
-		err(1, "fwrite(%s)", argv[3]);
-	if (fclose(pf))
-		err(1, "fclose");
-
-	/* Free the memory we used */
-	free(db);
-	free(eb);
-	free(I);
-	free(pold);
-	free(pnew);
+	if ((argc - i != 3) || (o.fmindex && (o.sparse > 1)) ||
+		((o.fmindex || o.anchors || (o.window > 0)) &&
+		(o.indexfile != NULL)) ||
+		(o.legacy && (o.sha || o.inplace ||
+		(o.codecs[0] != CODEC_BZIP2) || (o.codecs[1] != CODEC_BZIP2) ||
+		(o.codecs[2] != CODEC_BZIP2))))
+		errx(1, "usage: %s [options] oldfile newfile patchfile\n"
+			"  [--huge-pages] [--max-memory=size] [--index=file | --window=size [--threads=n]] [--trim | --anchors] [--sparse=k | --fm-index] [--legacy | [--sha256] [--in-place[=scratch]] [--codec=name] [--diff-codec=name] [--extra-codec=name]]\n",
+			argv[0]);
+
+	/* --anchors trims as well */
+	if (o.trim && o.anchors)
+		errx(1, "--anchors cannot be used with --trim, which it implies\n");
+
+	/* Windows find anchors of their own and are not trimmed */
+	if ((o.window > 0) && (o.trim || o.anchors))
+		errx(1, "--window cannot be used with --trim or --anchors\n");
+
+	/* The old file a dictionary codec needs is gone by the time an
+	   in-place patch is decoded */
+	if (o.inplace && ((codec_find(o.codecs[1])->setdict != NULL) ||
+		(codec_find(o.codecs[2])->setdict != NULL)))
+		errx(1, "--in-place cannot use a dictionary codec\n");
+	argv += i - 1;
+
+	if (difffiles(argv[1], argv[2], argv[3], &o, &st))
+		exit(1);
+	if (st.converted > 0)
+		fprintf(stderr, "%ld bytes of copies stored as literals to break "
+			"cycles; a larger --in-place scratch keeps them smaller\n",
+			st.converted);
 
 	return 0;
 }
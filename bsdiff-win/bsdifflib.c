@@ -0,0 +1,1982 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The bsdiff engine behind bsdifflib.h: suffix sorting the old data,
+ * matching the new data against it, and writing the patch.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ctrlcodec.h"
+#include "codec.h"
+#include "hash.h"
+#include "inplace.h"
+#include "arena.h"
+#include "fmindex.h"
+#include "anchor.h"
+#include "thread.h"
+#include "bsdifflib.h"
+
+#define MIN(x,y) (((x)<(y)) ? (x) : (y))
+#define MAX(x,y) (((x)>(y)) ? (x) : (y))
+
+typedef unsigned char u_char;
+
+/* With the diff and extra strings streamed, they are fed to their
+   encoders in pieces of this size */
+#define STRCHUNK	(1L << 20)
+
+/* What a plan allows for besides the arena and the encoders: the ctrl
+   triples, guessed at an eighth of newsize and 64 KB, and the
+   compressed patch, at a quarter of newsize */
+#define PLAN_CTRL(newsize)	((size_t)(newsize) / 8 + ((size_t)1 << 16))
+#define PLAN_PATCH(newsize)	((size_t)(newsize) / 4)
+
+/* The time a diff with an FM-index takes over one with a suffix array:
+   about 1.5 on large mostly-matching files and 3 on executables */
+#define FM_SLOWDOWN	2.0
+
+/* An index file starts with a header of this many bytes, and then
+   holds the suffix array as it is in memory */
+#define IDXHDR		ARENA_ALIGN
+#define IDXMAGIC	"BSDIFFSA"
+
+/* With trimming, the start and end the old and new data share are
+   compared this many bytes at a time, and this much of each is left to
+   the scan so that its matches run on into them */
+#define TRIM_BLOCK	4096
+#define TRIM_MARGIN	(1L << 16)
+
+/* A run of one byte at least twice this long in the new data is
+   scanned as its first byte and its last RUN_TAIL (see diffscan) */
+#define RUN_TAIL	64
+
+/* With anchors, a gap between two is diffed against the old data
+   between them, unless that is out of order or over ANCHOR_SPREAD
+   times the gap, when it is as much as the gap after the first; and
+   ANCHOR_MARGIN bytes either side (see gapregion) */
+#define ANCHOR_SPREAD	4
+#define ANCHOR_MARGIN	4096
+
+/* A window of size bytes is diffed against old data at up to this
+   many offsets, WINDOW_OLD(size) bytes of it in all (see windowregion) */
+#define WINDOW_PIECES	8
+#define WINDOW_OLD(size)	((size) + (size) / 4)
+
+/* The widest spacing a plan picks for a sparse suffix array */
+#define PLAN_MAXSPARSE	256
+
+/* The suffixes a suffix array of every k-th byte of size bytes holds */
+#define SAMPLES(size, k)	(((size) + (k) - 1) / (k))
+
+/* A block compressed into memory, so that the header, which holds its
+   length, can go out ahead of it */
+typedef struct membuf {
+	u_char *p;
+	long len, alloc;
+	int failed;
+	const codec *c;
+	void *cs;			/* its encoder while one is open */
+	stream st;
+} membuf;
+
+/* The diff or extra string as it is made: gathered whole in buf, or,
+   when streamed, handed to its block's encoder each time buf fills */
+typedef struct strout {
+	u_char *buf;
+	long size, fill;
+	long len;			/* bytes put in all */
+	membuf *m;			/* the block buf feeds, or NULL */
+} strout;
+
+/* A lookup of the new data at one offset in a suffix array */
+typedef struct lookup {
+	long at;			/* the offset, or -1 if none yet */
+	long len, pos;
+} lookup;
+
+/* A suffix array of the old data, of every suffix or, sparse, of only
+   those starting at multiples of k, with the last k lookups in it */
+typedef struct sufindex {
+	const long *I;
+	long n;				/* suffixes in it, besides the empty one */
+	long k;
+	lookup *memo;			/* by offset modulo k */
+} sufindex;
+
+/* The index the scan finds matches in, whichever it is: find sets
+   *pos to where the longest match of pnew + scan it knows of starts,
+   and returns its length */
+typedef struct matcher {
+	long (*find)(void *ix, const u_char *pold, long oldsize,
+		const u_char *pnew, long newsize, long scan, long *pos);
+	void *ix;
+} matcher;
+
+/* The index, its sort's rank array and the diff and extra strings all
+   come out of one arena, in two parts (see arenasize): each is used
+   first for sorting and then for the index or the strings, unless with
+   anchors the strings are apart. */
+struct bsdiff_ctx {
+	arena mem;
+	sufindex sx;			/* the old data's suffix array, */
+	fmindex fm;			/* or its FM-index */
+	u_char *db, *eb;		/* the diff and extra strings */
+	ctrlbuf cb;
+	membuf blk[3];			/* ctrl, diff and extra blocks */
+	lookup *memo;			/* a sparse index's lookups */
+	long memoalloc;
+	anchor *anchors;		/* the last diff's, with opts.anchors */
+	u_char *join;			/* a gap's two pieces of old data */
+	long joinalloc;
+	bsdiff_ctx **work;		/* one for each window diffed at once */
+	int nwork;
+};
+
+static void split(long *I, long *V, long start, long len, long h)
+{
+	long i, j, k, x, tmp, jj, kk;
+
+	if (len < 16) {
+		for (k = start;k < start + len;k += j) {
+			j = 1;x = V[I[k] + h];
+			for (i = 1;k + i < start + len;i++) {
+				if (V[I[k + i] + h] < x) {
+					x = V[I[k + i] + h];
+					j = 0;
+				};
+				if (V[I[k + i] + h] == x) {
+					tmp = I[k + j];I[k + j] = I[k + i];I[k + i] = tmp;
+					j++;
+				};
+			};
+			for (i = 0;i < j;i++) V[I[k + i]] = k + j - 1;
+			if (j == 1) I[k] = -1;
+		};
+		return;
+	};
+
+	x = V[I[start + len / 2] + h];
+	jj = 0;kk = 0;
+	for (i = start;i < start + len;i++) {
+		if (V[I[i] + h] < x) jj++;
+		if (V[I[i] + h] == x) kk++;
+	};
+	jj += start;kk += jj;
+
+	i = start;j = 0;k = 0;
+	while (i < jj) {
+		if (V[I[i] + h] < x) {
+			i++;
+		}
+		else if (V[I[i] + h] == x) {
+			tmp = I[i];I[i] = I[jj + j];I[jj + j] = tmp;
+			j++;
+		}
+		else {
+			tmp = I[i];I[i] = I[kk + k];I[kk + k] = tmp;
+			k++;
+		};
+	};
+
+	while (jj + j < kk) {
+		if (V[I[jj + j] + h] == x) {
+			j++;
+		}
+		else {
+			tmp = I[jj + j];I[jj + j] = I[kk + k];I[kk + k] = tmp;
+			k++;
+		};
+	};
+
+	if (jj > start) split(I, V, start, jj - start, h);
+
+	for (i = 0;i < kk - jj;i++) V[I[jj + i]] = kk - 1;
+	if (jj == kk - 1) I[jj] = -1;
+
+	if (start + len > kk) split(I, V, kk, start + len - kk, h);
+}
+
+/* Sort the n+1 suffixes of a string, whose rank array V and suffix
+   array I are already split into groups by their first character, by
+   doubling the prefix the groups agree on */
+static void sortgroups(long *I, long *V, long n)
+{
+	long i, h, len;
+
+	for (h = 1;I[0] != -(n + 1);h += h) {
+		len = 0;
+		for (i = 0;i < n + 1;) {
+			if (I[i] < 0) {
+				len -= I[i];
+				i -= I[i];
+			}
+			else {
+				if (len) I[i - len] = -len;
+				len = V[I[i]] + 1 - i;
+				split(I, V, i, len, h);
+				i += len;
+				len = 0;
+			};
+		};
+		if (len) I[i - len] = -len;
+	};
+
+	for (i = 0;i < n + 1;i++) I[V[i]] = i;
+}
+
+static void qsufsort(long *I, long *V, const u_char *pold, long oldsize)
+{
+	long buckets[256];
+	long i;
+
+	for (i = 0;i < 256;i++) buckets[i] = 0;
+	for (i = 0;i < oldsize;i++) buckets[pold[i]]++;
+	for (i = 1;i < 256;i++) buckets[i] += buckets[i - 1];
+	for (i = 255;i > 0;i--) buckets[i] = buckets[i - 1];
+	buckets[0] = 0;
+
+	for (i = 0;i < oldsize;i++) I[++buckets[pold[i]]] = i;
+	I[0] = oldsize;
+	for (i = 0;i < oldsize;i++) V[i] = buckets[pold[i]];
+	V[oldsize] = 0;
+	for (i = 1;i < 256;i++) if (buckets[i] == buckets[i - 1] + 1) I[buckets[i]] = -1;
+	I[0] = -1;
+
+	sortgroups(I, V, oldsize);
+}
+
+/* Compare the k-byte blocks of pold starting at a*k and b*k from byte
+   d on, a block cut short by the end of pold sorting first */
+static int blockcmp(const u_char *pold, long oldsize, long k, long a,
+	long b, long d)
+{
+	long la, lb;
+	int r;
+
+	la = MIN(k, oldsize - a * k);
+	lb = MIN(k, oldsize - b * k);
+	if ((MIN(la, lb) > d) &&
+		((r = memcmp(pold + a * k + d, pold + b * k + d, MIN(la, lb) - d)) != 0))
+		return r;
+
+	return (la > lb) - (la < lb);
+}
+
+/* Sort the n blocks numbered in I, which agree on their first d bytes,
+   by the rest of their k bytes: a three-way radix quicksort, so that
+   runs of one byte cost no more than k passes over them */
+static void sortblocks(long *I, long n, const u_char *pold, long oldsize,
+	long k, long d)
+{
+	long i, j, lt, gt, tmp;
+	int a, b, c, x;
+
+#define BLOCKBYTE(i)	((I[i] * k + d < oldsize) ? pold[I[i] * k + d] : -1)
+	while ((n > 1) && (d < k)) {
+		if (n < 16) {
+			for (i = 1;i < n;i++)
+				for (j = i;(j > 0) &&
+					(blockcmp(pold, oldsize, k, I[j - 1], I[j], d) > 0);j--) {
+					tmp = I[j];I[j] = I[j - 1];I[j - 1] = tmp;
+				};
+			return;
+		};
+
+		/* Split on the median of three bytes */
+		a = BLOCKBYTE(0);b = BLOCKBYTE(n / 2);c = BLOCKBYTE(n - 1);
+		x = (a < b) ? ((b < c) ? b : ((a < c) ? c : a)) :
+			((a < c) ? a : ((b < c) ? c : b));
+		lt = 0;gt = n;
+		for (i = 0;i < gt;) {
+			if (BLOCKBYTE(i) < x) {
+				tmp = I[i];I[i] = I[lt];I[lt] = tmp;
+				i++;lt++;
+			}
+			else if (BLOCKBYTE(i) > x) {
+				gt--;
+				tmp = I[i];I[i] = I[gt];I[gt] = tmp;
+			}
+			else
+				i++;
+		};
+
+		sortblocks(I, lt, pold, oldsize, k, d);
+		sortblocks(I + gt, n - gt, pold, oldsize, k, d);
+		if (x < 0)
+			return;
+		I += lt;n = gt - lt;d++;
+	};
+#undef BLOCKBYTE
+}
+
+/* Build a sparse suffix array of pold, of the suffixes at multiples of
+   k, into its n+1 entries of I with V as scratch.  Sorted by their
+   first k bytes, those suffixes are the suffixes of a string of n
+   blocks, which the doubling of qsufsort then finishes: the block after
+   a suffix's first is the start of the next suffix indexed. */
+static void sparsesort(long *I, long *V, const u_char *pold, long oldsize,
+	long k, long n)
+{
+	long i, j, x;
+
+	for (i = 0;i < n;i++) I[i + 1] = i;
+	sortblocks(I + 1, n, pold, oldsize, k, 0);
+
+	/* Group the blocks that are the same, as qsufsort's buckets do */
+	for (i = 1;i <= n;i = j) {
+		for (j = i + 1;(j <= n) &&
+			(blockcmp(pold, oldsize, k, I[i], I[j], 0) == 0);j++);
+		for (x = i;x < j;x++) V[I[x]] = j - 1;
+		if (j == i + 1) I[i] = -1;
+	};
+	V[n] = 0;
+	I[0] = -1;
+
+	sortgroups(I, V, n);
+	for (i = 0;i < n + 1;i++)
+		I[i] = (I[i] == n) ? oldsize : I[i] * k;
+}
+
+static long matchlen(const u_char *pold, long oldsize, const u_char *pnew,
+	long newsize)
+{
+	long i;
+
+	for (i = 0;(i < oldsize) && (i < newsize);i++)
+		if (pold[i] != pnew[i]) break;
+
+	return i;
+}
+
+static long search(const long *I, const u_char *pold, long oldsize,
+	const u_char *pnew, long newsize, long st, long en, long *pos)
+{
+	long x, y;
+
+	if (en - st < 2) {
+		x = matchlen(pold + I[st], oldsize - I[st], pnew, newsize);
+		y = matchlen(pold + I[en], oldsize - I[en], pnew, newsize);
+
+		if (x > y) {
+			*pos = I[st];
+			return x;
+		}
+		else {
+			*pos = I[en];
+			return y;
+		}
+	};
+
+	/* A suffix that pnew starts with sorts before the longer ones it
+	   may match more of; going down from it finds only shorter matches,
+	   which in a run of one byte is the run's last byte */
+	x = st + (en - st) / 2;
+	if (memcmp(pold + I[x], pnew, MIN(oldsize - I[x], newsize)) <= 0) {
+		return search(I, pold, oldsize, pnew, newsize, x, en, pos);
+	}
+	else {
+		return search(I, pold, oldsize, pnew, newsize, st, x, pos);
+	};
+}
+
+/* The longest match of pnew + scan in pold that x can find.  A sparse
+   index only finds matches starting at its suffixes, so the new data is
+   looked up again at each of the next k-1 offsets, and a match found
+   that far in is taken back to scan if the bytes before it agree.  The
+   scan mostly moves a byte at a time, so all but one of those lookups
+   were done for the offsets before and are kept. */
+static long findmatch(void *ix, const u_char *pold, long oldsize,
+	const u_char *pnew, long newsize, long scan, long *pos)
+{
+	sufindex *x = (sufindex *)ix;
+	lookup *l;
+	long j, best;
+
+	if (x->k == 1)
+		return search(x->I, pold, oldsize, pnew + scan, newsize - scan,
+			0, x->n, pos);
+
+	best = 0;
+	for (j = 0;(j < x->k) && (scan + j < newsize);j++) {
+		l = &x->memo[(scan + j) % x->k];
+		if (l->at != scan + j) {
+			l->at = scan + j;
+			l->len = search(x->I, pold, oldsize, pnew + scan + j,
+				newsize - scan - j, 0, x->n, &l->pos);
+		};
+		if (j == 0) {
+			best = l->len;
+			*pos = l->pos;
+		}
+		else if ((l->len > 0) && (j + l->len > best) && (l->pos >= j) &&
+			(memcmp(pold + l->pos - j, pnew + scan, j) == 0)) {
+			best = j + l->len;
+			*pos = l->pos - j;
+		};
+	};
+
+	return best;
+}
+
+static void offtout(long x, u_char *buf)
+{
+	long y;
+
+	if (x < 0) y = -x; else y = x;
+
+	buf[0] = y % 256;y -= buf[0];
+	y = y / 256;buf[1] = y % 256;y -= buf[1];
+	y = y / 256;buf[2] = y % 256;y -= buf[2];
+	y = y / 256;buf[3] = y % 256;y -= buf[3];
+	y = y / 256;buf[4] = y % 256;y -= buf[4];
+	y = y / 256;buf[5] = y % 256;y -= buf[5];
+	y = y / 256;buf[6] = y % 256;y -= buf[6];
+	y = y / 256;buf[7] = y % 256;
+
+	if (x < 0) buf[7] |= 0x80;
+}
+
+static int memwrite(void *arg, const void *buf, long len)
+{
+	membuf *m = (membuf *)arg;
+	u_char *p;
+	long n;
+
+	if (len > m->alloc - m->len) {
+		for (n = m->alloc ? m->alloc : 65536;n - m->len < len;n *= 2)
+			;
+		if ((p = (u_char *)realloc(m->p, n)) == NULL) {
+			m->failed = 1;
+			return -1;
+		};
+		m->p = p;
+		m->alloc = n;
+	};
+	memcpy(m->p + m->len, buf, len);
+	m->len += len;
+
+	return 0;
+}
+
+/* The level to open c at for a block of up to len bytes */
+static int blocklevel(const codec *c, long len)
+{
+	return (c->wlevel != NULL) ? c->wlevel(len) : 0;
+}
+
+/* Start compressing a block of up to len bytes into m, offering the
+   codec dict if it takes a dictionary */
+static int blockopen(membuf *m, const codec *c, long len,
+	const u_char *dict, long dictlen)
+{
+	m->len = 0;
+	m->failed = 0;
+	m->c = c;
+	stream_callback(&m->st, NULL, memwrite, m, -1);
+	if ((m->cs = c->wopen(&m->st, blocklevel(c, len))) == NULL)
+		return BSDIFF_ENOMEM;
+	if ((dict != NULL) && (c->setdict != NULL))
+		c->setdict(m->cs, dict, dictlen);
+
+	return BSDIFF_OK;
+}
+
+static int blockwrite(membuf *m, const u_char *buf, long len)
+{
+	if (m->c->write(m->cs, buf, len))
+		return m->failed ? BSDIFF_ENOMEM : BSDIFF_ECODEC;
+
+	return BSDIFF_OK;
+}
+
+/* Finish the block open on m, or only free its encoder if rc says
+   something already failed; returns rc, or the failure to finish */
+static int blockclose(membuf *m, int rc)
+{
+	void *cs;
+
+	if ((cs = m->cs) == NULL)
+		return rc;
+	m->cs = NULL;
+	if (m->c->wclose(cs) && (rc == BSDIFF_OK))
+		rc = m->failed ? BSDIFF_ENOMEM : BSDIFF_ECODEC;
+
+	return rc;
+}
+
+/* Compress len bytes as one block into m */
+static int writeblock(membuf *m, const codec *c, const u_char *buf, long len,
+	const u_char *dict, long dictlen)
+{
+	int rc;
+
+	if ((rc = blockopen(m, c, len, dict, dictlen)) != BSDIFF_OK)
+		return rc;
+
+	return blockclose(m, blockwrite(m, buf, len));
+}
+
+/* Put the n bytes at src into o, less those at sub if it is not NULL */
+static int strput(strout *o, const u_char *src, const u_char *sub, long n)
+{
+	long i, k;
+	int rc;
+
+	while (n > 0) {
+		if (o->fill == o->size) {
+			if ((rc = blockwrite(o->m, o->buf, o->fill)) != BSDIFF_OK)
+				return rc;
+			o->fill = 0;
+		};
+		k = (n < o->size - o->fill) ? n : o->size - o->fill;
+		if (sub != NULL) {
+			for (i = 0;i < k;i++)
+				o->buf[o->fill + i] = src[i] - sub[i];
+			sub += k;
+		}
+		else
+			memcpy(o->buf + o->fill, src, k);
+		src += k;
+		n -= k;
+		o->fill += k;
+		o->len += k;
+	};
+
+	return BSDIFF_OK;
+}
+
+/* Hand what is left in a streamed o to its encoder */
+static int strflush(strout *o)
+{
+	int rc;
+
+	if ((o->m == NULL) || (o->fill == 0))
+		return BSDIFF_OK;
+	rc = blockwrite(o->m, o->buf, o->fill);
+	o->fill = 0;
+
+	return rc;
+}
+
+/* Header is
+	0	8	"BSDIFF41"
+	8	8	length of header
+	16	8	length of pnew file
+	24	8	length of compressed ctrl block
+	32	8	length of compressed diff block
+	40	8	length of compressed extra block
+	48	1	codec of ctrl block (see codec.h)
+	49	1	codec of diff block
+	50	1	codec of extra block
+	51	5	zero
+	56	8	XXH64 of pold file (little endian)
+	64	8	XXH64 of pnew file
+	72	1	flags: 1 if the SHA-256 hashes follow, 2 if the ctrl
+		block holds in-place commands (see inplace.h)
+	73	7	zero
+	80	32	SHA-256 of pold file
+	112	32	SHA-256 of pnew file
+   File is
+	0	H	Header
+	H	??	Compressed ctrl block (see ctrlcodec.h)
+	??	??	Compressed diff block
+	??	??	Compressed extra block
+   Readers treat the codecs of a header shorter than 56 bytes as bzip2,
+   and check no hashes if it is shorter than 80.
+   Codecs that take a dictionary get the old file for the diff and
+   extra blocks, and none for the ctrl block.
+
+   With legacy set the BSDIFF40 layout is written instead:
+	0	8	"BSDIFF40"
+	8	8	length of bzip2ed ctrl block
+	16	8	length of bzip2ed diff block
+	24	8	length of pnew file
+   followed by the same three blocks, the ctrl block holding the
+   triples as interleaved offtout() values.
+   The blocks are compressed into memory first, and the patch handed
+   to write in order.  If db is NULL the diff and extra blocks have
+   been compressed already, as the strings were made. */
+static int writepatch(bsdiff_ctx *ctx, const bsdiff_opts *o,
+	const ctrlbuf *cb, const u_char *db, long dblen, const u_char *eb,
+	long eblen, const u_char *pold, long oldsize, const u_char *pnew,
+	long newsize, int (*write)(void *, const void *, long), void *arg,
+	long *sizep)
+{
+	xxh64_state xs;
+	sha256_state ss;
+	unsigned long long xh;
+	u_char header[144];
+	u_char *ctrl;
+	long hdrlen, ctrllen, i;
+	int j, rc;
+
+	/* Encode the control triples */
+	if (o->legacy) {
+		ctrllen = cb->count * 24;
+		if ((ctrl = (u_char *)malloc(ctrllen + 1)) != NULL)
+			for (i = 0;i < cb->count * 3;i++)
+				offtout(cb->ctrl[i], ctrl + i * 8);
+	}
+	else {
+		ctrl = ctrl_encode(cb, &ctrllen);
+	};
+	if (ctrl == NULL)
+		return BSDIFF_ENOMEM;
+
+	/* Compress the three blocks */
+	rc = writeblock(&ctx->blk[0], codec_find(o->codecs[0]), ctrl, ctrllen,
+		NULL, 0);
+	free(ctrl);
+	if ((rc != BSDIFF_OK) || ((db != NULL) &&
+		(((rc = writeblock(&ctx->blk[1], codec_find(o->codecs[1]), db, dblen,
+		pold, oldsize)) != BSDIFF_OK) ||
+		((rc = writeblock(&ctx->blk[2], codec_find(o->codecs[2]), eb, eblen,
+		pold, oldsize)) != BSDIFF_OK))))
+		return rc;
+
+	hdrlen = o->legacy ? 32 : (o->sha ? 144 : 80);
+	memset(header, 0, sizeof(header));
+	if (o->legacy) {
+		memcpy(header, "BSDIFF40", 8);
+		offtout(ctx->blk[0].len, header + 8);
+		offtout(ctx->blk[1].len, header + 16);
+		offtout(newsize, header + 24);
+	}
+	else {
+		memcpy(header, "BSDIFF41", 8);
+		offtout(hdrlen, header + 8);
+		offtout(newsize, header + 16);
+		for (i = 0;i < 3;i++) {
+			offtout(ctx->blk[i].len, header + 24 + i * 8);
+			header[48 + i] = (u_char)o->codecs[i];
+		};
+
+		/* Hashes bspatch checks the old file and its output against */
+		for (i = 0;i < 2;i++) {
+			xxh64_init(&xs);
+			xxh64_update(&xs, i ? pnew : pold, i ? newsize : oldsize);
+			xh = xxh64_final(&xs);
+			for (j = 0;j < 8;j++)
+				header[56 + i * 8 + j] = (u_char)(xh >> (j * 8));
+			if (o->sha) {
+				sha256_init(&ss);
+				sha256_update(&ss, i ? pnew : pold, i ? newsize : oldsize);
+				sha256_final(&ss, header + 80 + i * SHA256_LEN);
+			};
+		};
+		header[72] = (u_char)((o->sha != 0) | (o->inplace ? INPLACE_FLAG : 0));
+	};
+
+	/* Hand over the header and the blocks */
+	if (write(arg, header, hdrlen))
+		return BSDIFF_EWRITE;
+	*sizep = hdrlen;
+	for (i = 0;i < 3;i++) {
+		if ((ctx->blk[i].len > 0) &&
+			write(arg, ctx->blk[i].p, ctx->blk[i].len))
+			return BSDIFF_EWRITE;
+		*sizep += ctx->blk[i].len;
+	};
+
+	return BSDIFF_OK;
+}
+
+static long fmfind(void *ix, const u_char *pold, long oldsize,
+	const u_char *pnew, long newsize, long scan, long *pos)
+{
+	return fm_match((const fmindex *)ix, pold, oldsize, pnew + scan,
+		newsize - scan, pos);
+}
+
+/* Match pnew against pold, indexed by m, putting the diff and extra
+   strings to d and e and the triples to cb.
+
+   With runs set, long runs of one byte in pnew are not scanned a byte
+   at a time.  Every offset into a run finds the match of the one
+   before, a byte shorter, and when that is a few bytes better than
+   the old alignment, as where a zero-filled region has moved by a few
+   bytes, the scan would otherwise search at each of them, each search
+   comparing the rest of the run: quadratic in its length.  Only the
+   last RUN_TAIL bytes of a run, where what follows it can make a
+   better match, are scanned; the bytes skipped are still scored
+   against the old alignment, which is how the run ends up matched. */
+static int diffscan(const matcher *m, const u_char *pold, long oldsize,
+	const u_char *pnew, long newsize, int runs, strout *d, strout *e,
+	ctrlbuf *cb)
+{
+	long scan, pos, len;
+	long lastscan, lastpos, lastoffset;
+	long oldscore, scsc;
+	long s, Sf, lenf, Sb, lenb;
+	long overlap, Ss, lens;
+	long i, runend, tail;
+	int rc;
+
+	scan = 0;len = 0;pos = 0;
+	lastscan = 0;lastpos = 0;lastoffset = 0;
+	runend = 0;
+	while (scan < newsize) {
+		oldscore = 0;
+
+		for (scsc = scan += len;scan < newsize;scan++) {
+			len = m->find(m->ix, pold, oldsize, pnew, newsize, scan, &pos);
+
+			for (;scsc < scan + len;scsc++)
+				if ((scsc + lastoffset < oldsize) &&
+					(pold[scsc + lastoffset] == pnew[scsc]))
+					oldscore++;
+
+			if (((len == oldscore) && (len != 0)) ||
+				(len > oldscore + 8)) break;
+
+			if ((scan + lastoffset < oldsize) &&
+				(pold[scan + lastoffset] == pnew[scan]))
+				oldscore--;
+
+			/* Find the run scan is in once, and go from its first
+			   offset to its tail */
+			if (!runs)
+				continue;
+			if (scan >= runend)
+				for (runend = scan + 1;(runend < newsize) &&
+					(pnew[runend] == pnew[scan]);runend++);
+			if ((tail = runend - RUN_TAIL) > scan + RUN_TAIL) {
+				for (;scsc < tail;scsc++)
+					if ((scsc + lastoffset < oldsize) &&
+						(pold[scsc + lastoffset] == pnew[scsc]))
+						oldscore++;
+				for (i = scan + 1;i < tail;i++)
+					if ((i + lastoffset < oldsize) &&
+						(pold[i + lastoffset] == pnew[i]))
+						oldscore--;
+				scan = tail - 1;
+			};
+		};
+
+		if ((len != oldscore) || (scan == newsize)) {
+			s = 0;Sf = 0;lenf = 0;
+			for (i = 0;(lastscan + i < scan) && (lastpos + i < oldsize);) {
+				if (pold[lastpos + i] == pnew[lastscan + i]) s++;
+				i++;
+				if (s * 2 - i > Sf * 2 - lenf) { Sf = s; lenf = i; };
+			};
+
+			lenb = 0;
+			if (scan < newsize) {
+				s = 0;Sb = 0;
+				for (i = 1;(scan >= lastscan + i) && (pos >= i);i++) {
+					if (pold[pos - i] == pnew[scan - i]) s++;
+					if (s * 2 - i > Sb * 2 - lenb) { Sb = s; lenb = i; };
+				};
+			};
+
+			if (lastscan + lenf > scan - lenb) {
+				overlap = (lastscan + lenf) - (scan - lenb);
+				s = 0;Ss = 0;lens = 0;
+				for (i = 0;i < overlap;i++) {
+					if (pnew[lastscan + lenf - overlap + i] ==
+						pold[lastpos + lenf - overlap + i]) s++;
+					if (pnew[scan - lenb + i] ==
+						pold[pos - lenb + i]) s--;
+					if (s > Ss) { Ss = s; lens = i + 1; };
+				};
+
+				lenf += lens - overlap;
+				lenb -= lens;
+			};
+
+			if (((rc = strput(d, pnew + lastscan, pold + lastpos, lenf)) !=
+				BSDIFF_OK) ||
+				((rc = strput(e, pnew + lastscan + lenf, NULL,
+				(scan - lenb) - (lastscan + lenf))) != BSDIFF_OK))
+				return rc;
+
+			if (ctrlbuf_push(cb, lenf,
+				(scan - lenb) - (lastscan + lenf),
+				(pos - lenb) - (lastpos + lenf)))
+				return BSDIFF_ENOMEM;
+
+			lastscan = scan - lenb;
+			lastpos = pos - lenb;
+			lastoffset = pos - scan;
+		};
+	};
+
+	return BSDIFF_OK;
+}
+
+/* The bytes the n at a and b start with in common.  They are compared
+   a block at a time with memcmp, which the C library does with vector
+   instructions, and only the block that differs byte by byte. */
+static long prefixlen(const u_char *a, const u_char *b, long n)
+{
+	long i;
+
+	for (i = 0;(n - i >= TRIM_BLOCK) &&
+		(memcmp(a + i, b + i, TRIM_BLOCK) == 0);i += TRIM_BLOCK);
+	while ((i < n) && (a[i] == b[i])) i++;
+
+	return i;
+}
+
+/* The bytes, up to n, that the asize at a and the bsize at b end with
+   in common, compared as prefixlen does */
+static long suffixlen(const u_char *a, long asize, const u_char *b,
+	long bsize, long n)
+{
+	long i;
+
+	for (i = 0;(n - i >= TRIM_BLOCK) &&
+		(memcmp(a + asize - i - TRIM_BLOCK, b + bsize - i - TRIM_BLOCK,
+		TRIM_BLOCK) == 0);i += TRIM_BLOCK);
+	while ((i < n) && (a[asize - 1 - i] == b[bsize - 1 - i])) i++;
+
+	return i;
+}
+
+void bsdiff_defaults(bsdiff_opts *opts)
+{
+	opts->legacy = 0;
+	opts->sha = 0;
+	opts->inplace = 0;
+	opts->scratch = INPLACE_DEFSCRATCH;
+	opts->hugepages = 0;
+	opts->maxmemory = 0;
+	opts->sparse = 1;
+	opts->fmindex = 0;
+	opts->indexfile = NULL;
+	opts->trim = 0;
+	opts->runs = 1;
+	opts->anchors = 0;
+	opts->window = 0;
+	opts->threads = 1;
+	opts->codecs[0] = opts->codecs[1] = opts->codecs[2] = CODEC_BZIP2;
+}
+
+bsdiff_ctx *bsdiff_new(void)
+{
+	bsdiff_ctx *ctx;
+
+	if ((ctx = (bsdiff_ctx *)malloc(sizeof(bsdiff_ctx))) != NULL) {
+		memset(ctx, 0, sizeof(bsdiff_ctx));
+		arena_init(&ctx->mem);
+		ctrlbuf_init(&ctx->cb);
+	};
+
+	return ctx;
+}
+
+void bsdiff_release(bsdiff_ctx *ctx)
+{
+	int i;
+
+	arena_free(&ctx->mem);
+	ctrlbuf_free(&ctx->cb);
+	free(ctx->memo);
+	ctx->memo = NULL;
+	ctx->memoalloc = 0;
+	free(ctx->anchors);
+	ctx->anchors = NULL;
+	free(ctx->join);
+	ctx->join = NULL;
+	ctx->joinalloc = 0;
+	for (i = 0;i < ctx->nwork;i++)
+		bsdiff_free(ctx->work[i]);
+	free(ctx->work);
+	ctx->work = NULL;
+	ctx->nwork = 0;
+	for (i = 0;i < 3;i++) {
+		free(ctx->blk[i].p);
+		ctx->blk[i].p = NULL;
+		ctx->blk[i].alloc = 0;
+	};
+}
+
+void bsdiff_free(bsdiff_ctx *ctx)
+{
+	if (ctx == NULL)
+		return;
+	bsdiff_release(ctx);
+	free(ctx);
+}
+
+/* The arena a diff takes, in two parts.  With a suffix array of n
+   suffixes, the first holds it and the second the rank array and then
+   the two string buffers.  With an FM-index of n bytes, the first holds
+   the rank array and then the index, and the second the suffix array
+   and the reversed data it is of and then the strings.  With apart set
+   the strings follow what the second holds for the sort instead, so
+   that indexes can be built again once they are begun; *strsp is where
+   in the second they start. */
+static size_t arenasize(long n, size_t strsize, int fm, int apart,
+	size_t *firstp, size_t *secondp, size_t *strsp)
+{
+	size_t isize, first, sort, strs;
+
+	/* One entry more than n for the empty suffix */
+	isize = ((size_t)n + 1) * sizeof(long);
+	strsize = 2 * arena_need(strsize);
+	if (fm) {
+		first = MAX(isize, fm_size(n));
+		sort = arena_need(isize) + n;
+	}
+	else {
+		first = isize;
+		sort = isize;
+	};
+	strs = apart ? arena_need(sort) : 0;
+	if (firstp != NULL) {
+		*firstp = first;
+		*secondp = MAX(sort, strs + strsize);
+		*strsp = strs;
+	};
+
+	return arena_need(first) + arena_need(MAX(sort, strs + strsize));
+}
+
+/* Carve the two parts of a diff's arena out, for an index of n
+   suffixes or bytes and strsize bytes for each string, apart as
+   arenasize has it.  With file set
+   the arena is that file, behind an index file header at *hdrp, and
+   is cut to the header and the suffix array when it is given back. */
+static int getbuffers(bsdiff_ctx *ctx, long n, long strsize, int fm,
+	int apart, int huge, const char *file, u_char **hdrp, u_char **firstp,
+	u_char **secondp)
+{
+	size_t first, second, strs, size;
+
+	size = arenasize(n, strsize, fm, apart, &first, &second, &strs);
+	*hdrp = NULL;
+	if (file != NULL) {
+		switch (arena_mapfile(&ctx->mem, file, IDXHDR + size, IDXMAGIC,
+			8)) {
+		case -1:
+			return BSDIFF_EINDEX;
+		case -2:
+			return BSDIFF_ENOTINDEX;
+		};
+		*hdrp = (u_char *)arena_alloc(&ctx->mem, IDXHDR);
+		arena_keep(&ctx->mem, IDXHDR + ((size_t)n + 1) * sizeof(long));
+	}
+	else if (arena_reserve(&ctx->mem, size, huge))
+		return BSDIFF_ENOMEM;
+
+	*firstp = (u_char *)arena_alloc(&ctx->mem, first);
+	*secondp = (u_char *)arena_alloc(&ctx->mem, second);
+	ctx->db = *secondp + strs;
+	ctx->eb = ctx->db + arena_need(strsize);
+
+	return BSDIFF_OK;
+}
+
+/* The header of an index file of a suffix array of every k-th byte of
+   pold: a magic, the size of a long, oldsize, k and pold's XXH64 */
+static void idxheader(u_char *h, const u_char *pold, long oldsize, long k)
+{
+	xxh64_state xs;
+	unsigned long long xh;
+	int i;
+
+	memset(h, 0, IDXHDR);
+	memcpy(h, IDXMAGIC, 8);
+	h[8] = (u_char)sizeof(long);
+	offtout(oldsize, h + 16);
+	offtout(k, h + 24);
+	xxh64_init(&xs);
+	xxh64_update(&xs, pold, oldsize);
+	xh = xxh64_final(&xs);
+	for (i = 0;i < 8;i++)
+		h[32 + i] = (u_char)(xh >> (i * 8));
+}
+
+/* Build the index plan picks of pold in the parts getbuffers carved,
+   unless sorted is set and the suffix array is there already, and
+   point m at it */
+static int buildindex(bsdiff_ctx *ctx, const bsdiff_plan *plan,
+	const u_char *pold, long oldsize, u_char *first, u_char *second,
+	int sorted, matcher *m)
+{
+	sufindex *x = &ctx->sx;
+	u_char *rev;
+	long *I;
+	long i;
+
+	if (plan->fm) {
+		I = (long *)second;
+		rev = second + arena_need(((size_t)oldsize + 1) * sizeof(long));
+		for (i = 0;i < oldsize;i++) rev[i] = pold[oldsize - 1 - i];
+		qsufsort(I, (long *)first, rev, oldsize);
+		fm_build(&ctx->fm, first, I, rev, oldsize);
+		m->find = fmfind;
+		m->ix = &ctx->fm;
+		return BSDIFF_OK;
+	};
+
+	x->k = plan->sparse;
+	x->n = SAMPLES(oldsize, x->k);
+	if (!sorted && (x->k > 1))
+		sparsesort((long *)first, (long *)second, pold, oldsize, x->k, x->n);
+	else if (!sorted)
+		qsufsort((long *)first, (long *)second, pold, oldsize);
+	x->I = (const long *)first;
+	if (x->k > ctx->memoalloc) {
+		free(ctx->memo);
+		ctx->memoalloc = 0;
+		if ((ctx->memo = (lookup *)malloc(x->k * sizeof(lookup))) == NULL)
+			return BSDIFF_ENOMEM;
+		ctx->memoalloc = x->k;
+	};
+	for (i = 0;i < x->k;i++) ctx->memo[i].at = -1;
+	x->memo = ctx->memo;
+	m->find = findmatch;
+	m->ix = x;
+
+	return BSDIFF_OK;
+}
+
+/* Make the old data's position after the triples in cb to, by adding
+   to the seek of the last one, or by a triple of its own if there are
+   none; *at is the position after the first *done of them, and both
+   are brought up to date */
+static int seekto(ctrlbuf *cb, long *done, long *at, long to)
+{
+	for (;*done < cb->count;(*done)++)
+		*at += cb->ctrl[*done * 3] + cb->ctrl[*done * 3 + 2];
+	if (*at == to)
+		return BSDIFF_OK;
+
+	if (cb->count == 0) {
+		if (ctrlbuf_push(cb, 0, 0, to - *at))
+			return BSDIFF_ENOMEM;
+		(*done)++;
+	}
+	else
+		cb->ctrl[(cb->count - 1) * 3 + 2] += to - *at;
+	*at = to;
+
+	return BSDIFF_OK;
+}
+
+/* The new data of the gap before the i-th of the na anchors at a, or
+   after the last if i is na, and the old data it is diffed against, in
+   *np pieces of two longs each at r: that between the anchors either
+   side, where that is in order and, unless spread is 0, at most spread
+   times the gap, and otherwise as much as the gap after the anchor
+   before and as much before the one after; with margin bytes more
+   either side */
+static long gapregion(const anchor *a, long na, long i, long oldsize,
+	long newsize, long spread, long margin, long r[4], int *np)
+{
+	long ns, ne, lo, hi;
+
+	ns = (i > 0) ? a[i - 1].newpos + a[i - 1].len : 0;
+	ne = (i < na) ? a[i].newpos : newsize;
+	lo = (i > 0) ? a[i - 1].oldpos + a[i - 1].len : 0;
+	hi = (i < na) ? a[i].oldpos : oldsize;
+	if ((lo <= hi) && ((spread == 0) || ((hi - lo) / spread <= ne - ns))) {
+		r[0] = MAX(lo - margin, 0);
+		r[1] = MIN(hi + margin, oldsize);
+		*np = 1;
+	}
+	else {
+		r[0] = MAX(lo - margin, 0);
+		r[1] = MIN(lo + (ne - ns) + margin, oldsize);
+		r[2] = MAX(hi - (ne - ns) - margin, 0);
+		r[3] = MIN(hi + margin, oldsize);
+		*np = 2;
+		/* Pieces that meet are one */
+		if ((r[1] >= r[2]) && (r[3] >= r[0])) {
+			r[0] = MIN(r[0], r[2]);r[1] = MAX(r[1], r[3]);
+			*np = 1;
+		};
+	};
+
+	return ne - ns;
+}
+
+/* The old data of the n pieces at r, as the scan is to see it, and in
+   *sizep how much: the one piece, or all of them copied together into
+   ctx->join; NULL if out of memory */
+static const u_char *gapdata(bsdiff_ctx *ctx, const u_char *pold,
+	const long *r, int n, long *sizep)
+{
+	long size;
+	int i;
+
+	for (size = 0, i = 0;i < n;i++) size += r[i * 2 + 1] - r[i * 2];
+	*sizep = size;
+	if (n == 1)
+		return pold + r[0];
+
+	if (size > ctx->joinalloc) {
+		free(ctx->join);
+		ctx->joinalloc = 0;
+		if ((ctx->join = (u_char *)malloc(size)) == NULL)
+			return NULL;
+		ctx->joinalloc = size;
+	};
+	for (size = 0, i = 0;i < n;i++) {
+		memcpy(ctx->join + size, pold + r[i * 2], r[i * 2 + 1] - r[i * 2]);
+		size += r[i * 2 + 1] - r[i * 2];
+	};
+
+	return ctx->join;
+}
+
+/* Make the triples in cb from the t-th on, from a scan of the n pieces
+   of old data at r copied together, seek in pold instead, splitting
+   any that run from one piece into the next; *done and *at are as
+   seekto has them, up to the t-th */
+static int unjoin(ctrlbuf *cb, long t, const long *r, int n, long *done,
+	long *at)
+{
+	long *tr;
+	long count, k, c, x, start;
+	int i, rc;
+
+	count = cb->count - t;
+	if ((tr = (long *)malloc((count * 3 + 1) * sizeof(long))) == NULL)
+		return BSDIFF_ENOMEM;
+	memcpy(tr, cb->ctrl + t * 3, count * 3 * sizeof(long));
+	cb->count = t;
+
+	/* c is where each triple's add starts in the pieces together, and
+	   piece i starts at start there */
+	rc = BSDIFF_OK;
+	for (c = 0, k = 0;(k < count) && (rc == BSDIFF_OK);k++) {
+		x = tr[k * 3];
+		if (x > 0) {
+			for (start = 0, i = 0;(i < n - 1) &&
+				(c >= start + r[i * 2 + 1] - r[i * 2]);i++)
+				start += r[i * 2 + 1] - r[i * 2];
+			rc = seekto(cb, done, at, r[i * 2] + (c - start));
+			for (;(rc == BSDIFF_OK) && (i < n - 1) &&
+				(c + x > start + r[i * 2 + 1] - r[i * 2]);i++) {
+				start += r[i * 2 + 1] - r[i * 2];
+				if (ctrlbuf_push(cb, start - c, 0, 0))
+					rc = BSDIFF_ENOMEM;
+				else
+					rc = seekto(cb, done, at, r[i * 2 + 2]);
+				x -= start - c;
+				c = start;
+			};
+		};
+		if ((rc == BSDIFF_OK) && ctrlbuf_push(cb, x, tr[k * 3 + 1], 0))
+			rc = BSDIFF_ENOMEM;
+		c += x + tr[k * 3 + 2];
+	};
+	free(tr);
+
+	return rc;
+}
+
+/* Diff pnew against pold with the na anchors at a each a triple of its
+   own, copying them whole, and the gaps between them diffscanned, with
+   runs as diffscan has it, against the old data gapregion gives them.
+   m is an index of that of the first gap already, made before the
+   strings were begun; those of the others are built over it as plan
+   has it, which needs the strings apart. */
+static int anchorscan(bsdiff_ctx *ctx, const bsdiff_plan *plan,
+	matcher *m, const anchor *a, long na, long spread, long margin,
+	const u_char *pold, long oldsize, const u_char *pnew, long newsize,
+	u_char *first, u_char *second, int runs, strout *d, strout *e,
+	ctrlbuf *cb)
+{
+	const u_char *base;
+	long i, ns, gap, r[4], size, t, done, at;
+	int rc, built, n;
+
+	done = 0;at = 0;built = 0;
+	for (i = 0;i <= na;i++) {
+		ns = (i > 0) ? a[i - 1].newpos + a[i - 1].len : 0;
+		gap = gapregion(a, na, i, oldsize, newsize, spread, margin, r, &n);
+		if (gap > 0) {
+			if ((base = gapdata(ctx, pold, r, n, &size)) == NULL)
+				return BSDIFF_ENOMEM;
+			if (built++ && ((rc = buildindex(ctx, plan, base, size, first,
+				second, 0, m)) != BSDIFF_OK))
+				return rc;
+			if ((rc = seekto(cb, &done, &at, r[0])) != BSDIFF_OK)
+				return rc;
+			t = cb->count;
+			if ((rc = diffscan(m, base, size, pnew + ns, gap, runs, d, e,
+				cb)) != BSDIFF_OK)
+				return rc;
+			if ((n > 1) &&
+				((rc = unjoin(cb, t, r, n, &done, &at)) != BSDIFF_OK))
+				return rc;
+		};
+		if (i == na)
+			break;
+
+		if ((rc = seekto(cb, &done, &at, a[i].oldpos)) != BSDIFF_OK)
+			return rc;
+		if ((rc = strput(d, pnew + a[i].newpos, pold + a[i].oldpos,
+			a[i].len)) != BSDIFF_OK)
+			return rc;
+		if (ctrlbuf_push(cb, a[i].len, 0, 0))
+			return BSDIFF_ENOMEM;
+	};
+
+	return BSDIFF_OK;
+}
+
+/* The offset into the old data of each new byte of an anchor */
+#define OFFSET(a)	((a).oldpos - (a).newpos)
+
+/* Add size bytes of the old data from start, moved to lie within it,
+   to the *np pieces at r, into one it meets if there is one */
+static void addpiece(long start, long size, long oldsize, long *r, int *np)
+{
+	long end;
+	int i;
+
+	start = MAX(MIN(start, oldsize - size), 0);
+	end = MIN(start + size, oldsize);
+	for (i = 0;i < *np;i++)
+		if ((r[i * 2 + 1] >= start) && (end >= r[i * 2])) {
+			r[i * 2] = MIN(r[i * 2], start);
+			r[i * 2 + 1] = MAX(r[i * 2 + 1], end);
+			return;
+		};
+	r[*np * 2] = start;
+	r[*np * 2 + 1] = end;
+	(*np)++;
+}
+
+/* A run of a window's anchors with offsets into the old data close
+   enough to be diffed against one piece of it: from lo to hi of the
+   new data, at offsets from off to offhi, with bytes in the anchors */
+typedef struct winvote {
+	long lo, hi, off, offhi, bytes;
+} winvote;
+
+static int bybytes(const void *x, const void *y)
+{
+	const winvote *v = (const winvote *)x, *w = (const winvote *)y;
+
+	return (v->bytes < w->bytes) - (v->bytes > w->bytes);
+}
+
+/* The old data the window ws to we of the new data is diffed against,
+   in pieces at r as gapdata takes them; returns how many, or -1 if out
+   of memory.  The window is cut into runs of anchors whose offsets are
+   less than a sixteenth of the window apart, each with the bytes up to
+   the next, and the bytes before the first at the offset of the anchor
+   before the window.  The old data of the WINDOW_PIECES runs with the
+   most bytes in anchors is taken as far as it fits in WINDOW_OLD, and
+   what is left over is shared between them as margins either side.  A
+   window without anchors is at the offset of the nearest, before it or
+   else after, or if there are none where it falls in proportion. */
+static int windowregion(const anchor *a, long na, long ws, long we,
+	long oldsize, long newsize, long *r)
+{
+	winvote *v;
+	long lo, hi, mid, i, k, m, c, o, last, need, used, budget, margin;
+	int n;
+
+	/* The first anchor to end after ws */
+	for (lo = 0, hi = na;lo < hi;) {
+		mid = lo + (hi - lo) / 2;
+		if (a[mid].newpos + a[mid].len <= ws)
+			lo = mid + 1;
+		else
+			hi = mid;
+	};
+	for (m = 0;(lo + m < na) && (a[lo + m].newpos < we);m++);
+
+	n = 0;
+	budget = WINDOW_OLD(we - ws);
+	if (m == 0) {
+		if (lo > 0)
+			o = OFFSET(a[lo - 1]);
+		else if (lo < na)
+			o = OFFSET(a[lo]);
+		else
+			o = (long)((double)ws * oldsize / newsize) - ws;
+		margin = (budget - (we - ws)) / 2;
+		addpiece(ws + o - margin, budget, oldsize, r, &n);
+		return n;
+	};
+
+	if ((v = (winvote *)malloc((m + 1) * sizeof(winvote))) == NULL)
+		return -1;
+	/* Bytes before the first anchor carry on from the one before */
+	k = 0;last = 0;
+	if ((lo > 0) && (a[lo].newpos > ws)) {
+		v[0].lo = ws;
+		v[0].off = v[0].offhi = last = OFFSET(a[lo - 1]);
+		v[0].bytes = a[lo].newpos - ws;
+		k = 1;
+	};
+	for (i = lo;i < lo + m;i++) {
+		o = OFFSET(a[i]);
+		if ((k > 0) && (labs(o - last) <= (we - ws) / 16)) {
+			v[k - 1].off = MIN(v[k - 1].off, o);
+			v[k - 1].offhi = MAX(v[k - 1].offhi, o);
+		}
+		else {
+			if (k > 0)
+				v[k - 1].hi = MAX(a[i].newpos, ws);
+			v[k].lo = (k > 0) ? MAX(a[i].newpos, ws) : ws;
+			v[k].off = v[k].offhi = o;
+			v[k].bytes = 0;
+			k++;
+		};
+		v[k - 1].bytes += MIN(a[i].newpos + a[i].len, we) -
+			MAX(a[i].newpos, ws);
+		last = o;
+	};
+	v[k - 1].hi = we;
+	qsort(v, k, sizeof(winvote), bybytes);
+
+	/* The most voted for is taken even if it has to be cut short */
+	for (c = 0, used = 0, i = 0;(i < k) && (c < WINDOW_PIECES);i++) {
+		need = (v[i].hi - v[i].lo) + (v[i].offhi - v[i].off);
+		if (c == 0) {
+			need = MIN(need, budget);
+			v[i].offhi = MIN(v[i].offhi, v[i].off + need);
+			v[i].hi = v[i].lo + need - (v[i].offhi - v[i].off);
+		}
+		else if (used + need > budget)
+			continue;
+		v[c++] = v[i];
+		used += need;
+	};
+	margin = (budget - used) / (2 * c);
+	for (i = 0;i < c;i++)
+		addpiece(v[i].lo + v[i].off - margin, (v[i].hi - v[i].lo) +
+			(v[i].offhi - v[i].off) + 2 * margin, oldsize, r, &n);
+	free(v);
+
+	return n;
+}
+
+/* A window's diff, made on any thread and merged into the patch in
+   order: its strings, and its triples, from r[0] in the old data */
+typedef struct winpiece {
+	long r[WINDOW_PIECES * 2];	/* its old data (see windowregion) */
+	u_char *db, *eb;
+	long dlen, elen;
+	ctrlbuf cb;
+	int ready, rc;
+} winpiece;
+
+/* The windows of one diff, as the threads take them and the calling
+   thread merges them; each of slots pieces is for every slots-th
+   window, so that the threads go no further ahead than that */
+typedef struct winjob {
+	const bsdiff_opts *opts;
+	const bsdiff_plan *plan;
+	const u_char *pold, *pnew;
+	long oldsize, newsize;
+	const anchor *a;
+	long na;
+	long size, count;		/* bytes in each window, and windows */
+	winpiece *p;
+	long slots;
+	mutex m;
+	cond c;
+	long next, merged;		/* windows taken, and merged */
+	int rc;				/* the first failure */
+} winjob;
+
+typedef struct winthread {
+	winjob *j;
+	bsdiff_ctx *ctx;		/* its index and the old data joined */
+	thread t;
+} winthread;
+
+/* Diff the k-th window of j into p, with the index and buffers of wc */
+static int diffwindow(winjob *j, bsdiff_ctx *wc, long k, winpiece *p)
+{
+	const u_char *base;
+	u_char *hdr, *first, *second;
+	matcher m;
+	strout d, e;
+	long ws, we, size, done, at;
+	int rc, n;
+
+	ws = k * j->size;
+	we = MIN(ws + j->size, j->newsize);
+	if ((n = windowregion(j->a, j->na, ws, we, j->oldsize, j->newsize,
+		p->r)) < 0)
+		return BSDIFF_ENOMEM;
+	if ((base = gapdata(wc, j->pold, p->r, n, &size)) == NULL)
+		return BSDIFF_ENOMEM;
+
+	/* The strings are the piece's, so wc's arena is only the index */
+	if ((rc = getbuffers(wc, j->plan->fm ? size : SAMPLES(size,
+		j->plan->sparse), 1, j->plan->fm, 0, j->opts->hugepages, NULL,
+		&hdr, &first, &second)) != BSDIFF_OK)
+		return rc;
+	if ((rc = buildindex(wc, j->plan, base, size, first, second, 0,
+		&m)) != BSDIFF_OK)
+		return rc;
+
+	d.buf = p->db;
+	e.buf = p->eb;
+	d.size = e.size = j->size + 1;
+	d.fill = e.fill = 0;
+	d.len = e.len = 0;
+	d.m = e.m = NULL;
+	p->cb.count = 0;
+	if ((rc = diffscan(&m, base, size, j->pnew + ws, we - ws,
+		j->opts->runs, &d, &e, &p->cb)) != BSDIFF_OK)
+		return rc;
+	done = 0;at = p->r[0];
+	if ((n > 1) &&
+		((rc = unjoin(&p->cb, 0, p->r, n, &done, &at)) != BSDIFF_OK))
+		return rc;
+	p->dlen = d.len;
+	p->elen = e.len;
+
+	return BSDIFF_OK;
+}
+
+/* A thread diffing windows, in the order they come, until there are
+   no more or one has failed */
+static void winrun(void *arg)
+{
+	winthread *w = (winthread *)arg;
+	winjob *j = w->j;
+	winpiece *p;
+	long k;
+	int rc;
+
+	for (;;) {
+		mutex_lock(&j->m);
+		while ((j->rc == BSDIFF_OK) && (j->next < j->count) &&
+			(j->next >= j->merged + j->slots))
+			cond_wait(&j->c, &j->m);
+		if ((j->rc != BSDIFF_OK) || (j->next >= j->count)) {
+			mutex_unlock(&j->m);
+			return;
+		};
+		k = j->next++;
+		mutex_unlock(&j->m);
+
+		p = &j->p[k % j->slots];
+		rc = diffwindow(j, w->ctx, k, p);
+
+		mutex_lock(&j->m);
+		p->rc = rc;
+		p->ready = 1;
+		if ((rc != BSDIFF_OK) && (j->rc == BSDIFF_OK))
+			j->rc = rc;
+		cond_broadcast(&j->c);
+		mutex_unlock(&j->m);
+	};
+}
+
+/* Put a window's diff into the patch after those before it */
+static int winmerge(const winpiece *p, strout *d, strout *e, ctrlbuf *cb,
+	long *done, long *at)
+{
+	long i;
+	int rc;
+
+	if (((rc = seekto(cb, done, at, p->r[0])) != BSDIFF_OK) ||
+		((rc = strput(d, p->db, NULL, p->dlen)) != BSDIFF_OK) ||
+		((rc = strput(e, p->eb, NULL, p->elen)) != BSDIFF_OK))
+		return rc;
+	for (i = 0;i < p->cb.count;i++)
+		if (ctrlbuf_push(cb, p->cb.ctrl[i * 3], p->cb.ctrl[i * 3 + 1],
+			p->cb.ctrl[i * 3 + 2]))
+			return BSDIFF_ENOMEM;
+
+	return BSDIFF_OK;
+}
+
+/* Diff pnew against pold a window at a time, placed by the na anchors
+   at a, with plan.threads threads diffing windows while this one merges
+   them into d, e and cb; if no thread can be started, this one diffs
+   each window before merging it */
+static int windowscan(bsdiff_ctx *ctx, const bsdiff_opts *opts,
+	const bsdiff_plan *plan, const anchor *a, long na, const u_char *pold,
+	long oldsize, const u_char *pnew, long newsize, strout *d, strout *e,
+	ctrlbuf *cb)
+{
+	winjob j;
+	winthread *w;
+	winpiece *p;
+	bsdiff_ctx **work;
+	long i, k, done, at;
+	int rc, started;
+
+	/* A context of its own for each thread, kept for the next diff */
+	if (plan->threads > ctx->nwork) {
+		if ((work = (bsdiff_ctx **)realloc(ctx->work, plan->threads *
+			sizeof(bsdiff_ctx *))) == NULL)
+			return BSDIFF_ENOMEM;
+		ctx->work = work;
+		for (;ctx->nwork < plan->threads;ctx->nwork++)
+			if ((ctx->work[ctx->nwork] = bsdiff_new()) == NULL)
+				return BSDIFF_ENOMEM;
+	};
+
+	j.opts = opts;
+	j.plan = plan;
+	j.pold = pold;
+	j.oldsize = oldsize;
+	j.pnew = pnew;
+	j.newsize = newsize;
+	j.a = a;
+	j.na = na;
+	j.size = plan->window;
+	j.count = (newsize + j.size - 1) / j.size;
+	j.slots = 2 * plan->threads;
+	j.next = j.merged = 0;
+	j.rc = BSDIFF_OK;
+	w = (winthread *)malloc(plan->threads * sizeof(winthread));
+	if ((j.p = (winpiece *)calloc(j.slots, sizeof(winpiece))) == NULL) {
+		free(w);
+		return BSDIFF_ENOMEM;
+	};
+	for (rc = BSDIFF_OK, i = 0;i < j.slots;i++) {
+		ctrlbuf_init(&j.p[i].cb);
+		if ((j.p[i].db = (u_char *)malloc(2 * (j.size + 1))) == NULL)
+			rc = BSDIFF_ENOMEM;
+		j.p[i].eb = j.p[i].db + j.size + 1;
+	};
+	mutex_init(&j.m);
+	cond_init(&j.c);
+
+	started = 0;
+	if ((w != NULL) && (rc == BSDIFF_OK) && (plan->threads > 1))
+		for (;started < plan->threads;started++) {
+			w[started].j = &j;
+			w[started].ctx = ctx->work[started];
+			if (thread_start(&w[started].t, winrun, &w[started]))
+				break;
+		};
+
+	done = 0;at = 0;
+	for (k = 0;(k < j.count) && (rc == BSDIFF_OK);k++) {
+		p = &j.p[k % j.slots];
+		if (started == 0)
+			rc = diffwindow(&j, ctx->work[0], k, p);
+		else {
+			mutex_lock(&j.m);
+			while (!p->ready && (j.rc == BSDIFF_OK))
+				cond_wait(&j.c, &j.m);
+			rc = p->ready ? p->rc : j.rc;
+			mutex_unlock(&j.m);
+		};
+		if (rc == BSDIFF_OK)
+			rc = winmerge(p, d, e, cb, &done, &at);
+
+		/* Free its piece for the window slots on */
+		mutex_lock(&j.m);
+		p->ready = 0;
+		j.merged++;
+		if ((rc != BSDIFF_OK) && (j.rc == BSDIFF_OK))
+			j.rc = rc;
+		cond_broadcast(&j.c);
+		mutex_unlock(&j.m);
+	};
+	for (i = 0;i < started;i++)
+		thread_join(&w[i].t);
+
+	mutex_destroy(&j.m);
+	cond_destroy(&j.c);
+	for (i = 0;i < j.slots;i++) {
+		ctrlbuf_free(&j.p[i].cb);
+		free(j.p[i].db);
+	};
+	free(j.p);
+	free(w);
+
+	return rc;
+}
+
+/* What the encoders of o's codecs take for blocks of up to len bytes:
+   those of the diff and extra strings at once if they are streamed,
+   and otherwise one after the other, as the ctrl block's always is */
+static size_t codecmemory(const bsdiff_opts *o, long oldsize, long len,
+	int stream)
+{
+	const codec *c;
+	size_t m[3];
+	int i;
+
+	for (i = 0;i < 3;i++) {
+		m[i] = 0;
+		if ((c = codec_find(o->codecs[i])) != NULL)
+			m[i] = c->wmemory(blocklevel(c, len), len,
+				(c->setdict != NULL) ? oldsize : 0);
+	};
+	if (stream)
+		return MAX(m[0], m[1] + m[2]);
+
+	return MAX(m[0], MAX(m[1], m[2]));
+}
+
+/* What the diff takes with the strings streamed or not and a suffix
+   array of every k-th byte, or an FM-index, of all the old data or of
+   that of a window on each of threads threads */
+static size_t planmemory(const bsdiff_opts *o, long oldsize, long newsize,
+	int stream, long k, int fm, long window, int threads)
+{
+	size_t n, strsize;
+	long old;
+
+	/* A byte more than newsize for each string so that none is empty;
+	   an index file's arena is the system's to page, as the mapped
+	   inputs are */
+	n = 0;
+	strsize = stream ? STRCHUNK : (size_t)newsize + 1;
+	if (window > 0) {
+		/* Each thread indexes a window's old data, which it may have
+		   joined from its pieces, and the strings of two windows wait
+		   to be merged for each */
+		old = MIN(WINDOW_OLD(window), oldsize);
+		n = arenasize(0, strsize, 0, 0, NULL, NULL, NULL) +
+			threads * (arenasize(fm ? old : SAMPLES(old, k), 1, fm, 0, NULL,
+			NULL, NULL) + old + 4 * ((size_t)window + 1));
+	}
+	else if (o->indexfile == NULL)
+		n = arenasize(fm ? oldsize : SAMPLES(oldsize, k), strsize, fm,
+			o->anchors, NULL, NULL, NULL);
+	n += codecmemory(o, oldsize, newsize, stream) + PLAN_CTRL(newsize) +
+		PLAN_PATCH(newsize);
+
+	/* Reordering for in-place patching copies the strings */
+	if (o->inplace)
+		n += 2 * (size_t)newsize;
+
+	/* A gap's two pieces of old data are copied together */
+	if (o->anchors && (window == 0))
+		n += (size_t)oldsize;
+
+	return n;
+}
+
+/* Set plan's memory and slowdown from its other fields */
+static void plancost(const bsdiff_opts *o, long oldsize, long newsize,
+	bsdiff_plan *plan)
+{
+	plan->memory = planmemory(o, oldsize, newsize, plan->stream,
+		plan->sparse, plan->fm, plan->window, plan->threads);
+	/* A sparse index sorts faster than a full one, and its scan keeps
+	   the k lookups each offset needs, so it costs time only on odd
+	   data; what it costs is the matches it cannot find.  An FM-index
+	   finds the same matches, but each byte of a lookup is a scan of
+	   part of a block of its counts.  Fewer threads than asked for
+	   take longer by as much. */
+	plan->slowdown = plan->fm ? FM_SLOWDOWN : 1.0;
+	if (plan->window > 0)
+		plan->slowdown *= (double)MAX(o->threads, 1) / plan->threads;
+}
+
+int bsdiff_getplan(const bsdiff_opts *opts, long oldsize, long newsize,
+	bsdiff_plan *plan)
+{
+	plan->stream = 0;
+	plan->sparse = (opts->sparse > 1) ? opts->sparse : 1;
+	plan->fm = opts->fmindex;
+	plan->ondisk = (opts->indexfile != NULL);
+	plan->window = 0;
+	plan->threads = 1;
+	if (opts->window > 0) {
+		plan->window = MAX(MIN(opts->window, newsize), 1);
+		plan->threads = MAX(opts->threads, 1);
+	};
+	plancost(opts, oldsize, newsize, plan);
+	if ((opts->maxmemory == 0) || (plan->memory <= opts->maxmemory))
+		return BSDIFF_OK;
+
+	/* Compress the strings as they are made rather than hold them;
+	   in-place patches need them whole to reorder */
+	if (!opts->inplace) {
+		plan->stream = 1;
+		plancost(opts, oldsize, newsize, plan);
+		if (plan->memory <= opts->maxmemory)
+			return BSDIFF_OK;
+	};
+
+	/* Diff fewer windows at once */
+	while (plan->threads > 1) {
+		plan->threads /= 2;
+		plancost(opts, oldsize, newsize, plan);
+		if (plan->memory <= opts->maxmemory)
+			return BSDIFF_OK;
+	};
+
+	/* Strings held whole can have the space of the suffix array if an
+	   FM-index is kept instead; its sort takes as much as ever */
+	if (!plan->fm && (plan->sparse == 1)) {
+		plan->fm = 1;
+		plancost(opts, oldsize, newsize, plan);
+		if (plan->memory <= opts->maxmemory)
+			return BSDIFF_OK;
+		plan->fm = 0;
+		plancost(opts, oldsize, newsize, plan);
+	};
+
+	/* Then index fewer and fewer of the old data's suffixes */
+	while (!plan->fm && (plan->sparse < PLAN_MAXSPARSE)) {
+		plan->sparse *= 2;
+		plancost(opts, oldsize, newsize, plan);
+		if (plan->memory <= opts->maxmemory)
+			return BSDIFF_OK;
+	};
+
+	return BSDIFF_EBUDGET;
+}
+
+void bsdiff_plantext(const bsdiff_plan *plan, char *buf, size_t len)
+{
+	char index[64], window[64];
+
+	if (plan->ondisk)
+		snprintf(index, sizeof(index), "suffix array in the index file");
+	else if (plan->fm)
+		snprintf(index, sizeof(index), "FM-index");
+	else if (plan->sparse > 1)
+		snprintf(index, sizeof(index), "suffix array sampled every %ld bytes",
+			plan->sparse);
+	else
+		snprintf(index, sizeof(index), "suffix array in memory");
+	window[0] = 0;
+	if (plan->window > 0)
+		snprintf(window, sizeof(window), " per %ld KB window on %d %s",
+			(plan->window + 1023) / 1024, plan->threads,
+			(plan->threads > 1) ? "threads" : "thread");
+	snprintf(buf, len, "%s%s, diff and extra strings %s; "
+		"about %.0f MB, %.1fx the time of an unlimited diff", index, window,
+		plan->stream ? "compressed as they are made" : "held whole",
+		(double)plan->memory / (1 << 20), plan->slowdown);
+}
+
+/* Returns 1 if o describes a patch that can be written */
+static int checkopts(const bsdiff_opts *o)
+{
+	const codec *c;
+	int i;
+
+	for (i = 0;i < 3;i++) {
+		if ((c = codec_find(o->codecs[i])) == NULL)
+			return 0;
+		if (o->legacy && (c->id != CODEC_BZIP2))
+			return 0;
+		/* The old file a dictionary codec needs is gone by the time
+		   an in-place patch is decoded */
+		if (o->inplace && (i > 0) && (c->setdict != NULL))
+			return 0;
+	};
+
+	return !(o->legacy && (o->sha || o->inplace)) && (o->scratch >= 0) &&
+		(o->sparse >= 0) && !(o->fmindex && (o->sparse > 1)) &&
+		!((o->fmindex || o->anchors) && (o->indexfile != NULL)) &&
+		(o->window >= 0) && !((o->window > 0) && (o->indexfile != NULL));
+}
+
+int bsdiff_diff(bsdiff_ctx *ctx, const void *old, long oldsize,
+	const void *new, long newsize, const bsdiff_opts *opts,
+	int (*write)(void *arg, const void *buf, long len), void *arg,
+	bsdiff_stats *st)
+{
+	const u_char *pold = (const u_char *)old;
+	const u_char *pnew = (const u_char *)new;
+	bsdiff_opts defaults;
+	bsdiff_plan plan;
+	matcher m;
+	strout d, e;
+	u_char *first, *second, *hdr, want[IDXHDR];
+	long dblen, eblen, patchsize;
+	ctrlbuf cmd;
+	u_char *ndb, *neb;
+	inplace_stats is;
+	anchor two[2], *a;
+	const u_char *base;
+	long na, spread, margin, pre, suf, i, r[4], r0[4], span, size0;
+	int rc, sorted, n, n0;
+
+	if (opts == NULL) {
+		bsdiff_defaults(&defaults);
+		opts = &defaults;
+	};
+	if (!checkopts(opts))
+		return BSDIFF_EOPTION;
+
+	/* Anchor what content-defined chunks find, or with trimming the
+	   start and end the two share, but for a margin, so that only the
+	   gaps between are indexed and scanned; windows are placed by the
+	   anchors instead, with seeds found between them */
+	a = two;na = 0;spread = 0;margin = 0;
+	if (opts->anchors || (opts->window > 0)) {
+		free(ctx->anchors);
+		if ((na = anchor_find(pold, oldsize, pnew, newsize,
+			&ctx->anchors)) < 0)
+			return BSDIFF_ENOMEM;
+		if ((opts->window > 0) && ((na = anchor_seed(pold, oldsize, pnew,
+			newsize, &ctx->anchors, na)) < 0))
+			return BSDIFF_ENOMEM;
+		a = ctx->anchors;
+		spread = ANCHOR_SPREAD;
+		margin = ANCHOR_MARGIN;
+	}
+	else if (opts->trim) {
+		pre = prefixlen(pold, pnew, MIN(oldsize, newsize));
+		suf = suffixlen(pold, oldsize, pnew, newsize,
+			MIN(oldsize, newsize) - pre);
+		pre = MAX(pre - TRIM_MARGIN, 0);
+		suf = MAX(suf - TRIM_MARGIN, 0);
+		if (pre > 0) {
+			a[na].newpos = a[na].oldpos = 0;
+			a[na++].len = pre;
+		};
+		if (suf > 0) {
+			a[na].newpos = newsize - suf;
+			a[na].oldpos = oldsize - suf;
+			a[na++].len = suf;
+		};
+	};
+
+	/* The plan is for the most old data a gap is diffed against, and
+	   the first gap's is indexed before the strings are begun; windows
+	   are indexed as they are diffed */
+	span = (opts->window > 0) ? oldsize : 0;size0 = -1;n0 = 1;base = NULL;
+	for (i = na;(i >= 0) && (opts->window == 0);i--) {
+		if (gapregion(a, na, i, oldsize, newsize, spread, margin, r,
+			&n) == 0)
+			continue;
+		size0 = (n > 1) ? (r[1] - r[0]) + (r[3] - r[2]) : r[1] - r[0];
+		span = MAX(span, size0);
+		memcpy(r0, r, sizeof(r));
+		n0 = n;
+	};
+	if ((size0 >= 0) && ((base = gapdata(ctx, pold, r0, n0, &size0)) ==
+		NULL))
+		return BSDIFF_ENOMEM;
+
+	if ((rc = bsdiff_getplan(opts, span, newsize, &plan)) != BSDIFF_OK)
+		return rc;
+
+	if ((rc = getbuffers(ctx, (plan.window > 0) ? 0 : plan.fm ? span :
+		SAMPLES(span, plan.sparse), plan.stream ? STRCHUNK : newsize + 1,
+		plan.fm, opts->anchors, opts->hugepages, opts->indexfile, &hdr,
+		&first, &second)) != BSDIFF_OK)
+		return rc;
+
+	/* An index file of this old data is used as it is; any other is
+	   marked unfinished until the sort is done, but kept ours */
+	sorted = 0;
+	if ((opts->indexfile != NULL) && (base != NULL)) {
+		idxheader(want, base, size0, plan.sparse);
+		if (!(sorted = (memcmp(hdr, want, IDXHDR) == 0))) {
+			memset(hdr, 0, IDXHDR);
+			memcpy(hdr, IDXMAGIC, 8);
+		};
+	};
+	if ((base != NULL) && ((rc = buildindex(ctx, &plan, base, size0,
+		first, second, sorted, &m)) != BSDIFF_OK))
+		return rc;
+	if ((opts->indexfile != NULL) && (base != NULL))
+		memcpy(hdr, want, IDXHDR);
+
+	/* Compute the differences, collecting ctrl as we go */
+	d.buf = ctx->db;
+	e.buf = ctx->eb;
+	d.size = e.size = plan.stream ? STRCHUNK : newsize + 1;
+	d.fill = e.fill = 0;
+	d.len = e.len = 0;
+	d.m = e.m = NULL;
+	if (plan.stream) {
+		if ((rc = blockopen(&ctx->blk[1], codec_find(opts->codecs[1]),
+			newsize, pold, oldsize)) != BSDIFF_OK)
+			return rc;
+		if ((rc = blockopen(&ctx->blk[2], codec_find(opts->codecs[2]),
+			newsize, pold, oldsize)) != BSDIFF_OK)
+			return blockclose(&ctx->blk[1], rc);
+		d.m = &ctx->blk[1];
+		e.m = &ctx->blk[2];
+	};
+	ctx->cb.count = 0;
+	if (plan.window > 0)
+		rc = windowscan(ctx, opts, &plan, a, na, pold, oldsize, pnew,
+			newsize, &d, &e, &ctx->cb);
+	else
+		rc = anchorscan(ctx, &plan, &m, a, na, spread, margin, pold,
+			oldsize, pnew, newsize, first, second, opts->runs, &d, &e,
+			&ctx->cb);
+	if (plan.stream) {
+		if (rc == BSDIFF_OK)
+			rc = strflush(&d);
+		if (rc == BSDIFF_OK)
+			rc = strflush(&e);
+		rc = blockclose(&ctx->blk[1], rc);
+		rc = blockclose(&ctx->blk[2], rc);
+	};
+	if (rc != BSDIFF_OK)
+		return rc;
+	dblen = d.len;
+	eblen = e.len;
+
+	/* Write the patch, with the triples reordered into commands that
+	   can run over pold if asked for */
+	is.converted = 0;
+	if (!opts->inplace)
+		rc = writepatch(ctx, opts, &ctx->cb, plan.stream ? NULL : ctx->db,
+			dblen, ctx->eb, eblen, pold, oldsize, pnew, newsize, write, arg,
+			&patchsize);
+	else {
+		if (inplace_plan(&ctx->cb, ctx->db, ctx->eb, pold, oldsize, newsize,
+			opts->scratch, &cmd, &ndb, &dblen, &neb, &eblen, &is))
+			return BSDIFF_ENOMEM;
+		rc = writepatch(ctx, opts, &cmd, ndb, dblen, neb, eblen,
+			pold, oldsize, pnew, newsize, write, arg, &patchsize);
+		ctrlbuf_free(&cmd);
+		free(ndb);
+		free(neb);
+	};
+
+	if ((rc == BSDIFF_OK) && (st != NULL)) {
+		st->patchsize = patchsize;
+		st->converted = is.converted;
+	};
+	return rc;
+}
+
+const char *bsdiff_strerror(int rc)
+{
+	switch (rc) {
+	case BSDIFF_OK: return "no error";
+	case BSDIFF_ENOMEM: return "out of memory";
+	case BSDIFF_EOPTION: return "unsupported codec or options";
+	case BSDIFF_ECODEC: return "compression failed";
+	case BSDIFF_EWRITE: return "write failed";
+	case BSDIFF_EBUDGET: return "no plan fits the memory limit";
+	case BSDIFF_EINDEX: return "cannot map the index file";
+	case BSDIFF_ENOTINDEX: return "the index file is not a bsdiff index";
+	};
+
+	return "unknown error";
+}
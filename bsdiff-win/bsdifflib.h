@@ -0,0 +1,152 @@
+#pragma once
+/*
+ * bsdiff as a library, for programs that diff data they already hold.
+ *
+ * The old and new data are spans of memory, and the patch is handed to
+ * a write callback in order, header first.  Nothing here exits or
+ * prints; every failure comes back as one of the codes below.  A
+ * context keeps the suffix array and the other buffers of one diff for
+ * the next, in a single region of memory that is only mapped again
+ * when a diff needs more, so a program making many patches should keep
+ * one per thread.  Contexts share nothing, and may be used on different
+ * threads at once.
+ *
+ * bsdiff.exe and the DLL's bsdiff() are both built on bsdiff_diff.
+ */
+
+#define BSDIFF_OK		0
+#define BSDIFF_ENOMEM		-1
+#define BSDIFF_EOPTION		-2	/* a codec not built in, or options */
+					/* that do not go together */
+#define BSDIFF_ECODEC		-3	/* a codec failed */
+#define BSDIFF_EWRITE		-4	/* the write callback failed */
+#define BSDIFF_EBUDGET		-5	/* nothing fits opts.maxmemory */
+#define BSDIFF_EINDEX		-6	/* opts.indexfile cannot be mapped */
+#define BSDIFF_ENOTINDEX	-7	/* opts.indexfile holds something else */
+
+#include <stddef.h>
+
+/* The functions below are exported from the DLL; a program calling it
+   through its import library defines BSDIFF_DLL to import them */
+#ifndef _WIN32
+#define BSDIFF_API
+#elif defined(BSDIFF_DLL)
+#define BSDIFF_API	__declspec(dllimport)
+#else
+#define BSDIFF_API	__declspec(dllexport)
+#endif
+
+/* What to write; bsdiff_defaults gives a BSDIFF41 patch with XXH64
+   hashes and bzip2 for all three blocks, with runs skipped */
+typedef struct bsdiff_opts {
+	int legacy;		/* BSDIFF40, for older bspatch builds; bzip2 only */
+	int sha;		/* add SHA-256 hashes */
+	int inplace;		/* commands bspatch --in-place can run */
+	long scratch;		/* the scratch bytes those may use */
+	int hugepages;		/* ask for large pages for the suffix array */
+	size_t maxmemory;	/* bytes the diff may take, 0 for no limit */
+	long sparse;		/* index only every sparse-th suffix of the */
+				/* old data; 1 for all of them */
+	int fmindex;		/* find matches with an FM-index of the old */
+				/* data rather than its suffix array */
+	const char *indexfile;	/* keep the suffix array in this file, */
+				/* or reuse it from there; see below */
+	int trim;		/* index and scan only what lies between */
+				/* the start and end old and new share */
+	int runs;		/* skip over long runs of one byte in the */
+				/* new data rather than scan each offset */
+	int anchors;		/* copy chunks found whole in the old data */
+				/* and index and scan only the gaps between */
+				/* them, each against the old data near it; */
+				/* trim is then implied */
+	long window;		/* diff the new data this many bytes at a */
+				/* time, each against old data of its own; */
+				/* 0 for all at once; see below */
+	int threads;		/* windows diffed at once */
+	int codecs[3];		/* ctrl, diff and extra (CODEC_* in codec.h) */
+} bsdiff_opts;
+
+/* What a diff came to */
+typedef struct bsdiff_stats {
+	long patchsize;		/* bytes written */
+	long converted;		/* in-place copy bytes stored as literals */
+} bsdiff_stats;
+
+/* How a diff is done to stay within opts.maxmemory.  The memory
+   counted is what the diff allocates, not the caller's old and new
+   data; the cheapest plan that fits is picked, streaming the strings
+   first, then keeping an FM-index instead of the suffix array, and
+   then indexing sparser and sparser suffix arrays, from opts.sparse
+   up.  The encoders are counted as their codecs say, bzip2's with a
+   block no larger than the data needs.  The width of the suffix
+   array's entries is not chosen: they are longs, 4 bytes on Windows,
+   as narrow as old data of up to 2 GB allows. */
+typedef struct bsdiff_plan {
+	size_t memory;		/* bytes it is expected to take */
+	int stream;		/* compress the diff and extra strings as */
+				/* they are made instead of holding them */
+	long sparse;		/* the spacing of the suffixes indexed */
+	int fm;			/* an FM-index instead */
+	int ondisk;		/* the suffix array in opts.indexfile */
+	long window;		/* an index per window of this many bytes, */
+	int threads;		/* on this many threads */
+	double slowdown;	/* expected time over a diff with no limit */
+} bsdiff_plan;
+
+typedef struct bsdiff_ctx bsdiff_ctx;
+
+BSDIFF_API void bsdiff_defaults(bsdiff_opts *opts);
+
+/* Returns NULL if out of memory */
+BSDIFF_API bsdiff_ctx *bsdiff_new(void);
+BSDIFF_API void bsdiff_free(bsdiff_ctx *ctx);
+
+/* Give back the memory ctx keeps between diffs, two longs or more per
+   byte indexed of the largest old data diffed; ctx can still be used,
+   and maps it again on the next diff */
+BSDIFF_API void bsdiff_release(bsdiff_ctx *ctx);
+
+/* Write a patch from the oldsize bytes at pold to the newsize bytes at
+   pnew through write, which returns nonzero to stop; opts may be NULL
+   for the defaults, and st, if not NULL, is filled in on success.
+
+   With opts.indexfile set, the suffix array and the diff's other
+   buffers are a shared mapping of that file rather than memory, so
+   that the suffix array can be kept: when ctx is released or makes its
+   next diff the file is cut to a header and the suffix array, and a
+   later diff of the same old data, with the same opts.sparse, maps
+   that instead of sorting again.  The sort itself is the in-memory
+   one, paged to the file at random, so this is not for old data much
+   larger than memory.  An FM-index cannot be kept this way.  A
+   file already there that is neither empty nor an index file is left
+   alone, and the diff returns BSDIFF_ENOTINDEX.
+
+   With opts.window set, each window of the new data is diffed against
+   old data of its own: for each stretch of the window that its anchors
+   (see opts.anchors), and seeds of 32 bytes found between them, put at
+   much the same offset, as much old data at that offset, up to eight
+   such pieces, with a quarter of the window more shared out either
+   side of them.  Each gets an index of that alone, so the memory
+   taken goes with the window and not the old data, and opts.threads
+   windows are diffed at once, on threads of their own, and put into the
+   patch in order.  Matches outside a window's old data are not found;
+   opts.trim and opts.anchors do not apply, and opts.indexfile cannot
+   be used. */
+BSDIFF_API int bsdiff_diff(bsdiff_ctx *ctx, const void *pold,
+	long oldsize, const void *pnew, long newsize, const bsdiff_opts *opts,
+	int (*write)(void *arg, const void *buf, long len), void *arg,
+	bsdiff_stats *st);
+
+/* Pick the plan a diff with opts of oldsize to newsize bytes would use;
+   returns BSDIFF_EBUDGET, with the smallest plan there is in plan, if
+   none fits.  With opts.trim or opts.anchors the diff plans for the
+   most old data it indexes at once, and may pick a cheaper plan than
+   this. */
+BSDIFF_API int bsdiff_getplan(const bsdiff_opts *opts, long oldsize,
+	long newsize, bsdiff_plan *plan);
+/* Describe plan in a line of at most len bytes */
+BSDIFF_API void bsdiff_plantext(const bsdiff_plan *plan, char *buf,
+	size_t len);
+
+/* A short description of a return code */
+BSDIFF_API const char *bsdiff_strerror(int rc);
@@ -0,0 +1,186 @@
+/*
+ * FM-index match finding (see fmindex.h).
+ */
+
+#include <string.h>
+#include "fmindex.h"
+
+/* Each table starts on a boundary of this many bytes */
+#define FM_ALIGN	64
+#define FM_ROUND(n)	(((n) + FM_ALIGN - 1) & ~(size_t)(FM_ALIGN - 1))
+
+/* The sizes of the tables of an index of n bytes, in the order they
+   are laid out */
+static void fm_sizes(long n, size_t sizes[6])
+{
+	size_t rows = (size_t)n + 1;
+
+	sizes[0] = FM_ROUND(rows);
+	sizes[1] = FM_ROUND((rows / FM_SUPER + 1) * 256 * sizeof(unsigned int));
+	sizes[2] = FM_ROUND((rows / FM_BLOCK + 1) * 256 * sizeof(unsigned short));
+	sizes[3] = FM_ROUND((rows / 32 + 1) * sizeof(unsigned int));
+	sizes[4] = FM_ROUND((rows / 256 + 1) * sizeof(unsigned int));
+	sizes[5] = FM_ROUND(((size_t)n / FM_SAMPLE + 1) * sizeof(long));
+}
+
+size_t fm_size(long n)
+{
+	size_t sizes[6], size;
+	int i;
+
+	fm_sizes(n, sizes);
+	for (size = 0, i = 0;i < 6;i++) size += sizes[i];
+
+	return size;
+}
+
+void fm_build(fmindex *f, void *mem, const long *I, const unsigned char *rev,
+	long n)
+{
+	size_t sizes[6];
+	unsigned char *p = (unsigned char *)mem;
+	long count[256], base[256];
+	long r, k, marks;
+	int c;
+
+	fm_sizes(n, sizes);
+	f->n = n;
+	f->bwt = p;p += sizes[0];
+	f->super = (unsigned int *)p;p += sizes[1];
+	f->block = (unsigned short *)p;p += sizes[2];
+	f->mark = (unsigned int *)p;p += sizes[3];
+	f->markrank = (unsigned int *)p;p += sizes[4];
+	f->sample = (long *)p;
+	memset(f->mark, 0, sizes[3]);
+
+	for (c = 0;c < 256;c++) count[c] = base[c] = 0;
+	marks = 0;k = 0;
+	/* The counts go up to row n + 1, the end of the last search */
+	for (r = 0;;r++) {
+		if (r % FM_SUPER == 0)
+			for (c = 0;c < 256;c++) {
+				f->super[(r / FM_SUPER) * 256 + c] = (unsigned int)count[c];
+				base[c] = count[c];
+			};
+		if (r % FM_BLOCK == 0)
+			for (c = 0;c < 256;c++)
+				f->block[(r / FM_BLOCK) * 256 + c] =
+					(unsigned short)(count[c] - base[c]);
+		if (r % 256 == 0)
+			f->markrank[r / 256] = (unsigned int)marks;
+		if (r > n)
+			break;
+
+		/* The byte before each suffix, but for the whole data's */
+		if (I[r] == 0) {
+			f->bwt[r] = 0;
+			f->primary = r;
+		}
+		else
+			f->bwt[r] = rev[I[r] - 1];
+		count[f->bwt[r]]++;
+
+		if (I[r] % FM_SAMPLE == 0) {
+			f->mark[r / 32] |= 1U << (r % 32);
+			f->sample[k++] = I[r];
+			marks++;
+		};
+	};
+
+	/* Row 0 is the empty suffix, before all the others */
+	count[0]--;
+	f->C[0] = 1;
+	for (c = 1;c < 256;c++) f->C[c] = f->C[c - 1] + count[c - 1];
+}
+
+/* The rows before the start of block b whose BWT byte is c */
+#define BLOCKCOUNT(f, b, c) ((long)(f)->super[((b) / (FM_SUPER / FM_BLOCK)) * \
+	256 + (c)] + (f)->block[(b) * 256 + (c)])
+
+/* The rows before row i whose BWT byte is c */
+static long occ(const fmindex *f, int c, long i)
+{
+	const unsigned char *p;
+	long b, j, n, x;
+
+	/* Count from whichever end of i's block is nearer */
+	b = i / FM_BLOCK;
+	if ((i % FM_BLOCK < FM_BLOCK / 2) || ((b + 1) * FM_BLOCK > f->n + 1)) {
+		p = f->bwt + b * FM_BLOCK;
+		n = i % FM_BLOCK;
+		for (x = 0, j = 0;j < n;j++) x += (p[j] == c);
+		x = BLOCKCOUNT(f, b, c) + x;
+	}
+	else {
+		p = f->bwt + i;
+		n = (b + 1) * FM_BLOCK - i;
+		for (x = 0, j = 0;j < n;j++) x += (p[j] == c);
+		x = BLOCKCOUNT(f, b + 1, c) - x;
+	};
+
+	/* The whole data's row holds a 0 it does not have */
+	if ((c == 0) && (f->primary < i))
+		x--;
+
+	return x;
+}
+
+static int popcount(unsigned int x)
+{
+	x = x - ((x >> 1) & 0x55555555U);
+	x = (x & 0x33333333U) + ((x >> 2) & 0x33333333U);
+	x = (x + (x >> 4)) & 0x0f0f0f0fU;
+
+	return (int)((x * 0x01010101U) >> 24);
+}
+
+/* The position of row r's suffix: stepped back a byte at a time to a
+   row with its position kept */
+static long locate(const fmindex *f, long r)
+{
+	long steps, w, k;
+	int c;
+
+	for (steps = 0;!(f->mark[r / 32] & (1U << (r % 32)));steps++) {
+		c = f->bwt[r];
+		r = f->C[c] + occ(f, c, r);
+	};
+
+	k = f->markrank[r / 256];
+	for (w = (r / 256) * 8;w < r / 32;w++)
+		k += popcount(f->mark[w]);
+	k += popcount(f->mark[r / 32] & ((1U << (r % 32)) - 1));
+
+	return f->sample[k] + steps;
+}
+
+long fm_match(const fmindex *f, const unsigned char *pold, long oldsize,
+	const unsigned char *pnew, long newsize, long *pos)
+{
+	long lo, hi, nlo, nhi, len, start;
+	int c;
+
+	/* Rows lo to hi start with the first len bytes of pnew reversed */
+	lo = 0;hi = f->n + 1;
+	for (len = 0;len < newsize;) {
+		c = pnew[len];
+		nlo = f->C[c] + occ(f, c, lo);
+		nhi = f->C[c] + occ(f, c, hi);
+		if (nlo >= nhi)
+			break;
+		lo = nlo;hi = nhi;len++;
+
+		/* Only one place left, where the rest can be compared */
+		if (hi - lo == 1) {
+			start = f->n - locate(f, lo) - len;
+			*pos = start;
+			while ((len < newsize) && (start + len < oldsize) &&
+				(pold[start + len] == pnew[len]))
+				len++;
+			return len;
+		};
+	};
+
+	*pos = (len == 0) ? 0 : f->n - locate(f, lo) - len;
+	return len;
+}
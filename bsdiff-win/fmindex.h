@@ -0,0 +1,53 @@
+#pragma once
+/*
+ * An FM-index of the old data, for finding matches in a fraction of
+ * the memory of its suffix array.
+ *
+ * The index is of the old data reversed: the Burrows-Wheeler transform
+ * of it, counts of each byte at every FM_BLOCK rows of that, and the
+ * positions of the suffixes starting at every FM_SAMPLE-th byte.
+ * Backward search over the reversed data takes the new data forwards,
+ * so matching it a byte at a time narrows the rows down to those whose
+ * suffixes start with the bytes matched so far, read backwards; once a
+ * single row is left the match is located and extended by comparing
+ * the data directly.  It takes about 2.5 bytes per byte indexed.
+ *
+ * It is built from the suffix array of the reversed data, which is
+ * done with by then, so a diff's peak memory is that of the sort; what
+ * it saves is the suffix array's space while the strings are made.
+ */
+
+#include <stddef.h>
+
+/* Rows between the cumulative byte counts, and between the absolute
+   counts those are from */
+#define FM_BLOCK	512
+#define FM_SUPER	65536
+
+/* Every FM_SAMPLE-th suffix has its position kept */
+#define FM_SAMPLE	16
+
+typedef struct fmindex {
+	long n;				/* bytes indexed; there is a row more */
+	long C[256];			/* rows before those starting with each */
+	unsigned char *bwt;		/* the row of the whole data has a 0 */
+	long primary;			/* which is that row */
+	unsigned int *super;		/* 256 counts per FM_SUPER rows */
+	unsigned short *block;		/* 256 per FM_BLOCK, from the last */
+	unsigned int *mark;		/* a bit per row with a position kept */
+	unsigned int *markrank;		/* marks before each 256 rows */
+	long *sample;			/* the positions kept, by row */
+} fmindex;
+
+/* The bytes fm_build needs for n bytes of data */
+size_t fm_size(long n);
+
+/* Build an index in the fm_size(n) bytes at mem from the n bytes at
+   rev, the old data reversed, and their suffix array I */
+void fm_build(fmindex *f, void *mem, const long *I, const unsigned char *rev,
+	long n);
+
+/* The length of the longest match of pnew in pold, the data f is of
+   (not reversed), setting *pos to where it starts in pold */
+long fm_match(const fmindex *f, const unsigned char *pold, long oldsize,
+	const unsigned char *pnew, long newsize, long *pos);
@@ -29,9 +29,20 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
 #include <fcntl.h>
+#include "ctrlcodec.h"
+#include "codec.h"
+#include "hash.h"
+#include "patchfile.h"
+#include "ring.h"
+#include "mapfile.h"
+#include "bspatch.h"
+#include "parsesize.h"
+
+/* Decoded bytes buffered per block between its thread and the patcher */
+#define RINGSIZE	(1 << 20)
 
-#define errx err
 void err(int exitcode, const char * fmt, ...)
 {
 	va_list valist;
@@ -41,43 +52,203 @@ void err(int exitcode, const char * fmt, ...)
 	exit(exitcode);
 }
 
-static long offtin(u_char *buf)
+/* Read n bytes of diff string into pnew and add pold from oldpos on;
+   returns 0, or -1 if corrupt */
+static int readdiff(ring *dr, u_char *pnew, const u_char *pold,
+	long oldsize, long oldpos, long n)
+{
+	long lo, hi;
+
+	/* Where pold has bytes to add, they are added as the diff string
+	   comes out of the decoder */
+	lo = (oldpos < 0) ? -oldpos : 0;
+	if (lo > n)
+		lo = n;
+	hi = (oldpos + n > oldsize) ? oldsize - oldpos : n;
+	if (hi < lo)
+		hi = lo;
+	if ((ring_read(dr, pnew, lo) != lo) ||
+		((hi > lo) && (ring_readadd(dr, pnew + lo, pold + oldpos + lo,
+		hi - lo) != hi - lo)) ||
+		(ring_read(dr, pnew + hi, n - hi) != n - hi))
+		return -1;
+
+	return 0;
+}
+
+/* Open a FILE at the given offset of the patch and a decoder on it */
+static void *openblock(const char *patchfile, long off, long len,
+	const codec *c, FILE **fp, stream *st)
+{
+	void *cs;
+
+	if ((*fp = fopen(patchfile, "rb")) == NULL)
+		err(1, "fopen(%s)", patchfile);
+	if (fseek(*fp, off, SEEK_SET))
+		err(1, "fseeko(%s, %lld)", patchfile, (long long)off);
+	stream_file(st, *fp);
+	if ((cs = c->ropen(st, len)) == NULL)
+		errx(1, "%s: open failed\n", c->name);
+
+	return cs;
+}
+
+/* Hand a block over to a decoding thread with a ring of size bytes,
+   or none if size is 0 */
+static void startring(ring *r, const codec *c, void *cs, long size)
 {
-	long y;
+	if (ring_start(r, c, cs, size))
+		err(1, NULL);
+}
 
-	y = buf[7] & 0x7F;
-	y = y * 256;y += buf[6];
-	y = y * 256;y += buf[5];
-	y = y * 256;y += buf[4];
-	y = y * 256;y += buf[3];
-	y = y * 256;y += buf[2];
-	y = y * 256;y += buf[1];
-	y = y * 256;y += buf[0];
+/* Old file bytes the triples ahead are paged in for, and the gap up to
+   which neighbouring ranges are asked for in one go */
+#define READAHEAD	(4 << 20)
+#define READGAP		(64 << 10)
 
-	if (buf[7] & 0x80) y = -y;
+/* A second reader walking the ctrl block ahead of the patcher, asking
+   for the parts of the mapped old file it will add from */
+typedef struct readahead {
+	ctrlreader cr;
+	const mapfile *m;
+	long oldpos;		/* where the next triple ahead adds from */
+	long ahead;		/* bytes asked for that the patcher has not used */
+	int done;
+} readahead;
 
-	return y;
+/* Top up the bytes asked for ahead of the patcher, which is about to
+   use used of them */
+static void readahead_step(readahead *ra, long used)
+{
+	long ctrl[3], lo, hi, s, e;
+
+	lo = hi = 0;
+	while (!ra->done && (ra->ahead < READAHEAD)) {
+		if (ctrl_next(&ra->cr, ctrl) != 1) {
+			ra->done = 1;
+			break;
+		};
+		s = (ra->oldpos < 0) ? 0 : ra->oldpos;
+		e = (ra->oldpos + ctrl[0] > ra->m->size) ?
+			ra->m->size : ra->oldpos + ctrl[0];
+		ra->oldpos += ctrl[0] + ctrl[2];
+		ra->ahead += ctrl[0];
+		if (s >= e)
+			continue;
+		if ((hi > lo) && (s >= lo) && (s <= hi + READGAP)) {
+			if (e > hi)
+				hi = e;
+		} else {
+			map_willneed(ra->m, lo, hi - lo);
+			lo = s;
+			hi = e;
+		};
+	};
+	map_willneed(ra->m, lo, hi - lo);
+	ra->ahead -= used;
+}
+
+/* An output file being streamed, removed if bspatch exits before it is
+   complete and correct */
+static FILE *partialf;
+static const char *partial;
+
+static void removepartial(void)
+{
+	if (partial != NULL) {
+		fclose(partialf);
+		remove(partial);
+	};
+}
+
+/* With --update, the output goes over whatever newfile already holds
+   through upd, and only the blocks that differ from it are written */
+static int update;
+static updater upd;
+
+/* Hash a finished stretch of output, and write it out if fs is open */
+static void emit(FILE *fs, const char *name, const u_char *buf, long len,
+	xxh64_state *xs, sha256_state *ss, int sha)
+{
+	xxh64_update(xs, buf, len);
+	if (sha)
+		sha256_update(ss, buf, len);
+	if (fs == NULL)
+		return;
+	if (update)
+		update_write(&upd, buf, len);
+	else if (fwrite(buf, 1, len, fs) != (size_t)len)
+		err(1, "Write failed :%s", name);
 }
 
 int main(int argc, char * argv[])
 {
 	FILE * f, *cpf, *dpf, *epf;
-	BZFILE * cpfbz2, *dpfbz2, *epfbz2;
-	int cbz2err, dbz2err, ebz2err;
+	const codec *cc, *dc, *ec;
+	void *cs, *ds, *es;
+	stream cio, dio, eio;
+	ring cring, dring, ering;
 	FILE * fs;
 	long oldsize, newsize;
-	long bzctrllen, bzdatalen;
-	u_char header[32], buf[8];
+	long hdrlen, ctrllen, datalen, extralen;
+	patchhdr h;
+	u_char *header, buf[8];
+	int hashes, sha, rc;
+	xxh64_state xs;
+	sha256_state ss;
+	u_char *ctrlblock;
+	long ctrlblocklen;
+	ctrlreader cr;
 	u_char *pold, *pnew;
+	const u_char *same;
+	long samesize;
+	mapfile om;
+	readahead ra;
 	long oldpos, newpos;
 	long ctrl[3];
-	long lenread;
-	long i;
+	long i, j, n, chunk;
+	long window, wsize, wfill, dsize;
+	double x;
 
-	if (argc != 4) errx(1, "usage: %s oldfile newfile patchfile\n", argv[0]);
+	/* Merge two patches instead of applying one */
+	if ((argc == 5) && (strcmp(argv[1], "--compose") == 0))
+		return compose(argv[2], argv[3], argv[4]);
+
+	/* Apply an in-place patch over the old file itself */
+	if ((argc == 4) && (strcmp(argv[1], "--in-place") == 0))
+		return inplace(argv[2], NULL, argv[3]);
+
+	/* Rebuild the output through a window of this many bytes, and
+	   write only what changed over an existing newfile */
+	window = 0;
+	update = 0;
+	while ((argc > 1) && (strncmp(argv[1], "--", 2) == 0)) {
+		if (strncmp(argv[1], "--window=", 9) == 0) {
+			if ((x = parsesize(argv[1] + 9, LONG_MAX)) < 1)
+				errx(1, "Bad window size :%s\n", argv[1] + 9);
+			window = (long)x;
+		} else if (strcmp(argv[1], "--update") == 0)
+			update = 1;
+		else
+			break;
+		argv[1] = argv[0];
+		argv++;
+		argc--;
+	};
+
+	if ((argc < 4) || ((window || update) && (argc > 4)))
+		errx(1, "usage: %s [--window=size] [--update] oldfile newfile patchfile\n"
+			"       %s oldfile newfile patchfile...\n"
+			"       %s --compose patch1 patch2 patchfile\n"
+			"       %s --in-place file patchfile\n",
+			argv[0], argv[0], argv[0], argv[0]);
+
+	/* Several patches are applied in turn without touching disk */
+	if (argc > 4)
+		return chain(argv[1], argv[2], argc - 3, argv + 3);
 
 	/* Open patch file */
-	if ((f = fopen(argv[3], "r")) == NULL)
+	if ((f = fopen(argv[3], "rb")) == NULL)
 		err(1, "fopen(%s)", argv[3]);
 
 	/*
@@ -92,89 +263,194 @@ int main(int argc, char * argv[])
 	with control block a set of triples (x,y,z) meaning "add x bytes
 	from oldfile to x bytes from the diff block; copy y bytes from the
 	extra block; seek forwards in oldfile by z bytes".
+
+	or:
+		0	8	"BSDIFF41"
+		8	8	H
+		16	8	sizeof(newfile)
+		24	8	X
+		32	8	Y
+		40	8	Z
+		48	1	codec of control block
+		49	1	codec of diff block
+		50	1	codec of extra block
+		51	5	zero
+		56	8	XXH64(oldfile)
+		64	8	XXH64(newfile)
+		72	1	flags: 1 if SHA-256 hashes follow, 2 for in-place
+		73	7	zero
+		80	32	SHA-256(oldfile)
+		112	32	SHA-256(newfile)
+		H	X	compressed(control block)
+		H+X	Y	compressed(diff block)
+		H+X+Y	Z	compressed(extra block)
+	with the same triples stored as columns of zigzag varints (see
+	ctrlcodec.h), and the codecs numbered as in codec.h.  Headers of
+	only 48 bytes predate the codec fields and use bzip2 throughout,
+	and headers shorter than 80 bytes carry no hashes.
 	*/
 
 	/* Read header */
-	if (fread(header, 1, 32, f) < 32) {
-		if (feof(f))
-			errx(1, "Corrupt patch\n");
-		err(1, "fread(%s)", argv[3]);
-	}
-
-	/* Check for appropriate magic */
-	if (memcmp(header, "BSDIFF40", 8) != 0)
+	stream_file(&cio, f);
+	if ((rc = patch_readheader(&cio, &h)) == -2)
+		errx(1, "Patch uses a codec this bspatch lacks\n");
+	if (rc != 0) {
+		if (ferror(f))
+			err(1, "fread(%s)", argv[3]);
 		errx(1, "Corrupt patch\n");
+	};
+	header = h.raw;
+	hdrlen = h.hdrlen;
+	newsize = h.newsize;
+	ctrllen = h.ctrllen;
+	datalen = h.datalen;
+	extralen = h.extralen;
+	cc = h.c[0];
+	dc = h.c[1];
+	ec = h.c[2];
+	hashes = h.hashes;
+	sha = h.sha;
 
-	/* Read lengths from header */
-	bzctrllen = offtin(header + 8);
-	bzdatalen = offtin(header + 16);
-	newsize = offtin(header + 24);
-	if ((bzctrllen < 0) || (bzdatalen < 0) || (newsize < 0))
-		errx(1, "Corrupt patch\n");
+	/* An in-place patch holds commands, not triples; it is applied
+	   over a copy of the old file */
+	if (h.inplace) {
+		fclose(f);
+		return inplace(argv[2], argv[1], argv[3]);
+	};
 
-	/* Close patch file and re-open it via libbzip2 at the right places */
+	/* Close patch file and re-open it at the right places */
 	if (fclose(f))
 		err(1, "fclose(%s)", argv[3]);
-	if ((cpf = fopen(argv[3], "rb")) == NULL)
-		err(1, "fopen(%s)", argv[3]);
-	if (fseek(cpf, 32, SEEK_SET))
-		err(1, "fseeko(%s, %lld)", argv[3],
-		(long long)32);
-	if ((cpfbz2 = BZ2_bzReadOpen(&cbz2err, cpf, 0, 0, NULL, 0)) == NULL)
-		errx(1, "BZ2_bzReadOpen, bz2err = %d", cbz2err);
-	if ((dpf = fopen(argv[3], "rb")) == NULL)
-		err(1, "fopen(%s)", argv[3]);
-	if (fseek(dpf, 32 + bzctrllen, SEEK_SET))
-		err(1, "fseeko(%s, %lld)", argv[3],
-		(long long)(32 + bzctrllen));
-	if ((dpfbz2 = BZ2_bzReadOpen(&dbz2err, dpf, 0, 0, NULL, 0)) == NULL)
-		errx(1, "BZ2_bzReadOpen, bz2err = %d", dbz2err);
-	if ((epf = fopen(argv[3], "rb")) == NULL)
-		err(1, "fopen(%s)", argv[3]);
-	if (fseek(epf, 32 + bzctrllen + bzdatalen, SEEK_SET))
-		err(1, "fseeko(%s, %lld)", argv[3],
-		(long long)(32 + bzctrllen + bzdatalen));
-	if ((epfbz2 = BZ2_bzReadOpen(&ebz2err, epf, 0, 0, NULL, 0)) == NULL)
-		errx(1, "BZ2_bzReadOpen, bz2err = %d", ebz2err);
-
-	fs = fopen(argv[1], "rb");
-	if (fs == NULL)err(1, "Open failed :%s", argv[1]);
-	if (fseek(fs, 0, SEEK_END) != 0)err(1, "Seek failed :%s", argv[1]);
-	oldsize = ftell(fs);
-	pold = (u_char *)malloc(oldsize + 1);
-	if (pold == NULL)	err(1, "Malloc failed :%s", argv[1]);
-	fseek(fs, 0, SEEK_SET);
-	if (fread(pold, 1, oldsize, fs) == -1)	err(1, "Read failed :%s", argv[1]);
-	if (fclose(fs) == -1)	err(1, "Close failed :%s", argv[1]);
-
-	pnew = malloc(newsize + 1);
+	cs = openblock(argv[3], hdrlen, ctrllen, cc, &cpf, &cio);
+	ds = openblock(argv[3], hdrlen + ctrllen, datalen, dc, &dpf, &dio);
+	es = openblock(argv[3], hdrlen + ctrllen + datalen, extralen, ec, &epf,
+		&eio);
+
+	/* Each block decodes on its own thread from here on, except that
+	   blocks taking the old file as dictionary wait until it is in, and
+	   a diff block whose codec adds the old file as it decodes is left
+	   to the patcher to do that where there are too few processors to
+	   give it a thread */
+	dsize = ring_threaddiff(dc, datalen, extralen) ? RINGSIZE : 0;
+	if (dc->setdict == NULL)
+		startring(&dring, dc, ds, dsize);
+	if (ec->setdict == NULL)
+		startring(&ering, ec, es, RINGSIZE);
+
+	/* BSDIFF41 columns can only be walked once the whole block is in */
+	ctrlblock = NULL;
+	if (hdrlen != 32) {
+		if ((ctrlblock = patch_readall(cc, cs, &ctrlblocklen)) == NULL)
+			errx(1, "Corrupt patch\n");
+		if (ctrl_open(&cr, ctrlblock, ctrlblocklen))
+			errx(1, "Corrupt patch\n");
+	} else
+		startring(&cring, cc, cs, RINGSIZE);
+
+	/* The old file is mapped and paged in as the patch needs it,
+	   unless it is also the output, which would change under it */
+	if (map_open(&om, argv[1], strcmp(argv[1], argv[2]) != 0))
+		err(1, "Read failed :%s", argv[1]);
+	pold = om.p;
+	oldsize = om.size;
+
+	/* Refuse the wrong old file before doing any work, hashing it
+	   while the next chunk is paged in */
+	if (hashes) {
+		xxh64_init(&xs);
+		sha256_init(&ss);
+		for (i = 0;i < oldsize;i += chunk) {
+			chunk = (oldsize - i < (1 << 20)) ? oldsize - i : (1 << 20);
+			map_willneed(&om, i + chunk, 1 << 20);
+			xxh64_update(&xs, pold + i, chunk);
+			if (sha)
+				sha256_update(&ss, pold + i, chunk);
+		};
+		if (!patch_checkhash(&xs, &ss, header + 56, sha ? header + 80 : NULL))
+			errx(1, "Old file does not match patch :%s\n", argv[1]);
+	};
+
+	/* BSDIFF41 triples can be read ahead of the patcher */
+	ra.done = (ctrlblock == NULL) || !om.mapped;
+	if (!ra.done) {
+		ctrl_open(&ra.cr, ctrlblock, ctrlblocklen);
+		ra.m = &om;
+		ra.oldpos = 0;
+		ra.ahead = 0;
+	};
+
+	/* Diff and extra block codecs may use the old file as dictionary */
+	if (dc->setdict != NULL) {
+		dc->setdict(ds, pold, oldsize);
+		startring(&dring, dc, ds, dsize);
+	};
+	if (ec->setdict != NULL) {
+		ec->setdict(es, pold, oldsize);
+		startring(&ering, ec, es, RINGSIZE);
+	};
+
+	/* pnew holds the window of output being rebuilt.  Without a
+	   window it is the whole file, written only once it checks out;
+	   with one, each window is written as it fills, and the file is
+	   removed again if anything goes wrong, or with --update, which
+	   writes over it, said to be damaged */
+	fs = NULL;
+	same = NULL;
+	samesize = 0;
+	if (update && (strcmp(argv[1], argv[2]) == 0)) {
+		/* Compared with the copy in memory rather than read back */
+		same = pold;
+		samesize = oldsize;
+	};
+	wsize = ((window > 0) && (window < newsize)) ? window : newsize;
+	if (update && (wsize < newsize)) {
+		update_open(&upd, argv[2], same, samesize);
+		fs = upd.f;
+	}
+	else if (wsize < newsize) {
+		fs = fopen(argv[2], "wb");
+		if (fs == NULL)err(1, "Create failed :%s", argv[2]);
+		partialf = fs;
+		partial = argv[2];
+		atexit(removepartial);
+	};
+	pnew = malloc(wsize + 1);
 	if (pnew == NULL)err(1, NULL);
 
-	oldpos = 0;newpos = 0;
+	/* pnew is hashed as each window completes */
+	xxh64_init(&xs);
+	sha256_init(&ss);
+	oldpos = 0;newpos = 0;wfill = 0;
 	while (newpos < newsize) {
 		/* Read control data */
-		for (i = 0;i <= 2;i++) {
-			lenread = BZ2_bzRead(&cbz2err, cpfbz2, buf, 8);
-			if ((lenread < 8) || ((cbz2err != BZ_OK) &&
-				(cbz2err != BZ_STREAM_END)))
+		if (ctrlblock != NULL) {
+			if (ctrl_next(&cr, ctrl) != 1)
 				errx(1, "Corrupt patch\n");
-			ctrl[i] = offtin(buf);
+		} else for (i = 0;i <= 2;i++) {
+			if (ring_read(&cring, buf, 8) != 8)
+				errx(1, "Corrupt patch\n");
+			ctrl[i] = patch_offtin(buf);
 		};
 
 		/* Sanity-check */
 		if (newpos + ctrl[0] > newsize)
 			errx(1, "Corrupt patch\n");
+		if (!ra.done)
+			readahead_step(&ra, ctrl[0]);
 
-		/* Read diff string */
-		lenread = BZ2_bzRead(&dbz2err, dpfbz2, pnew + newpos, ctrl[0]);
-		if ((lenread < ctrl[0]) ||
-			((dbz2err != BZ_OK) && (dbz2err != BZ_STREAM_END)))
+		/* Read diff string and add pold data to it */
+		if (ctrl[0] < 0)
 			errx(1, "Corrupt patch\n");
-
-		/* Add pold data to diff string */
-		for (i = 0;i < ctrl[0];i++)
-			if ((oldpos + i >= 0) && (oldpos + i < oldsize))
-				pnew[newpos + i] += pold[oldpos + i];
+		for (j = 0;j < ctrl[0];j += n) {
+			if (wfill == wsize) {
+				emit(fs, argv[2], pnew, wfill, &xs, &ss, sha);
+				wfill = 0;
+			};
+			n = (ctrl[0] - j < wsize - wfill) ? ctrl[0] - j : wsize - wfill;
+			if (readdiff(&dring, pnew + wfill, pold, oldsize, oldpos + j, n))
+				errx(1, "Corrupt patch\n");
+			wfill += n;
+		};
 
 		/* Adjust pointers */
 		newpos += ctrl[0];
@@ -185,31 +461,61 @@ int main(int argc, char * argv[])
 			errx(1, "Corrupt patch\n");
 
 		/* Read extra string */
-		lenread = BZ2_bzRead(&ebz2err, epfbz2, pnew + newpos, ctrl[1]);
-		if ((lenread < ctrl[1]) ||
-			((ebz2err != BZ_OK) && (ebz2err != BZ_STREAM_END)))
+		if (ctrl[1] < 0)
 			errx(1, "Corrupt patch\n");
+		for (j = 0;j < ctrl[1];j += n) {
+			if (wfill == wsize) {
+				emit(fs, argv[2], pnew, wfill, &xs, &ss, sha);
+				wfill = 0;
+			};
+			n = (ctrl[1] - j < wsize - wfill) ? ctrl[1] - j : wsize - wfill;
+			if (ring_read(&ering, pnew + wfill, n) != n)
+				errx(1, "Corrupt patch\n");
+			wfill += n;
+		};
 
 		/* Adjust pointers */
 		newpos += ctrl[1];
 		oldpos += ctrl[2];
 	};
 
-	/* Clean up the bzip2 reads */
-	BZ2_bzReadClose(&cbz2err, cpfbz2);
-	BZ2_bzReadClose(&dbz2err, dpfbz2);
-	BZ2_bzReadClose(&ebz2err, epfbz2);
+	/* Clean up the decoders */
+	if (ctrlblock == NULL)
+		ring_stop(&cring);
+	ring_stop(&dring);
+	ring_stop(&ering);
+	cc->rclose(cs);
+	dc->rclose(ds);
+	ec->rclose(es);
 	if (fclose(cpf) || fclose(dpf) || fclose(epf))
 		err(1, "fclose(%s)", argv[3]);
 
+	/* Nothing is kept unless the output is what the patch promised */
+	emit(fs, argv[2], pnew, wfill, &xs, &ss, sha);
+	if (hashes && !patch_checkhash(&xs, &ss, header + 64, sha ? header + 112 : NULL))
+		errx(1, "Patch produced the wrong output\n");
+
 	/* Write the pnew file */
-	fs = fopen(argv[2], "wb");
-	if (fs == NULL)err(1, "Create failed :%s", argv[2]);
-	if (fwrite(pnew, 1, newsize, fs) == -1)err(1, "Write failed :%s", argv[2]);
-	if (fclose(fs) == -1)err(1, "Close failed :%s", argv[2]);
+	if (update) {
+		if (fs == NULL) {
+			update_open(&upd, argv[2], same, samesize);
+			update_write(&upd, pnew, newsize);
+		};
+		update_close(&upd);
+	} else {
+		if (fs == NULL) {
+			fs = fopen(argv[2], "wb");
+			if (fs == NULL)err(1, "Create failed :%s", argv[2]);
+			if (fwrite(pnew, 1, newsize, fs) != (size_t)newsize)
+				err(1, "Write failed :%s", argv[2]);
+		};
+		partial = NULL;
+		if (fclose(fs) == -1)err(1, "Close failed :%s", argv[2]);
+	};
 
+	free(ctrlblock);
 	free(pnew);
-	free(pold);
+	map_close(&om);
 
 	return 0;
 }
@@ -0,0 +1,41 @@
+#pragma once
+/*
+ * Shared by the bspatch tool's source files.
+ */
+
+#include <stdio.h>
+
+#define errx err
+void err(int exitcode, const char * fmt, ...);
+
+/* Write the composition of patch1 then patch2 to patchfile (compose.c);
+   exits on error, returns 0 otherwise */
+int compose(const char *patch1, const char *patch2, const char *patchfile);
+
+/* Apply the n patches in order to oldfile, writing newfile (chain.c);
+   exits on error, returns 0 otherwise */
+int chain(const char *oldfile, const char *newfile, int npatch,
+	char * const patches[]);
+
+/* Apply the in-place patch over file, first copying from to it if from
+   is not NULL (inplace.c); exits on error, returns 0 otherwise */
+int inplace(const char *file, const char *from, const char *patchfile);
+
+/* Output written over what a file already holds, only the blocks that
+   differ (update.c) */
+typedef struct updater {
+	FILE *f;
+	const char *name;
+	long pos;			/* where the next output byte goes */
+	const unsigned char *same;	/* what the file holds, if that is */
+	long samesize;			/* already in memory, or NULL */
+	long written;			/* bytes written so far */
+} updater;
+
+/* Open name to update, creating it if it is not there; exits on error */
+void update_open(updater *u, const char *name, const unsigned char *same,
+	long samesize);
+/* Write the next len bytes of output */
+void update_write(updater *u, const unsigned char *buf, long len);
+/* Cut the file to the output written and close it */
+void update_close(updater *u);
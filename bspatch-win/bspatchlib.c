@@ -0,0 +1,377 @@
+/*
+ * bspatch as a library (see bspatchlib.h).
+ *
+ * This is the patcher of bspatch.c without its files and threads: the
+ * blocks are decoded in turn on the caller's thread, into the output
+ * buffer or a chunk of the context's, and the decoders are kept in the
+ * context for the next patch.  bzip2 decoders, which hold the most
+ * memory, are restarted on the next patch's blocks with all of it kept.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "ctrlcodec.h"
+#include "codec.h"
+#include "hash.h"
+#include "patchfile.h"
+#include "addbytes.h"
+#include "bspatchlib.h"
+
+typedef unsigned char u_char;
+
+/* Output gathered for a write callback, and old data read through a
+   callback, go through buffers of this size */
+#define LIBCHUNK	(1 << 18)
+
+/* A patch read through a callback, noting whether the callback failed,
+   which the codecs only see as the end of their data */
+typedef struct libsource {
+	const bspatch_source *src;
+	int failed;
+} libsource;
+
+struct bspatch_ctx {
+	ctrlbuf cb;
+	u_char *ctrl;			/* the decoded ctrl block */
+	long ctrlalloc;
+	u_char *outbuf;			/* LIBCHUNK bytes each */
+	u_char *oldbuf;
+	libsource ls;
+	const codec *c[3];		/* ctrl, diff and extra decoders, */
+	void *cs[3];			/* kept for the next patch */
+	stream io[3];
+};
+
+static long libread(void *arg, long off, void *buf, long len)
+{
+	libsource *ls = (libsource *)arg;
+	long n;
+
+	if ((n = ls->src->read(ls->src->arg, off, buf, len)) < 0)
+		ls->failed = 1;
+
+	return n;
+}
+
+static void libstream(bspatch_ctx *ctx, stream *s, const bspatch_source *src)
+{
+	if (src->data != NULL)
+		stream_span(s, src->data, src->size);
+	else
+		stream_callback(s, libread, NULL, &ctx->ls, src->size);
+}
+
+/* A failure seen by the codecs, told apart by whether reading failed */
+static int corrupt(bspatch_ctx *ctx)
+{
+	return ctx->ls.failed ? BSPATCH_EREAD : BSPATCH_ECORRUPT;
+}
+
+bspatch_ctx *bspatch_new(void)
+{
+	bspatch_ctx *ctx;
+
+	if ((ctx = (bspatch_ctx *)malloc(sizeof(bspatch_ctx))) == NULL)
+		return NULL;
+	memset(ctx, 0, sizeof(bspatch_ctx));
+	ctrlbuf_init(&ctx->cb);
+	if (((ctx->outbuf = (u_char *)malloc(LIBCHUNK)) == NULL) ||
+		((ctx->oldbuf = (u_char *)malloc(LIBCHUNK)) == NULL)) {
+		bspatch_free(ctx);
+		return NULL;
+	};
+
+	return ctx;
+}
+
+void bspatch_free(bspatch_ctx *ctx)
+{
+	int k;
+
+	if (ctx == NULL)
+		return;
+	for (k = 0;k < 3;k++)
+		if (ctx->cs[k] != NULL)
+			ctx->c[k]->rclose(ctx->cs[k]);
+	ctrlbuf_free(&ctx->cb);
+	free(ctx->ctrl);
+	free(ctx->outbuf);
+	free(ctx->oldbuf);
+	free(ctx);
+}
+
+/* Start decoder k on the len bytes at off of the patch, reusing the one
+   kept if it has the same codec and can be restarted */
+static int decoder(bspatch_ctx *ctx, int k, const codec *c,
+	const bspatch_source *patch, long off, long len)
+{
+	stream *s = &ctx->io[k];
+
+	libstream(ctx, s, patch);
+	if (stream_seek(s, off))
+		return corrupt(ctx);
+	if ((ctx->cs[k] != NULL) && (ctx->c[k] == c) && (c->rreopen != NULL))
+		ctx->cs[k] = c->rreopen(ctx->cs[k], s, len);
+	else {
+		if (ctx->cs[k] != NULL)
+			ctx->c[k]->rclose(ctx->cs[k]);
+		ctx->cs[k] = c->ropen(s, len);
+	};
+	ctx->c[k] = c;
+
+	return (ctx->cs[k] == NULL) ? corrupt(ctx) : BSPATCH_OK;
+}
+
+/* Decode the rest of the ctrl block into ctx->ctrl */
+static int readctrl(bspatch_ctx *ctx, long *lenp)
+{
+	u_char *p;
+	long len, n;
+
+	len = 0;
+	do {
+		if (len == ctx->ctrlalloc) {
+			n = ctx->ctrlalloc ? ctx->ctrlalloc * 2 : 65536;
+			if ((p = (u_char *)realloc(ctx->ctrl, n)) == NULL)
+				return BSPATCH_ENOMEM;
+			ctx->ctrl = p;
+			ctx->ctrlalloc = n;
+		};
+		if ((n = ctx->c[0]->read(ctx->cs[0], ctx->ctrl + len,
+			ctx->ctrlalloc - len)) < 0)
+			return corrupt(ctx);
+		len += n;
+	} while (len == ctx->ctrlalloc);
+
+	*lenp = len;
+	return BSPATCH_OK;
+}
+
+/* Read the n bytes of old data at pos into ctx->oldbuf */
+static int readold(bspatch_ctx *ctx, const bspatch_source *old, long pos,
+	long n)
+{
+	return (old->read(old->arg, pos, ctx->oldbuf, n) == n) ?
+		BSPATCH_OK : BSPATCH_EREAD;
+}
+
+/* Hash all of old, which is checked before anything is written */
+static int hashold(bspatch_ctx *ctx, const bspatch_source *old,
+	xxh64_state *xs, sha256_state *ss, int sha)
+{
+	long i, n;
+	int rc;
+
+	xxh64_init(xs);
+	sha256_init(ss);
+	if (old->data != NULL) {
+		xxh64_update(xs, old->data, old->size);
+		if (sha)
+			sha256_update(ss, old->data, old->size);
+		return BSPATCH_OK;
+	};
+	for (i = 0;i < old->size;i += n) {
+		n = (old->size - i < LIBCHUNK) ? old->size - i : LIBCHUNK;
+		if ((rc = readold(ctx, old, i, n)) != BSPATCH_OK)
+			return rc;
+		xxh64_update(xs, ctx->oldbuf, n);
+		if (sha)
+			sha256_update(ss, ctx->oldbuf, n);
+	};
+
+	return BSPATCH_OK;
+}
+
+/* Read n bytes of diff string into dst and add old from oldpos on */
+static int readdiff(bspatch_ctx *ctx, const bspatch_source *old, u_char *dst,
+	long oldpos, long n)
+{
+	const codec *c = ctx->c[1];
+	void *ds = ctx->cs[1];
+	long lo, hi;
+	int rc;
+
+	lo = (oldpos < 0) ? -oldpos : 0;
+	if (lo > n)
+		lo = n;
+	hi = (oldpos + n > old->size) ? old->size - oldpos : n;
+	if (hi < lo)
+		hi = lo;
+
+	/* Add as the diff string is decoded where the codec can */
+	if ((old->data != NULL) && (c->readadd != NULL)) {
+		if ((c->read(ds, dst, lo) != lo) ||
+			((hi > lo) && (c->readadd(ds, dst + lo,
+			(const u_char *)old->data + oldpos + lo, hi - lo) != hi - lo)) ||
+			(c->read(ds, dst + hi, n - hi) != n - hi))
+			return corrupt(ctx);
+		return BSPATCH_OK;
+	};
+
+	if (c->read(ds, dst, n) != n)
+		return corrupt(ctx);
+	if (hi == lo)
+		return BSPATCH_OK;
+	if (old->data != NULL) {
+		add_bytes(dst + lo, (const u_char *)old->data + oldpos + lo, hi - lo);
+		return BSPATCH_OK;
+	};
+	if ((rc = readold(ctx, old, oldpos + lo, hi - lo)) != BSPATCH_OK)
+		return rc;
+	add_bytes(dst + lo, ctx->oldbuf, hi - lo);
+
+	return BSPATCH_OK;
+}
+
+int bspatch_info(const bspatch_source *patch, long *newsize)
+{
+	libsource ls;
+	stream s;
+	patchhdr h;
+	int rc;
+
+	ls.src = patch;
+	ls.failed = 0;
+	if (patch->data != NULL)
+		stream_span(&s, patch->data, patch->size);
+	else
+		stream_callback(&s, libread, NULL, &ls, patch->size);
+	if ((rc = patch_readheader(&s, &h)) == -2)
+		return BSPATCH_ECODEC;
+	if (rc != 0)
+		return ls.failed ? BSPATCH_EREAD : BSPATCH_ECORRUPT;
+	*newsize = h.newsize;
+
+	return BSPATCH_OK;
+}
+
+int bspatch_apply(bspatch_ctx *ctx, const bspatch_source *old,
+	const bspatch_source *patch, const bspatch_sink *out, long *newsize)
+{
+	stream ps;
+	patchhdr h;
+	xxh64_state xs;
+	sha256_state ss;
+	u_char *dst;
+	long ctrllen, oldpos, newpos, fill, room, i, j, n;
+	const long *ctrl;
+	int k, rc;
+
+	ctx->ls.src = patch;
+	ctx->ls.failed = 0;
+
+	/* Read the header, and turn away what cannot be applied here */
+	libstream(ctx, &ps, patch);
+	if ((rc = patch_readheader(&ps, &h)) == -2)
+		return BSPATCH_ECODEC;
+	if (rc != 0)
+		return corrupt(ctx);
+	if (newsize != NULL)
+		*newsize = h.newsize;
+	if (h.inplace || (patch_needsdict(&h) && (old->data == NULL)))
+		return BSPATCH_EUNSUPPORTED;
+	if ((out->data != NULL) && (out->size < h.newsize))
+		return BSPATCH_ESPACE;
+	if (h.hashes) {
+		if ((rc = hashold(ctx, old, &xs, &ss, h.sha)) != BSPATCH_OK)
+			return rc;
+		if (!patch_checkhash(&xs, &ss, h.raw + 56, h.sha ? h.raw + 80 : NULL))
+			return BSPATCH_EOLD;
+	};
+
+	/* Decode the ctrl block whole, and start on the other two */
+	ctx->cb.count = 0;
+	if (((rc = decoder(ctx, 0, h.c[0], patch, h.hdrlen, h.ctrllen)) !=
+		BSPATCH_OK) || ((rc = readctrl(ctx, &ctrllen)) != BSPATCH_OK))
+		return rc;
+	if (patch_readctrl(&h, ctx->ctrl, ctrllen, &ctx->cb))
+		return BSPATCH_ECORRUPT;
+	if (((rc = decoder(ctx, 1, h.c[1], patch, h.hdrlen + h.ctrllen,
+		h.datalen)) != BSPATCH_OK) ||
+		((rc = decoder(ctx, 2, h.c[2], patch,
+		h.hdrlen + h.ctrllen + h.datalen, h.extralen)) != BSPATCH_OK))
+		return rc;
+	for (k = 1;k <= 2;k++)
+		if (h.c[k]->setdict != NULL)
+			h.c[k]->setdict(ctx->cs[k], old->data, old->size);
+
+	/* Output through a callback is hashed as each piece of it is made,
+	   and a buffer once it is finished */
+	xxh64_init(&xs);
+	sha256_init(&ss);
+	oldpos = 0;newpos = 0;fill = 0;
+	for (i = 0;newpos < h.newsize;i++) {
+		if (i == ctx->cb.count)
+			return BSPATCH_ECORRUPT;
+		ctrl = ctx->cb.ctrl + 3 * i;
+		if ((ctrl[0] < 0) || (ctrl[1] < 0) ||
+			(ctrl[0] > h.newsize - newpos) ||
+			(ctrl[1] > h.newsize - newpos - ctrl[0]))
+			return BSPATCH_ECORRUPT;
+
+		/* Diff string, then extra string */
+		for (k = 1;k <= 2;k++)
+			for (j = 0;j < ctrl[k - 1];j += n) {
+				if ((out->data == NULL) && (fill == LIBCHUNK)) {
+					if (out->write(out->arg, ctx->outbuf, fill))
+						return BSPATCH_EWRITE;
+					fill = 0;
+				};
+				room = (out->data == NULL) ? LIBCHUNK - fill : LIBCHUNK;
+				n = (ctrl[k - 1] - j < room) ? ctrl[k - 1] - j : room;
+				dst = (out->data == NULL) ? ctx->outbuf + fill :
+					(u_char *)out->data + newpos +
+					((k == 2) ? ctrl[0] : 0) + j;
+				if (k == 1)
+					rc = readdiff(ctx, old, dst, oldpos + j, n);
+				else
+					rc = (ctx->c[2]->read(ctx->cs[2], dst, n) == n) ?
+						BSPATCH_OK : corrupt(ctx);
+				if (rc != BSPATCH_OK)
+					return rc;
+				if (out->data == NULL) {
+					xxh64_update(&xs, dst, n);
+					if (h.sha)
+						sha256_update(&ss, dst, n);
+				};
+				fill += n;
+			};
+
+		newpos += ctrl[0] + ctrl[1];
+		oldpos += ctrl[0] + ctrl[2];
+	};
+
+	/* Whatever a callback was given, it is only told all is well if the
+	   output hashes right */
+	if ((out->data == NULL) && (fill > 0) &&
+		out->write(out->arg, ctx->outbuf, fill))
+		return BSPATCH_EWRITE;
+	if (h.hashes && (out->data != NULL)) {
+		xxh64_update(&xs, out->data, h.newsize);
+		if (h.sha)
+			sha256_update(&ss, out->data, h.newsize);
+	};
+	if (h.hashes && !patch_checkhash(&xs, &ss, h.raw + 64,
+		h.sha ? h.raw + 112 : NULL))
+		return BSPATCH_EOUTPUT;
+
+	return BSPATCH_OK;
+}
+
+const char *bspatch_strerror(int rc)
+{
+	switch (rc) {
+	case BSPATCH_OK: return "no error";
+	case BSPATCH_ECORRUPT: return "corrupt patch";
+	case BSPATCH_ECODEC: return "patch uses a codec that is not built in";
+	case BSPATCH_ENOMEM: return "out of memory";
+	case BSPATCH_EOLD: return "old data does not match patch";
+	case BSPATCH_EOUTPUT: return "patch produced the wrong output";
+	case BSPATCH_ESPACE: return "output buffer too small";
+	case BSPATCH_EREAD: return "read failed";
+	case BSPATCH_EWRITE: return "write failed";
+	case BSPATCH_EUNSUPPORTED: return "patch cannot be applied through this interface";
+	};
+
+	return "unknown error";
+}
@@ -0,0 +1,67 @@
+#pragma once
+/*
+ * bspatch as a library, for programs that apply patches themselves.
+ *
+ * The old data and the patch are given as spans of memory or as read
+ * callbacks, and the new data goes to a caller's buffer or to a write
+ * callback.  Nothing here exits or prints; every failure comes back as
+ * one of the codes below.  A context holds the buffers and decoders of
+ * one patch at a time and keeps them for the next, so a program applying
+ * many patches should keep one per thread rather than make one each
+ * time.  Contexts share nothing, and may be used on different threads
+ * at once.
+ *
+ * In-place patches are not applied here; bspatch --in-place does that.
+ */
+
+#define BSPATCH_OK		0
+#define BSPATCH_ECORRUPT	-1	/* the patch is corrupt */
+#define BSPATCH_ECODEC		-2	/* it uses a codec that is not built in */
+#define BSPATCH_ENOMEM		-3
+#define BSPATCH_EOLD		-4	/* the old data is not what it is for */
+#define BSPATCH_EOUTPUT		-5	/* it produced the wrong output */
+#define BSPATCH_ESPACE		-6	/* the output buffer is too small */
+#define BSPATCH_EREAD		-7	/* a read callback failed */
+#define BSPATCH_EWRITE		-8	/* the write callback failed */
+#define BSPATCH_EUNSUPPORTED	-9	/* an in-place patch, or one whose */
+					/* codecs need the old data as a span */
+
+/* Data to read: the size bytes at data, or, if data is NULL, the size
+   bytes read returns, which it is asked for by offset and may return
+   fewer of only at the end, or -1 on error */
+typedef struct bspatch_source {
+	const void *data;
+	long size;
+	long (*read)(void *arg, long off, void *buf, long len);
+	void *arg;
+} bspatch_source;
+
+/* Where the new data goes: the size bytes at data, or, if data is NULL,
+   write, which gets it in order and returns nonzero to stop */
+typedef struct bspatch_sink {
+	void *data;
+	long size;
+	int (*write)(void *arg, const void *buf, long len);
+	void *arg;
+} bspatch_sink;
+
+typedef struct bspatch_ctx bspatch_ctx;
+
+/* Returns NULL if out of memory */
+bspatch_ctx *bspatch_new(void);
+void bspatch_free(bspatch_ctx *ctx);
+
+/* Read the header of patch, setting *newsize to the size of the data
+   it produces */
+int bspatch_info(const bspatch_source *patch, long *newsize);
+
+/* Apply patch to old, writing the new data to out.  *newsize, if
+   newsize is not NULL, is set as soon as the header is read, so that
+   after BSPATCH_ESPACE it tells how large a buffer is needed.  When
+   out is a callback, a failure may come after some output was written;
+   only BSPATCH_OK means all of it is right. */
+int bspatch_apply(bspatch_ctx *ctx, const bspatch_source *old,
+	const bspatch_source *patch, const bspatch_sink *out, long *newsize);
+
+/* A short description of a return code */
+const char *bspatch_strerror(int rc);
@@ -0,0 +1,228 @@
+/*
+ * Applying a chain of patches, old -> ... -> new, in memory.
+ *
+ * The files in between alternate between two buffers and never reach
+ * disk.  While patch k is applied, a worker thread reads and decodes
+ * patch k+1 whole, so the two overlap; a patch whose codecs take its
+ * old file as dictionary can only be decoded once the output of the
+ * patch before it exists, and is decoded then instead.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "ctrlcodec.h"
+#include "codec.h"
+#include "patchfile.h"
+#include "thread.h"
+#include "addbytes.h"
+#include "bspatch.h"
+
+typedef unsigned char u_char;
+
+typedef struct loader {
+	const char *name;
+	const u_char *dict;	/* old file, for dictionary codecs */
+	long dictlen;
+	patchdata p;
+	int rc;			/* patch_load's, or -4 if unreadable */
+	int needsdict;
+	int threaded;
+	thread t;
+} loader;
+
+static void load(void *arg)
+{
+	loader *l = (loader *)arg;
+	FILE *f;
+	stream st;
+
+	if ((f = fopen(l->name, "rb")) == NULL) {
+		l->rc = -4;
+		return;
+	};
+	stream_file(&st, f);
+	l->rc = patch_load(&st, &l->p, l->dict, l->dictlen);
+	fclose(f);
+}
+
+/* Decode on a worker if asked and one can be had, else right away */
+static void startload(loader *l, const u_char *dict, long dictlen,
+	int background)
+{
+	l->dict = dict;
+	l->dictlen = dictlen;
+	l->threaded = background && (thread_start(&l->t, load, l) == 0);
+	if (!l->threaded)
+		load(l);
+}
+
+static void finishload(loader *l)
+{
+	if (l->threaded)
+		thread_join(&l->t);
+	switch (l->rc) {
+	case -1:
+		errx(1, "Corrupt patch :%s\n", l->name);
+		break;
+	case -2:
+		errx(1, "Patch uses a codec this bspatch lacks :%s\n", l->name);
+		break;
+	case -4:
+		err(1, "fopen(%s)", l->name);
+		break;
+	};
+}
+
+/* Apply p to the oldsize bytes at pold, filling pnew; returns 0, or -1
+   if the patch is corrupt */
+static int apply(const patchdata *p, const u_char *pold, long oldsize,
+	u_char *pnew)
+{
+	long oldpos, newpos, dpos, epos;
+	long i, *ctrl;
+
+	oldpos = 0;newpos = 0;dpos = 0;epos = 0;
+	for (i = 0;newpos < p->h.newsize;i++) {
+		if (i == p->cb.count)
+			return -1;
+		ctrl = p->cb.ctrl + 3 * i;
+
+		/* Sanity-check */
+		if ((ctrl[0] < 0) || (ctrl[1] < 0) ||
+			(newpos + ctrl[0] > p->h.newsize) ||
+			(newpos + ctrl[0] + ctrl[1] > p->h.newsize) ||
+			(dpos + ctrl[0] > p->dblen) || (epos + ctrl[1] > p->eblen))
+			return -1;
+
+		/* Add pold data to diff string */
+		memcpy(pnew + newpos, p->db + dpos, ctrl[0]);
+		add_from(pnew + newpos, pold, oldsize, oldpos, ctrl[0]);
+		newpos += ctrl[0];
+		oldpos += ctrl[0];
+		dpos += ctrl[0];
+
+		/* Copy extra string */
+		memcpy(pnew + newpos, p->eb + epos, ctrl[1]);
+		newpos += ctrl[1];
+		epos += ctrl[1];
+		oldpos += ctrl[2];
+	};
+
+	return 0;
+}
+
+/* Check len bytes at buf against the old (which 0) or new (which 1)
+   file hashes of h; returns 1 if they match or h has none */
+static int matches(const patchhdr *h, int which, const u_char *buf, long len)
+{
+	xxh64_state xs;
+	sha256_state ss;
+
+	if (!h->hashes)
+		return 1;
+	xxh64_init(&xs);
+	xxh64_update(&xs, buf, len);
+	if (h->sha) {
+		sha256_init(&ss);
+		sha256_update(&ss, buf, len);
+	};
+
+	return patch_checkhash(&xs, &ss, h->raw + 56 + 8 * which,
+		h->sha ? h->raw + 80 + SHA256_LEN * which : NULL);
+}
+
+int chain(const char *oldfile, const char *newfile, int npatch,
+	char * const patches[])
+{
+	loader *l;
+	u_char *buf[2], *p;
+	long alloc[2], size;
+	int cur, k, rc;
+	FILE *f;
+	stream st;
+
+	if ((l = calloc(npatch, sizeof(loader))) == NULL)
+		err(1, NULL);
+
+	/* Headers first, so that a broken chain fails before any work */
+	for (k = 0;k < npatch;k++) {
+		l[k].name = patches[k];
+		if ((f = fopen(patches[k], "rb")) == NULL)
+			err(1, "fopen(%s)", patches[k]);
+		stream_file(&st, f);
+		if ((rc = patch_readheader(&st, &l[k].p.h)) == -2)
+			errx(1, "Patch uses a codec this bspatch lacks :%s\n", patches[k]);
+		if (rc != 0)
+			errx(1, "Corrupt patch :%s\n", patches[k]);
+		fclose(f);
+		if (l[k].p.h.inplace)
+			errx(1, "Cannot chain an in-place patch :%s\n", patches[k]);
+		l[k].needsdict = patch_needsdict(&l[k].p.h);
+		if ((k > 0) && l[k - 1].p.h.hashes && l[k].p.h.hashes &&
+			(memcmp(l[k - 1].p.h.raw + 64, l[k].p.h.raw + 56, 8) != 0))
+			errx(1, "%s does not apply to the output of %s\n",
+				patches[k], patches[k - 1]);
+	};
+
+	/* buf[cur] holds the input of the next patch */
+	if ((f = fopen(oldfile, "rb")) == NULL)
+		err(1, "Open failed :%s", oldfile);
+	size = -1;
+	if (fseek(f, 0, SEEK_END) || ((size = ftell(f)) == -1) ||
+		fseek(f, 0, SEEK_SET))
+		err(1, "Seek failed :%s", oldfile);
+	cur = 0;
+	alloc[0] = size + 1;
+	alloc[1] = 0;
+	buf[1] = NULL;
+	if ((buf[0] = malloc(alloc[0])) == NULL)
+		err(1, "Malloc failed :%s", oldfile);
+	if (fread(buf[0], 1, size, f) != (size_t)size)
+		err(1, "Read failed :%s", oldfile);
+	if (fclose(f))
+		err(1, "Close failed :%s", oldfile);
+	if (!matches(&l[0].p.h, 0, buf[0], size))
+		errx(1, "Old file does not match patch :%s\n", oldfile);
+
+	startload(&l[0], buf[0], size, 0);
+	for (k = 0;k < npatch;k++) {
+		finishload(&l[k]);
+
+		if (alloc[cur ^ 1] < l[k].p.h.newsize + 1) {
+			if ((p = realloc(buf[cur ^ 1], l[k].p.h.newsize + 1)) == NULL)
+				err(1, NULL);
+			buf[cur ^ 1] = p;
+			alloc[cur ^ 1] = l[k].p.h.newsize + 1;
+		};
+
+		/* Decode the next patch while this one is applied */
+		if ((k + 1 < npatch) && !l[k + 1].needsdict)
+			startload(&l[k + 1], NULL, 0, 1);
+
+		if (apply(&l[k].p, buf[cur], size, buf[cur ^ 1]))
+			errx(1, "Corrupt patch :%s\n", l[k].name);
+		size = l[k].p.h.newsize;
+		cur ^= 1;
+		if (!matches(&l[k].p.h, 1, buf[cur], size))
+			errx(1, "Patch produced the wrong output :%s\n", l[k].name);
+		patch_free(&l[k].p);
+
+		if ((k + 1 < npatch) && l[k + 1].needsdict)
+			startload(&l[k + 1], buf[cur], size, 0);
+	};
+
+	/* Only the final output is written */
+	if ((f = fopen(newfile, "wb")) == NULL)
+		err(1, "Create failed :%s", newfile);
+	if (fwrite(buf[cur], 1, size, f) != (size_t)size)
+		err(1, "Write failed :%s", newfile);
+	if (fclose(f))
+		err(1, "Close failed :%s", newfile);
+
+	free(buf[0]);
+	free(buf[1]);
+	free(l);
+
+	return 0;
+}
@@ -0,0 +1,320 @@
+/*
+ * Merging an A->B patch and a B->C patch into an A->C patch.
+ *
+ * Every byte of C is either d2 + B[q] (a diff byte of the second patch
+ * added to B) or e2 (an extra byte of it).  Every byte of B is in turn
+ * either d1 + A[p] or e1.  So, without ever materializing B, each diff
+ * run of the second patch splits along the runs of the first into
+ *	d1 + d2 added to A[p]	where B[q] came from A
+ *	e1 + d2 as extra bytes	where B[q] was an extra byte
+ *	d2 as extra bytes	where q lies outside B, which adds nothing
+ * and the pieces are packed back into (add, copy, seek) triples.  The
+ * A positions are carried through unchanged, including ones outside A,
+ * so the merged patch adds exactly what the two patches would have.
+ * Time and memory are linear in the decompressed patches; neither A
+ * nor B is read.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "ctrlcodec.h"
+#include "codec.h"
+#include "patchfile.h"
+#include "bspatch.h"
+
+typedef unsigned char u_char;
+
+/* A run of B that came from a single triple of the first patch */
+typedef struct segment {
+	long bpos;		/* start in B */
+	long len;
+	long apos;		/* start in A; extra runs have none */
+	u_char *src;		/* its diff or extra bytes */
+	int extra;
+} segment;
+
+/* The merged patch, with its last triple still open */
+typedef struct builder {
+	ctrlbuf cb;
+	u_char *db, *eb;
+	long dblen, eblen;
+	long add, copy;		/* the open triple */
+	long apos;		/* A position after its add run */
+} builder;
+
+static void loadpatch(const char *name, patchdata *p)
+{
+	FILE *f;
+	stream st;
+	int rc;
+
+	if ((f = fopen(name, "rb")) == NULL)
+		err(1, "fopen(%s)", name);
+	stream_file(&st, f);
+	switch (rc = patch_load(&st, p, NULL, 0)) {
+	case -1:
+		errx(1, "Corrupt patch :%s\n", name);
+		break;
+	case -2:
+		errx(1, "Patch uses a codec this bspatch lacks :%s\n", name);
+		break;
+	case -3:
+		/* A dictionary codec needs the patch's own old file to decode */
+		errx(1, "Cannot compose a patch that uses the %s codec :%s\n",
+			(p->h.c[1]->setdict != NULL) ? p->h.c[1]->name :
+			p->h.c[2]->name, name);
+		break;
+	};
+	if (fclose(f))
+		err(1, "fclose(%s)", name);
+	if (p->h.inplace)
+		errx(1, "Cannot compose an in-place patch :%s\n", name);
+}
+
+/* Split B into the runs the first patch writes it with */
+static segment *segments(const patchdata *p, const char *name, long *countp)
+{
+	segment *seg;
+	long oldpos, newpos, dpos, epos;
+	long i, n, *ctrl;
+
+	if ((seg = malloc((2 * p->cb.count + 1) * sizeof(segment))) == NULL)
+		err(1, NULL);
+
+	oldpos = 0;newpos = 0;dpos = 0;epos = 0;n = 0;
+	for (i = 0;(i < p->cb.count) && (newpos < p->h.newsize);i++) {
+		ctrl = p->cb.ctrl + 3 * i;
+
+		/* Sanity-check, as applying the patch would */
+		if ((ctrl[0] < 0) || (ctrl[1] < 0) ||
+			(newpos + ctrl[0] > p->h.newsize) ||
+			(newpos + ctrl[0] + ctrl[1] > p->h.newsize) ||
+			(dpos + ctrl[0] > p->dblen) || (epos + ctrl[1] > p->eblen))
+			errx(1, "Corrupt patch :%s\n", name);
+
+		if (ctrl[0] > 0) {
+			seg[n].bpos = newpos;
+			seg[n].len = ctrl[0];
+			seg[n].apos = oldpos;
+			seg[n].src = p->db + dpos;
+			seg[n++].extra = 0;
+		};
+		newpos += ctrl[0];
+		oldpos += ctrl[0];
+		dpos += ctrl[0];
+
+		if (ctrl[1] > 0) {
+			seg[n].bpos = newpos;
+			seg[n].len = ctrl[1];
+			seg[n].apos = 0;
+			seg[n].src = p->eb + epos;
+			seg[n++].extra = 1;
+		};
+		newpos += ctrl[1];
+		epos += ctrl[1];
+		oldpos += ctrl[2];
+	};
+	if (newpos < p->h.newsize)
+		errx(1, "Corrupt patch :%s\n", name);
+
+	*countp = n;
+	return seg;
+}
+
+/* Append len bytes added to A from apos on */
+static void addrun(builder *b, long apos, long len, const u_char *d1,
+	const u_char *d2)
+{
+	long i;
+
+	/* Extend the open triple if the run follows on in A; else close
+	   it, seeking to the new run */
+	if ((b->copy != 0) || (apos != b->apos)) {
+		if (ctrlbuf_push(&b->cb, b->add, b->copy, apos - b->apos))
+			err(1, NULL);
+		b->add = 0;
+		b->copy = 0;
+	};
+	for (i = 0;i < len;i++)
+		b->db[b->dblen + i] = d1[i] + d2[i];
+	b->dblen += len;
+	b->add += len;
+	b->apos = apos + len;
+}
+
+/* Append len extra bytes, e + d if d is not NULL */
+static void extrarun(builder *b, long len, const u_char *e, const u_char *d)
+{
+	long i;
+
+	if (d != NULL) {
+		for (i = 0;i < len;i++)
+			b->eb[b->eblen + i] = e[i] + d[i];
+	} else
+		memcpy(b->eb + b->eblen, e, len);
+	b->eblen += len;
+	b->copy += len;
+}
+
+/* Compress a block to f with codec c */
+static void writeblock(FILE *f, const codec *c, const u_char *buf, long len,
+	const char *name)
+{
+	stream st;
+	void *cs;
+
+	stream_file(&st, f);
+	if ((cs = c->wopen(&st, 0)) == NULL)
+		errx(1, "%s: open failed\n", c->name);
+	if (c->write(cs, buf, len))
+		errx(1, "%s: write failed :%s\n", c->name, name);
+	if (c->wclose(cs))
+		errx(1, "%s: close failed :%s\n", c->name, name);
+}
+
+int compose(const char *patch1, const char *patch2, const char *patchfile)
+{
+	patchdata p1, p2;
+	segment *seg;
+	builder b;
+	const codec *c[3];
+	u_char header[PATCH_MAXHDR], *ctrlblock;
+	long nseg, k, lo, hi;
+	long ctrllen, datalen, hdrlen, ctrlblocklen;
+	long oldpos, newpos, dpos, epos;
+	long i, j, len, *ctrl;
+	FILE *pf;
+
+	loadpatch(patch1, &p1);
+	loadpatch(patch2, &p2);
+	seg = segments(&p1, patch1, &nseg);
+
+	/* Neither stream of the result can outgrow C */
+	ctrlbuf_init(&b.cb);
+	if (((b.db = malloc(p2.h.newsize + 1)) == NULL) ||
+		((b.eb = malloc(p2.h.newsize + 1)) == NULL))
+		err(1, NULL);
+	b.dblen = 0;b.eblen = 0;
+	b.add = 0;b.copy = 0;b.apos = 0;
+
+	oldpos = 0;newpos = 0;dpos = 0;epos = 0;
+	for (i = 0;(i < p2.cb.count) && (newpos < p2.h.newsize);i++) {
+		ctrl = p2.cb.ctrl + 3 * i;
+		if ((ctrl[0] < 0) || (ctrl[1] < 0) ||
+			(newpos + ctrl[0] > p2.h.newsize) ||
+			(newpos + ctrl[0] + ctrl[1] > p2.h.newsize) ||
+			(dpos + ctrl[0] > p2.dblen) || (epos + ctrl[1] > p2.eblen))
+			errx(1, "Corrupt patch :%s\n", patch2);
+
+		/* Find the run of B that oldpos falls in */
+		lo = 0;hi = nseg;
+		while (hi - lo > 1) {
+			k = lo + (hi - lo) / 2;
+			if (seg[k].bpos <= oldpos) lo = k; else hi = k;
+		};
+		k = lo;
+
+		/* Split the add run of the second patch along the first */
+		for (j = 0;j < ctrl[0];j += len) {
+			if (oldpos + j < 0) {
+				len = ctrl[0] - j;
+				if (len > -(oldpos + j))
+					len = -(oldpos + j);
+				extrarun(&b, len, p2.db + dpos + j, NULL);
+				continue;
+			};
+			if (oldpos + j >= p1.h.newsize) {
+				len = ctrl[0] - j;
+				extrarun(&b, len, p2.db + dpos + j, NULL);
+				continue;
+			};
+			while (seg[k].bpos + seg[k].len <= oldpos + j)
+				k++;
+			len = seg[k].bpos + seg[k].len - (oldpos + j);
+			if (len > ctrl[0] - j)
+				len = ctrl[0] - j;
+			if (seg[k].extra)
+				extrarun(&b, len, seg[k].src + (oldpos + j - seg[k].bpos),
+					p2.db + dpos + j);
+			else
+				addrun(&b, seg[k].apos + (oldpos + j - seg[k].bpos), len,
+					seg[k].src + (oldpos + j - seg[k].bpos), p2.db + dpos + j);
+		};
+		extrarun(&b, ctrl[1], p2.eb + epos, NULL);
+
+		newpos += ctrl[0] + ctrl[1];
+		dpos += ctrl[0];
+		epos += ctrl[1];
+		oldpos += ctrl[0] + ctrl[2];
+	};
+	if (newpos < p2.h.newsize)
+		errx(1, "Corrupt patch :%s\n", patch2);
+	if ((b.add != 0) || (b.copy != 0))
+		if (ctrlbuf_push(&b.cb, b.add, b.copy, 0))
+			err(1, NULL);
+
+	/* The second patch's codecs, less any that want a dictionary */
+	for (i = 0;i < 3;i++)
+		c[i] = (p2.h.c[i]->setdict != NULL) ?
+			codec_find(CODEC_BZIP2) : p2.h.c[i];
+
+	/* Hashes of A from the first patch and of C from the second,
+	   if both have them */
+	memset(header, 0, sizeof(header));
+	hdrlen = 56;
+	if (p1.h.hashes && p2.h.hashes) {
+		hdrlen = 80;
+		memcpy(header + 56, p1.h.raw + 56, 8);
+		memcpy(header + 64, p2.h.raw + 64, 8);
+		if (p1.h.sha && p2.h.sha) {
+			hdrlen = 144;
+			header[72] = 1;
+			memcpy(header + 80, p1.h.raw + 80, SHA256_LEN);
+			memcpy(header + 112, p2.h.raw + 112, SHA256_LEN);
+		};
+	};
+
+	if ((ctrlblock = ctrl_encode(&b.cb, &ctrlblocklen)) == NULL)
+		err(1, NULL);
+
+	/* Write the blocks after room for the header, then the header */
+	if ((pf = fopen(patchfile, "wb")) == NULL)
+		err(1, "Create failed :%s", patchfile);
+	if (fwrite(header, hdrlen, 1, pf) != 1)
+		err(1, "Write failed :%s", patchfile);
+	writeblock(pf, c[0], ctrlblock, ctrlblocklen, patchfile);
+	if ((ctrllen = ftell(pf)) == -1)
+		err(1, "ftello");
+	ctrllen -= hdrlen;
+	writeblock(pf, c[1], b.db, b.dblen, patchfile);
+	if ((datalen = ftell(pf)) == -1)
+		err(1, "ftello");
+	datalen -= hdrlen + ctrllen;
+	writeblock(pf, c[2], b.eb, b.eblen, patchfile);
+	if ((len = ftell(pf)) == -1)
+		err(1, "ftello");
+
+	memcpy(header, "BSDIFF41", 8);
+	patch_offtout(hdrlen, header + 8);
+	patch_offtout(p2.h.newsize, header + 16);
+	patch_offtout(ctrllen, header + 24);
+	patch_offtout(datalen, header + 32);
+	patch_offtout(len - hdrlen - ctrllen - datalen, header + 40);
+	for (i = 0;i < 3;i++)
+		header[48 + i] = (u_char)c[i]->id;
+	if (fseek(pf, 0, SEEK_SET) || (fwrite(header, hdrlen, 1, pf) != 1))
+		err(1, "Write failed :%s", patchfile);
+	if (fclose(pf))
+		err(1, "Close failed :%s", patchfile);
+
+	free(ctrlblock);
+	free(seg);
+	free(b.db);
+	free(b.eb);
+	ctrlbuf_free(&b.cb);
+	patch_free(&p1);
+	patch_free(&p2);
+
+	return 0;
+}
@@ -0,0 +1,263 @@
+/*
+ * Applying in-place patches over the file itself (see inplace.h).
+ *
+ * Besides the ctrl block, only a few chunk buffers, the decoding rings
+ * and the scratch buffer the patch asks for are held in memory, however
+ * large the file.  The commands are checked against the file before the
+ * first write; if the diff or extra data turn out to be corrupt later,
+ * or the output does not hash right, the file is left damaged and
+ * bspatch says so.
+ */
+
+#include <io.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "ctrlcodec.h"
+#include "codec.h"
+#include "patchfile.h"
+#include "inplace.h"
+#include "ring.h"
+#include "bspatch.h"
+
+typedef unsigned char u_char;
+
+/* Decoded bytes buffered per block between its thread and the patcher */
+#define INPLACE_RING	(1 << 20)
+
+static void readat(FILE *f, const char *name, long off, u_char *buf, long len)
+{
+	if (fseek(f, off, SEEK_SET) ||
+		(fread(buf, 1, len, f) != (size_t)len))
+		err(1, "Read failed :%s", name);
+}
+
+static void writeat(FILE *f, const char *name, long off, const u_char *buf,
+	long len)
+{
+	if (fseek(f, off, SEEK_SET) ||
+		(fwrite(buf, 1, len, f) != (size_t)len))
+		err(1, "Write failed :%s", name);
+}
+
+/* Hash the size bytes of f */
+static void hashfile(FILE *f, const char *name, long size, u_char *buf,
+	xxh64_state *xs, sha256_state *ss, int sha)
+{
+	long i, n;
+
+	xxh64_init(xs);
+	sha256_init(ss);
+	if (fseek(f, 0, SEEK_SET))
+		err(1, "Seek failed :%s", name);
+	for (i = 0;i < size;i += n) {
+		n = (size - i < INPLACE_CHUNK) ? size - i : INPLACE_CHUNK;
+		if (fread(buf, 1, n, f) != (size_t)n)
+			err(1, "Read failed :%s", name);
+		xxh64_update(xs, buf, n);
+		if (sha)
+			sha256_update(ss, buf, n);
+	};
+}
+
+/* Open a FILE at the given offset of the patch and a decoder on it */
+static void *openblock(const char *patchfile, long off, long len,
+	const codec *c, FILE **fp, stream *st)
+{
+	void *cs;
+
+	if ((*fp = fopen(patchfile, "rb")) == NULL)
+		err(1, "fopen(%s)", patchfile);
+	if (fseek(*fp, off, SEEK_SET))
+		err(1, "fseeko(%s, %lld)", patchfile, (long long)off);
+	stream_file(st, *fp);
+	if ((cs = c->ropen(st, len)) == NULL)
+		errx(1, "%s: open failed\n", c->name);
+
+	return cs;
+}
+
+/* Copy from to file, which the patch is then applied over */
+static void copyfile(const char *from, const char *file, u_char *buf)
+{
+	FILE *fs, *fd;
+	size_t n;
+
+	if ((fs = fopen(from, "rb")) == NULL)
+		err(1, "Open failed :%s", from);
+	if ((fd = fopen(file, "wb")) == NULL)
+		err(1, "Create failed :%s", file);
+	while ((n = fread(buf, 1, INPLACE_CHUNK, fs)) > 0)
+		if (fwrite(buf, 1, n, fd) != n)
+			err(1, "Write failed :%s", file);
+	if (ferror(fs))
+		err(1, "Read failed :%s", from);
+	if (fclose(fs) || fclose(fd))
+		err(1, "Close failed :%s", file);
+}
+
+int inplace(const char *file, const char *from, const char *patchfile)
+{
+	FILE *f, *pf, *dpf, *epf;
+	stream ps, dio, eio;
+	patchhdr h;
+	ctrlbuf cb;
+	ring dring, ering;
+	void *ds, *es;
+	u_char *ctrlblock, *buf[2], *out, *scr;
+	long ctrlblocklen, oldsize, scrsize, sfill, end, dst, src, len, kind;
+	long *ctrl, i, j, n, next;
+	xxh64_state xs;
+	sha256_state ss;
+	int rc, cur;
+
+	if (((buf[0] = (u_char *)malloc(INPLACE_CHUNK)) == NULL) ||
+		((buf[1] = (u_char *)malloc(INPLACE_CHUNK)) == NULL) ||
+		((out = (u_char *)malloc(INPLACE_CHUNK)) == NULL))
+		err(1, NULL);
+
+	/* Read the header and the commands */
+	if ((pf = fopen(patchfile, "rb")) == NULL)
+		err(1, "fopen(%s)", patchfile);
+	stream_file(&ps, pf);
+	if ((rc = patch_readheader(&ps, &h)) == -2)
+		errx(1, "Patch uses a codec this bspatch lacks\n");
+	if (rc != 0) {
+		if (ferror(pf))
+			err(1, "fread(%s)", patchfile);
+		errx(1, "Corrupt patch\n");
+	};
+	if (!h.inplace || !h.hashes)
+		errx(1, "Not an in-place patch :%s\n", patchfile);
+	if (patch_needsdict(&h))
+		errx(1, "Corrupt patch\n");
+	ctrlbuf_init(&cb);
+	if (((ctrlblock = patch_readblock(&ps, h.hdrlen, h.ctrllen, h.c[0],
+		NULL, 0, &ctrlblocklen)) == NULL) ||
+		patch_readctrl(&h, ctrlblock, ctrlblocklen, &cb))
+		errx(1, "Corrupt patch\n");
+	free(ctrlblock);
+	if (fclose(pf))
+		err(1, "fclose(%s)", patchfile);
+
+	/* Apply to a copy of from if asked to, leaving from as it is */
+	if ((from != NULL) && (strcmp(from, file) != 0))
+		copyfile(from, file, out);
+	if ((f = fopen(file, "r+b")) == NULL)
+		err(1, "Open failed :%s", file);
+	if (fseek(f, 0, SEEK_END) != 0)
+		err(1, "Seek failed :%s", file);
+	oldsize = ftell(f);
+
+	/* Refuse the wrong file, and commands that reach outside it,
+	   before anything is written */
+	hashfile(f, file, oldsize, out, &xs, &ss, h.sha);
+	if (!patch_checkhash(&xs, &ss, h.raw + 56, h.sha ? h.raw + 80 : NULL))
+		errx(1, "Old file does not match patch :%s\n", file);
+	scrsize = 0;end = 0;
+	for (i = 0;i < cb.count;i++) {
+		ctrl = cb.ctrl + 3 * i;
+		kind = ctrl[2] & 3;
+		len = ctrl[2] >> 2;
+		if (len < 0)
+			errx(1, "Corrupt patch\n");
+		if (kind == INPLACE_PRELOAD) {
+			if ((ctrl[1] < 0) || (ctrl[1] > oldsize - len))
+				errx(1, "Corrupt patch\n");
+			scrsize += len;
+			continue;
+		};
+		dst = end + ctrl[0];
+		if ((dst < 0) || (dst > h.newsize - len) ||
+			((kind == INPLACE_COPY) && ((dst + ctrl[1] < 0) ||
+			(dst + ctrl[1] > oldsize - len))) ||
+			((kind == INPLACE_SCRATCH) && ((ctrl[1] < 0) ||
+			(ctrl[1] > scrsize - len))))
+			errx(1, "Corrupt patch\n");
+		end = dst + len;
+	};
+	if ((scr = (u_char *)malloc(scrsize + 1)) == NULL)
+		err(1, NULL);
+
+	ds = openblock(patchfile, h.hdrlen + h.ctrllen, h.datalen, h.c[1], &dpf,
+		&dio);
+	es = openblock(patchfile, h.hdrlen + h.ctrllen + h.datalen, h.extralen,
+		h.c[2], &epf, &eio);
+	/* A diff block whose codec adds as it decodes is decoded here
+	   unless there is a processor to spare for it */
+	if (ring_start(&dring, h.c[1], ds, ring_threaddiff(h.c[1], h.datalen,
+		h.extralen) ? INPLACE_RING : 0) ||
+		ring_start(&ering, h.c[2], es, INPLACE_RING))
+		err(1, NULL);
+
+	/* Run the commands.  A copy reads its next chunk before writing
+	   the last one, so it may overwrite up to a chunk of its own
+	   source ahead of where it reads. */
+	sfill = 0;end = 0;
+	for (i = 0;i < cb.count;i++) {
+		ctrl = cb.ctrl + 3 * i;
+		kind = ctrl[2] & 3;
+		len = ctrl[2] >> 2;
+		if (kind == INPLACE_PRELOAD) {
+			readat(f, file, ctrl[1], scr + sfill, len);
+			sfill += len;
+			continue;
+		};
+		dst = end + ctrl[0];
+		end = dst + len;
+
+		cur = 0;
+		src = dst + ctrl[1];
+		if ((kind == INPLACE_COPY) && (len > 0))
+			readat(f, file, src, buf[0],
+				(len < INPLACE_CHUNK) ? len : INPLACE_CHUNK);
+		for (j = 0;j < len;j += n) {
+			n = (len - j < INPLACE_CHUNK) ? len - j : INPLACE_CHUNK;
+			switch (kind) {
+			case INPLACE_COPY:
+				if (j + n < len) {
+					next = (len - j - n < INPLACE_CHUNK) ?
+						len - j - n : INPLACE_CHUNK;
+					readat(f, file, src + j + n, buf[cur ^ 1], next);
+				};
+				if (ring_readadd(&dring, out, buf[cur], n) != n)
+					errx(1, "Corrupt patch; %s is damaged\n", file);
+				cur ^= 1;
+				break;
+			case INPLACE_SCRATCH:
+				if (ring_readadd(&dring, out, scr + ctrl[1] + j, n) != n)
+					errx(1, "Corrupt patch; %s is damaged\n", file);
+				break;
+			default:
+				if (ring_read(&ering, out, n) != n)
+					errx(1, "Corrupt patch; %s is damaged\n", file);
+				break;
+			};
+			writeat(f, file, dst + j, out, n);
+		};
+	};
+
+	ring_stop(&dring);
+	ring_stop(&ering);
+	h.c[1]->rclose(ds);
+	h.c[2]->rclose(es);
+	if (fclose(dpf) || fclose(epf))
+		err(1, "fclose(%s)", patchfile);
+
+	/* Cut or extend the file to its new size, and check the result */
+	if (fflush(f) || _chsize_s(_fileno(f), h.newsize))
+		err(1, "Resize failed :%s", file);
+	hashfile(f, file, h.newsize, out, &xs, &ss, h.sha);
+	if (!patch_checkhash(&xs, &ss, h.raw + 64, h.sha ? h.raw + 112 : NULL))
+		errx(1, "Patch produced the wrong output; %s is damaged\n", file);
+	if (fclose(f))
+		err(1, "Close failed :%s", file);
+
+	ctrlbuf_free(&cb);
+	free(scr);
+	free(buf[0]);
+	free(buf[1]);
+	free(out);
+
+	return 0;
+}
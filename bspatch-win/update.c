@@ -0,0 +1,99 @@
+/*
+ * Writing the output over what newfile already holds (bspatch --update).
+ *
+ * The output is compared with the file UPDATE_BLOCK bytes at a time,
+ * and only the blocks that differ are written, neighbours together,
+ * so that a file that mostly stays the same is mostly left alone.
+ * Once a block has been written the file no longer holds what it did,
+ * and bspatch says so if it exits before update_close.
+ */
+
+#include <io.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "bspatch.h"
+
+typedef unsigned char u_char;
+
+#define UPDATE_BLOCK	4096
+
+static const char *damaged;
+
+static void saydamaged(void)
+{
+	if (damaged != NULL)
+		printf("%s is damaged\n", damaged);
+}
+
+void update_open(updater *u, const char *name, const u_char *same,
+	long samesize)
+{
+	static int registered;
+
+	if (((u->f = fopen(name, "r+b")) == NULL) &&
+		((u->f = fopen(name, "w+b")) == NULL))
+		err(1, "Create failed :%s", name);
+	if (!registered)
+		atexit(saydamaged);
+	registered = 1;
+	u->name = name;
+	u->pos = 0;
+	u->same = same;
+	u->samesize = samesize;
+	u->written = 0;
+}
+
+/* Write the stretch of buf that differs from the file, if any */
+static void writerun(updater *u, const u_char *buf, long off, long len)
+{
+	if (len == 0)
+		return;
+	if (fseek(u->f, off, SEEK_SET))
+		err(1, "Seek failed :%s", u->name);
+	damaged = u->name;
+	if (fwrite(buf, 1, len, u->f) != (size_t)len)
+		err(1, "Write failed :%s", u->name);
+	u->written += len;
+}
+
+void update_write(updater *u, const u_char *buf, long len)
+{
+	u_char cur[UPDATE_BLOCK];
+	long i, n, run, off;
+	int changed;
+
+	run = 0;
+	for (i = 0;i < len;i += n) {
+		off = u->pos + i;
+		n = UPDATE_BLOCK - off % UPDATE_BLOCK;
+		if (n > len - i)
+			n = len - i;
+		if (u->same != NULL)
+			changed = (off + n > u->samesize) ||
+				memcmp(u->same + off, buf + i, n);
+		else {
+			if (fseek(u->f, off, SEEK_SET))
+				err(1, "Seek failed :%s", u->name);
+			changed = (fread(cur, 1, n, u->f) != (size_t)n) ||
+				memcmp(cur, buf + i, n);
+		};
+		if (changed)
+			run += n;
+		else {
+			writerun(u, buf + i - run, off - run, run);
+			run = 0;
+		};
+	};
+	writerun(u, buf + len - run, u->pos + len - run, run);
+	u->pos += len;
+}
+
+void update_close(updater *u)
+{
+	if (fflush(u->f) || _chsize_s(_fileno(u->f), u->pos))
+		err(1, "Resize failed :%s", u->name);
+	damaged = NULL;
+	if (fclose(u->f) == -1)
+		err(1, "Close failed :%s", u->name);
+}
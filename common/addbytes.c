@@ -0,0 +1,177 @@
+/*
+ * Adding the old file into the diff string, the inner loop of bspatch.
+ */
+
+#include "addbytes.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || \
+	defined(__i386__)
+#define ADD_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#include <immintrin.h>
+#endif
+
+/* Visual Studio 2015 has no AVX-512 intrinsics */
+#if defined(ADD_X86) && !(defined(_MSC_VER) && (_MSC_VER < 1910))
+#define ADD_AVX512
+#endif
+
+/* GCC and clang only emit wider instructions in functions marked for
+   them; Visual C++ emits any intrinsic anywhere */
+#if defined(__GNUC__)
+#define TARGET(x)	__attribute__((target(x)))
+#else
+#define TARGET(x)
+#endif
+
+static void add_scalar(unsigned char *dst, const unsigned char *src, long n)
+{
+	long i;
+
+	for (i = 0;i < n;i++)
+		dst[i] += src[i];
+}
+
+#ifdef ADD_X86
+TARGET("sse2")
+static void add_sse2(unsigned char *dst, const unsigned char *src, long n)
+{
+	long i;
+
+	for (i = 0;i + 16 <= n;i += 16)
+		_mm_storeu_si128((__m128i *)(dst + i),
+			_mm_add_epi8(_mm_loadu_si128((const __m128i *)(dst + i)),
+			_mm_loadu_si128((const __m128i *)(src + i))));
+	add_scalar(dst + i, src + i, n - i);
+}
+
+TARGET("avx2")
+static void add_avx2(unsigned char *dst, const unsigned char *src, long n)
+{
+	long i;
+
+	for (i = 0;i + 64 <= n;i += 64) {
+		_mm256_storeu_si256((__m256i *)(dst + i),
+			_mm256_add_epi8(_mm256_loadu_si256((const __m256i *)(dst + i)),
+			_mm256_loadu_si256((const __m256i *)(src + i))));
+		_mm256_storeu_si256((__m256i *)(dst + i + 32),
+			_mm256_add_epi8(_mm256_loadu_si256((const __m256i *)(dst + i + 32)),
+			_mm256_loadu_si256((const __m256i *)(src + i + 32))));
+	};
+	for (;i + 32 <= n;i += 32)
+		_mm256_storeu_si256((__m256i *)(dst + i),
+			_mm256_add_epi8(_mm256_loadu_si256((const __m256i *)(dst + i)),
+			_mm256_loadu_si256((const __m256i *)(src + i))));
+	add_scalar(dst + i, src + i, n - i);
+}
+#endif
+
+#ifdef ADD_AVX512
+TARGET("avx512f,avx512bw")
+static void add_avx512(unsigned char *dst, const unsigned char *src, long n)
+{
+	__mmask64 m;
+	long i;
+
+	for (i = 0;i + 64 <= n;i += 64)
+		_mm512_storeu_si512((void *)(dst + i),
+			_mm512_add_epi8(_mm512_loadu_si512((const void *)(dst + i)),
+			_mm512_loadu_si512((const void *)(src + i))));
+
+	/* The tail in one masked step */
+	if (i < n) {
+		m = (__mmask64)(~0ULL >> (64 - (n - i)));
+		_mm512_mask_storeu_epi8(dst + i, m,
+			_mm512_add_epi8(_mm512_maskz_loadu_epi8(m, dst + i),
+			_mm512_maskz_loadu_epi8(m, src + i)));
+	};
+}
+#endif
+
+#ifdef ADD_X86
+static void cpuid(int leaf, int sub, unsigned int r[4])
+{
+#ifdef _MSC_VER
+	__cpuidex((int *)r, leaf, sub);
+#else
+	__cpuid_count(leaf, sub, r[0], r[1], r[2], r[3]);
+#endif
+}
+
+/* Which register states the OS saves across context switches */
+static unsigned long long xgetbv0(void)
+{
+#ifdef _MSC_VER
+	return _xgetbv(0);
+#else
+	unsigned int lo, hi;
+
+	__asm__ ("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+	return ((unsigned long long)hi << 32) | lo;
+#endif
+}
+#endif
+
+static void add_init(unsigned char *dst, const unsigned char *src, long n);
+
+/* Set on first use; every thread would pick the same kernel */
+static void (*add_kernel)(unsigned char *, const unsigned char *, long) =
+	add_init;
+
+static void add_init(unsigned char *dst, const unsigned char *src, long n)
+{
+	void (*k)(unsigned char *, const unsigned char *, long);
+#ifdef ADD_X86
+	unsigned int r1[4], r7[4], max;
+	unsigned long long xcr0;
+
+	k = add_scalar;
+	cpuid(0, 0, r1);
+	max = r1[0];
+	if (max >= 1) {
+		cpuid(1, 0, r1);
+		if (r1[3] & (1U << 26))
+			k = add_sse2;
+
+		/* AVX needs OSXSAVE and the OS saving the YMM (and for
+		   AVX-512, the opmask and ZMM) registers */
+		if ((max >= 7) && (r1[2] & (1U << 27)) && (r1[2] & (1U << 28))) {
+			xcr0 = xgetbv0();
+			cpuid(7, 0, r7);
+			if (((xcr0 & 0x6) == 0x6) && (r7[1] & (1U << 5)))
+				k = add_avx2;
+#ifdef ADD_AVX512
+			if (((xcr0 & 0xE6) == 0xE6) && (r7[1] & (1U << 16)) &&
+				(r7[1] & (1U << 30)))
+				k = add_avx512;
+#endif
+		};
+	};
+#else
+	k = add_scalar;
+#endif
+
+	add_kernel = k;
+	k(dst, src, n);
+}
+
+void add_bytes(unsigned char *dst, const unsigned char *src, long n)
+{
+	add_kernel(dst, src, n);
+}
+
+void add_from(unsigned char *dst, const unsigned char *src, long srclen,
+	long srcpos, long n)
+{
+	long lo, hi;
+
+	/* The part of [srcpos, srcpos + n) inside src, found once */
+	lo = (srcpos < 0) ? -srcpos : 0;
+	hi = (srcpos + n > srclen) ? srclen - srcpos : n;
+	if (lo < hi)
+		add_kernel(dst + lo, src + srcpos + lo, hi - lo);
+}
@@ -0,0 +1,15 @@
+#pragma once
+/*
+ * Adding the old file into the diff string, the inner loop of bspatch.
+ *
+ * The kernel is picked on first use from what the CPU supports: AVX-512
+ * (with byte ops), AVX2, SSE2, or plain C elsewhere.
+ */
+
+/* dst[i] += src[i] for 0 <= i < n */
+void add_bytes(unsigned char *dst, const unsigned char *src, long n);
+
+/* dst[i] += src[srcpos + i] for 0 <= i < n, skipping the i for which
+   srcpos + i falls outside [0, srclen) */
+void add_from(unsigned char *dst, const unsigned char *src, long srclen,
+	long srcpos, long n);
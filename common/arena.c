@@ -0,0 +1,252 @@
+/*
+ * Single region allocation (see arena.h).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+#include "arena.h"
+
+void arena_init(arena *a)
+{
+	a->base = NULL;
+	a->size = 0;
+	a->used = 0;
+	a->huge = 0;
+	a->large = 0;
+	a->file = 0;
+	a->keep = 0;
+}
+
+size_t arena_need(size_t n)
+{
+	return (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+#ifdef _WIN32
+static unsigned char *arena_map(size_t *size, int huge, int *gothuge)
+{
+	unsigned char *p;
+	size_t page;
+
+	*gothuge = 0;
+	if (huge && ((page = GetLargePageMinimum()) != 0)) {
+		p = (unsigned char *)VirtualAlloc(NULL,
+			(*size + page - 1) & ~(page - 1),
+			MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+		if (p != NULL) {
+			*size = (*size + page - 1) & ~(page - 1);
+			*gothuge = 1;
+			return p;
+		};
+	};
+
+	return (unsigned char *)VirtualAlloc(NULL, *size,
+		MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+}
+
+static void arena_unmap(unsigned char *p, size_t size)
+{
+	VirtualFree(p, 0, MEM_RELEASE);
+}
+
+int arena_mapfile(arena *a, const char *name, size_t size,
+	const char *magic, size_t len)
+{
+	unsigned long long n;
+	LARGE_INTEGER fsize;
+	char head[ARENA_ALIGN];
+	DWORD got;
+
+	arena_free(a);
+	if (size == 0)
+		size = ARENA_ALIGN;
+	a->fh = CreateFileA(name, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+		CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+	if ((a->fh == INVALID_HANDLE_VALUE) &&
+		(GetLastError() == ERROR_FILE_EXISTS)) {
+		a->fh = CreateFileA(name, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+			OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (a->fh == INVALID_HANDLE_VALUE)
+			return -1;
+		if (!GetFileSizeEx(a->fh, &fsize)) {
+			CloseHandle(a->fh);
+			return -1;
+		};
+		if ((fsize.QuadPart != 0) && (!ReadFile(a->fh, head, (DWORD)len,
+			&got, NULL) || (got != len) || (memcmp(head, magic, len) != 0))) {
+			CloseHandle(a->fh);
+			return -2;
+		};
+	};
+	if (a->fh == INVALID_HANDLE_VALUE)
+		return -1;
+
+	/* The mapping grows the file to size */
+	n = size;
+	a->mh = CreateFileMappingA(a->fh, NULL, PAGE_READWRITE,
+		(DWORD)(n >> 32), (DWORD)n, NULL);
+	if (a->mh == NULL) {
+		CloseHandle(a->fh);
+		return -1;
+	};
+	a->base = (unsigned char *)MapViewOfFile(a->mh, FILE_MAP_WRITE, 0, 0,
+		size);
+	if (a->base == NULL) {
+		CloseHandle(a->mh);
+		CloseHandle(a->fh);
+		return -1;
+	};
+	a->size = size;
+	a->file = 1;
+	a->keep = size;
+
+	return 0;
+}
+
+static void arena_unmapfile(arena *a)
+{
+	LARGE_INTEGER n;
+
+	UnmapViewOfFile(a->base);
+	CloseHandle(a->mh);
+	n.QuadPart = (LONGLONG)a->keep;
+	if (SetFilePointerEx(a->fh, n, NULL, FILE_BEGIN))
+		SetEndOfFile(a->fh);
+	CloseHandle(a->fh);
+}
+#else
+/* Transparent huge pages come in this size on x86-64 and arm64 */
+#define ARENA_HUGE	(2UL << 20)
+
+static unsigned char *arena_map(size_t *size, int huge, int *gothuge)
+{
+	void *p;
+
+	*gothuge = 0;
+	if (huge)
+		*size = (*size + ARENA_HUGE - 1) & ~(size_t)(ARENA_HUGE - 1);
+	p = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+#ifdef MADV_HUGEPAGE
+	if (huge && (madvise(p, *size, MADV_HUGEPAGE) == 0))
+		*gothuge = 1;
+#endif
+
+	return (unsigned char *)p;
+}
+
+static void arena_unmap(unsigned char *p, size_t size)
+{
+	munmap(p, size);
+}
+
+int arena_mapfile(arena *a, const char *name, size_t size,
+	const char *magic, size_t len)
+{
+	struct stat sb;
+	char head[ARENA_ALIGN];
+	void *p;
+
+	arena_free(a);
+	if (size == 0)
+		size = ARENA_ALIGN;
+	if ((a->fd = open(name, O_RDWR | O_CREAT | O_EXCL, 0666)) == -1) {
+		if ((errno != EEXIST) || ((a->fd = open(name, O_RDWR)) == -1))
+			return -1;
+		if (fstat(a->fd, &sb) != 0) {
+			close(a->fd);
+			return -1;
+		};
+		if ((sb.st_size != 0) && ((read(a->fd, head, len) != (ssize_t)len) ||
+			(memcmp(head, magic, len) != 0))) {
+			close(a->fd);
+			return -2;
+		};
+	};
+	if ((fstat(a->fd, &sb) != 0) ||
+		(((size_t)sb.st_size < size) && (ftruncate(a->fd, size) != 0)) ||
+		((p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, a->fd,
+		0)) == MAP_FAILED)) {
+		close(a->fd);
+		return -1;
+	};
+	a->base = (unsigned char *)p;
+	a->size = size;
+	a->file = 1;
+	a->keep = size;
+
+	return 0;
+}
+
+static void arena_unmapfile(arena *a)
+{
+	munmap(a->base, a->size);
+	/* Failing only leaves the file longer than it need be */
+	(void)!ftruncate(a->fd, (off_t)a->keep);
+	close(a->fd);
+}
+#endif
+
+void arena_keep(arena *a, size_t n)
+{
+	if (n < a->keep)
+		a->keep = n;
+}
+
+int arena_reserve(arena *a, size_t size, int huge)
+{
+	int gothuge;
+
+	a->used = 0;
+	if ((a->base != NULL) && !a->file && (size <= a->size) &&
+		(a->huge || !huge))
+		return 0;
+	arena_free(a);
+	if (size == 0)
+		size = ARENA_ALIGN;
+	if ((a->base = arena_map(&size, huge, &gothuge)) == NULL)
+		return -1;
+	a->size = size;
+	a->huge = huge;
+	a->large = gothuge;
+
+	return 0;
+}
+
+void *arena_alloc(arena *a, size_t n)
+{
+	void *p;
+
+	n = arena_need(n);
+	if (n > a->size - a->used)
+		return NULL;
+	p = a->base + a->used;
+	a->used += n;
+
+	return p;
+}
+
+void arena_reset(arena *a)
+{
+	a->used = 0;
+}
+
+void arena_free(arena *a)
+{
+	if ((a->base != NULL) && a->file)
+		arena_unmapfile(a);
+	else if (a->base != NULL)
+		arena_unmap(a->base, a->size);
+	arena_init(a);
+}
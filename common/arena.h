@@ -0,0 +1,67 @@
+#pragma once
+/*
+ * One region of memory that a job's large buffers are carved out of,
+ * instead of a malloc() each: a single VirtualAlloc or mmap sized up
+ * front, handed out by bumping a pointer and taken back all at once.
+ * Kept between jobs, it is only remapped when a job needs more.
+ *
+ * With huge set the region is asked to be backed by large pages: on
+ * Windows MEM_LARGE_PAGES, which needs the lock pages privilege, and
+ * elsewhere transparent huge pages through madvise.  Either way it is
+ * only a request, and small pages are used if it is refused.
+ *
+ * An arena can also be the shared mapping of a file: the system then
+ * pages it to and from the file, and what it holds is left in the file
+ * when it is unmapped.
+ */
+
+#include <stddef.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+/* Every allocation starts on a boundary of this many bytes */
+#define ARENA_ALIGN	64
+
+typedef struct arena {
+	unsigned char *base;
+	size_t size;		/* bytes mapped */
+	size_t used;		/* bytes handed out */
+	int huge;		/* 1 if large pages were asked for, */
+	int large;		/* and 1 if they were granted */
+	int file;		/* 1 if it maps a file (arena_mapfile) */
+	size_t keep;		/* the bytes of the file kept at unmapping */
+#ifdef _WIN32
+	HANDLE fh, mh;		/* the file and its mapping */
+#else
+	int fd;
+#endif
+} arena;
+
+void arena_init(arena *a);
+
+/* The bytes an allocation of n takes up, for sizing arena_reserve */
+size_t arena_need(size_t n);
+
+/* Empty a and make sure it holds at least size bytes, remapping it if
+   it is smaller, or if huge is set and it was mapped without; returns
+   0, or -1 if out of memory */
+int arena_reserve(arena *a, size_t size, int huge);
+
+/* Empty a and map it onto the file name, created or made at least size
+   bytes long, keeping what the file holds; returns 0, -1, or -2 if the
+   file is there, not empty, and does not start with the len bytes at
+   magic, which it is then left alone for.  len is at most ARENA_ALIGN. */
+int arena_mapfile(arena *a, const char *name, size_t size,
+	const char *magic, size_t len);
+/* Have the file a maps cut to its first n bytes when a is unmapped */
+void arena_keep(arena *a, size_t n);
+
+/* Returns n bytes, or NULL if a has not that many left */
+void *arena_alloc(arena *a, size_t n);
+
+/* Hand out everything again from the start */
+void arena_reset(arena *a);
+
+/* Unmap a, cutting its file if it maps one; it can be reserved again */
+void arena_free(arena *a);
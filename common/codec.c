@@ -0,0 +1,767 @@
+/*
+ * Codec table and the bzip2, store, zstd and xz codecs.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <bzlib.h>
+#ifdef BSDIFF_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef BSDIFF_HAVE_LZMA
+#include <lzma.h>
+#endif
+#include "codec.h"
+#include "addbytes.h"
+
+#define IOBUFSIZE 65536
+
+/* Read up to IOBUFSIZE bytes of what is left of a compressed block */
+static long blockfill(stream *f, long *left, char *buf)
+{
+	long n;
+
+	n = *left < IOBUFSIZE ? *left : IOBUFSIZE;
+	if ((n > 0) && (stream_read(f, buf, n) != n))
+		return -1;
+	*left -= n;
+
+	return n;
+}
+
+/* bzip2, through the low-level interface so that blocks can be flushed */
+
+/* A decoder keeps the memory bzip2 frees, its state and the tables
+   sized by the block size, for the next block it is reopened on */
+#define BZCACHE	4
+
+typedef struct bzblock {
+	void *p;
+	int len;
+	int used;
+} bzblock;
+
+typedef struct bzstate {
+	bz_stream strm;
+	stream *f;
+	long left;
+	int end;
+	bzblock cache[BZCACHE];
+	char buf[IOBUFSIZE];
+} bzstate;
+
+static void *bz_wopen(stream *f, int level)
+{
+	bzstate *s;
+
+	if ((s = (bzstate *)malloc(sizeof(bzstate))) == NULL)
+		return NULL;
+	memset(&s->strm, 0, sizeof(s->strm));
+	if (BZ2_bzCompressInit(&s->strm, level ? level : 9, 0, 0) != BZ_OK) {
+		free(s);
+		return NULL;
+	};
+	s->f = f;
+
+	return s;
+}
+
+/* bzip2 sets aside eight bytes for each of the level times 100000 of
+   its block, and 400 KB besides */
+static size_t bz_wmemory(int level, long len, long dictlen)
+{
+	return sizeof(bzstate) + ((size_t)400 << 10) +
+		(size_t)8 * 100000 * (level ? level : 9);
+}
+
+/* The smallest block that holds len bytes, less the 19 bzip2 keeps */
+static int bz_wlevel(long len)
+{
+	return (len < 9 * 100000L - 19) ? (int)((len + 19) / 100000) + 1 : 9;
+}
+
+/* Run the compressor with the given action until it wants more input */
+static int bz_run(bzstate *s, int action, int done)
+{
+	int rc;
+	size_t n;
+
+	do {
+		s->strm.next_out = s->buf;
+		s->strm.avail_out = IOBUFSIZE;
+		rc = BZ2_bzCompress(&s->strm, action);
+		if ((rc != BZ_RUN_OK) && (rc != BZ_FLUSH_OK) &&
+			(rc != BZ_FINISH_OK) && (rc != BZ_STREAM_END))
+			return -1;
+		n = IOBUFSIZE - s->strm.avail_out;
+		if ((n > 0) && stream_write(s->f, s->buf, n))
+			return -1;
+	} while ((action == BZ_RUN) ? (s->strm.avail_in > 0) : (rc != done));
+
+	return 0;
+}
+
+static int bz_write(void *p, const void *buf, long len)
+{
+	bzstate *s = (bzstate *)p;
+	unsigned int n;
+
+	while (len > 0) {
+		n = len > 0x40000000 ? 0x40000000 : (unsigned int)len;
+		s->strm.next_in = (char *)buf;
+		s->strm.avail_in = n;
+		if (bz_run(s, BZ_RUN, BZ_RUN_OK))
+			return -1;
+		buf = (const char *)buf + n;
+		len -= n;
+	};
+
+	return 0;
+}
+
+static int bz_flush(void *p)
+{
+	return bz_run((bzstate *)p, BZ_FLUSH, BZ_RUN_OK);
+}
+
+static int bz_wclose(void *p)
+{
+	bzstate *s = (bzstate *)p;
+	int rc;
+
+	rc = bz_run(s, BZ_FINISH, BZ_STREAM_END);
+	BZ2_bzCompressEnd(&s->strm);
+	free(s);
+
+	return rc;
+}
+
+static void *bz_alloc(void *p, int n, int m)
+{
+	bzstate *s = (bzstate *)p;
+	bzblock *b;
+	void *q;
+	int i;
+
+	for (i = 0;i < BZCACHE;i++) {
+		b = s->cache + i;
+		if ((b->p != NULL) && !b->used && (b->len == n * m)) {
+			b->used = 1;
+			return b->p;
+		};
+	};
+
+	/* Note the new block in an empty slot, or one no longer wanted */
+	if ((q = malloc((size_t)n * m)) == NULL)
+		return NULL;
+	for (i = 0;i < BZCACHE;i++) {
+		b = s->cache + i;
+		if ((b->p == NULL) || !b->used) {
+			free(b->p);
+			b->p = q;
+			b->len = n * m;
+			b->used = 1;
+			break;
+		};
+	};
+
+	return q;
+}
+
+static void bz_free(void *p, void *q)
+{
+	bzstate *s = (bzstate *)p;
+	int i;
+
+	for (i = 0;i < BZCACHE;i++)
+		if (s->cache[i].p == q) {
+			s->cache[i].used = 0;
+			return;
+		};
+	free(q);
+}
+
+static void bz_freecache(bzstate *s)
+{
+	int i;
+
+	for (i = 0;i < BZCACHE;i++) {
+		free(s->cache[i].p);
+		s->cache[i].p = NULL;
+	};
+}
+
+/* Start decoding a block; returns 0, or -1 */
+static int bz_start(bzstate *s, stream *f, long len)
+{
+	memset(&s->strm, 0, sizeof(s->strm));
+	s->strm.bzalloc = bz_alloc;
+	s->strm.bzfree = bz_free;
+	s->strm.opaque = s;
+	if (BZ2_bzDecompressInit(&s->strm, 0, 0) != BZ_OK)
+		return -1;
+	s->f = f;
+	s->left = len;
+	s->end = 0;
+
+	return 0;
+}
+
+static void *bz_ropen(stream *f, long len)
+{
+	bzstate *s;
+
+	if ((s = (bzstate *)malloc(sizeof(bzstate))) == NULL)
+		return NULL;
+	memset(s->cache, 0, sizeof(s->cache));
+	if (bz_start(s, f, len)) {
+		bz_freecache(s);
+		free(s);
+		return NULL;
+	};
+
+	return s;
+}
+
+/* Decode len bytes to buf, adding add[i] to each if add is not NULL */
+#define BZADDCHUNK	16384
+
+static long bz_decode(bzstate *s, void *buf, const void *add, long len)
+{
+	long n, done;
+	int rc;
+
+	for (done = 0;(done < len) && !s->end;) {
+		if (s->strm.avail_in == 0) {
+			if ((n = blockfill(s->f, &s->left, s->buf)) <= 0)
+				return -1;
+			s->strm.next_in = s->buf;
+			s->strm.avail_in = (unsigned int)n;
+		};
+		n = len - done > 0x40000000 ? 0x40000000 : len - done;
+		if ((add != NULL) && (n > BZADDCHUNK))
+			n = BZADDCHUNK;
+		s->strm.next_out = (char *)buf + done;
+		s->strm.avail_out = (unsigned int)n;
+		rc = BZ2_bzDecompress(&s->strm);
+		if (rc == BZ_STREAM_END)
+			s->end = 1;
+		else if (rc != BZ_OK)
+			return -1;
+		n -= s->strm.avail_out;
+
+		/* Add while the bytes are still in L1 */
+		if (add != NULL)
+			add_bytes((unsigned char *)buf + done,
+				(const unsigned char *)add + done, n);
+		done += n;
+	};
+
+	return done;
+}
+
+static long bz_read(void *p, void *buf, long len)
+{
+	return bz_decode((bzstate *)p, buf, NULL, len);
+}
+
+static long bz_readadd(void *p, void *buf, const void *add, long len)
+{
+	return bz_decode((bzstate *)p, buf, add, len);
+}
+
+static void bz_rclose(void *p)
+{
+	bzstate *s = (bzstate *)p;
+
+	BZ2_bzDecompressEnd(&s->strm);
+	bz_freecache(s);
+	free(s);
+}
+
+static void *bz_rreopen(void *p, stream *f, long len)
+{
+	bzstate *s = (bzstate *)p;
+
+	BZ2_bzDecompressEnd(&s->strm);
+	if (bz_start(s, f, len)) {
+		bz_freecache(s);
+		free(s);
+		return NULL;
+	};
+
+	return s;
+}
+
+static const codec bzip2_codec = {
+	CODEC_BZIP2, "bzip2",
+	bz_wopen, bz_write, bz_flush, bz_wclose, bz_wmemory,
+	bz_ropen, bz_read, bz_rclose,
+	NULL,
+	bz_readadd,
+	bz_rreopen,
+	bz_wlevel
+};
+
+/* store: the block is the data itself */
+
+typedef struct storestate {
+	stream *f;
+	long left;
+} storestate;
+
+static void *store_wopen(stream *f, int level)
+{
+	storestate *s;
+
+	if ((s = (storestate *)malloc(sizeof(storestate))) != NULL)
+		s->f = f;
+
+	return s;
+}
+
+static int store_write(void *p, const void *buf, long len)
+{
+	storestate *s = (storestate *)p;
+
+	if ((len > 0) && stream_write(s->f, buf, len))
+		return -1;
+
+	return 0;
+}
+
+static int store_flush(void *p)
+{
+	return 0;
+}
+
+static int store_wclose(void *p)
+{
+	free(p);
+	return 0;
+}
+
+static void *store_ropen(stream *f, long len)
+{
+	storestate *s;
+
+	if ((s = (storestate *)malloc(sizeof(storestate))) != NULL) {
+		s->f = f;
+		s->left = len;
+	};
+
+	return s;
+}
+
+static long store_read(void *p, void *buf, long len)
+{
+	storestate *s = (storestate *)p;
+
+	if (len > s->left)
+		len = s->left;
+	if ((len > 0) && (stream_read(s->f, buf, len) != len))
+		return -1;
+	s->left -= len;
+
+	return len;
+}
+
+static void store_rclose(void *p)
+{
+	free(p);
+}
+
+static size_t store_wmemory(int level, long len, long dictlen)
+{
+	return sizeof(storestate);
+}
+
+static const codec store_codec = {
+	CODEC_STORE, "store",
+	store_wopen, store_write, store_flush, store_wclose, store_wmemory,
+	store_ropen, store_read, store_rclose,
+	NULL,
+	NULL,
+	NULL,
+	NULL
+};
+
+#ifdef BSDIFF_HAVE_ZSTD
+/* zstd */
+
+typedef struct zstdstate {
+	ZSTD_CStream *cs;
+	ZSTD_DStream *ds;
+	stream *f;
+	long left;
+	int end;
+	ZSTD_inBuffer in;
+	char buf[IOBUFSIZE];
+} zstdstate;
+
+static void *zstd_wopen(stream *f, int level)
+{
+	zstdstate *s;
+
+	if ((s = (zstdstate *)malloc(sizeof(zstdstate))) == NULL)
+		return NULL;
+	if ((s->cs = ZSTD_createCStream()) == NULL) {
+		free(s);
+		return NULL;
+	};
+	if (ZSTD_isError(ZSTD_initCStream(s->cs, level ? level : 19))) {
+		ZSTD_freeCStream(s->cs);
+		free(s);
+		return NULL;
+	};
+	s->ds = NULL;
+	s->f = f;
+
+	return s;
+}
+
+static int zstd_run(zstdstate *s, ZSTD_inBuffer *in, ZSTD_EndDirective mode)
+{
+	ZSTD_outBuffer out;
+	size_t rc;
+
+	do {
+		out.dst = s->buf;
+		out.size = IOBUFSIZE;
+		out.pos = 0;
+		rc = ZSTD_compressStream2(s->cs, &out, in, mode);
+		if (ZSTD_isError(rc))
+			return -1;
+		if ((out.pos > 0) && stream_write(s->f, s->buf, (long)out.pos))
+			return -1;
+	} while ((mode == ZSTD_e_continue) ? (in->pos < in->size) : (rc != 0));
+
+	return 0;
+}
+
+static int zstd_write(void *p, const void *buf, long len)
+{
+	ZSTD_inBuffer in;
+
+	in.src = buf;
+	in.size = len;
+	in.pos = 0;
+
+	return zstd_run((zstdstate *)p, &in, ZSTD_e_continue);
+}
+
+static int zstd_flush(void *p)
+{
+	ZSTD_inBuffer in = { NULL, 0, 0 };
+
+	return zstd_run((zstdstate *)p, &in, ZSTD_e_flush);
+}
+
+static int zstd_wclose(void *p)
+{
+	zstdstate *s = (zstdstate *)p;
+	ZSTD_inBuffer in = { NULL, 0, 0 };
+	int rc;
+
+	rc = zstd_run(s, &in, ZSTD_e_end);
+	ZSTD_freeCStream(s->cs);
+	free(s);
+
+	return rc;
+}
+
+static void *zstd_ropen(stream *f, long len)
+{
+	zstdstate *s;
+
+	if ((s = (zstdstate *)malloc(sizeof(zstdstate))) == NULL)
+		return NULL;
+	if ((s->ds = ZSTD_createDStream()) == NULL) {
+		free(s);
+		return NULL;
+	};
+	ZSTD_initDStream(s->ds);
+	s->cs = NULL;
+	s->f = f;
+	s->left = len;
+	s->end = 0;
+	s->in.src = s->buf;
+	s->in.size = 0;
+	s->in.pos = 0;
+
+	return s;
+}
+
+static long zstd_read(void *p, void *buf, long len)
+{
+	zstdstate *s = (zstdstate *)p;
+	ZSTD_outBuffer out;
+	long n;
+	size_t rc;
+
+	out.dst = buf;
+	out.size = len;
+	out.pos = 0;
+	while ((out.pos < out.size) && !s->end) {
+		if (s->in.pos == s->in.size) {
+			if ((n = blockfill(s->f, &s->left, s->buf)) <= 0)
+				return -1;
+			s->in.size = n;
+			s->in.pos = 0;
+		};
+		rc = ZSTD_decompressStream(s->ds, &out, &s->in);
+		if (ZSTD_isError(rc))
+			return -1;
+		if ((rc == 0) && (s->left == 0) && (s->in.pos == s->in.size))
+			s->end = 1;
+	};
+
+	return (long)out.pos;
+}
+
+static void zstd_rclose(void *p)
+{
+	zstdstate *s = (zstdstate *)p;
+
+	ZSTD_freeDStream(s->ds);
+	free(s);
+}
+
+/* The default level, 19, has a hash table of 4 << 22 bytes and a
+   binary tree of 4 << 24, and buffers its window, of 8 MB, or with a
+   dictionary of twice that as zstd_setdict widens it to */
+static size_t zstd_wmemory(int level, long len, long dictlen)
+{
+	size_t w;
+
+	w = (size_t)1 << 23;
+	if (dictlen > 0)
+		for (w = 1;w < 2 * (size_t)dictlen;w *= 2);
+	return sizeof(zstdstate) + ((size_t)4 << 22) + ((size_t)4 << 24) + w +
+		((size_t)2 << 20);
+}
+
+/* The dictionary is referenced as a raw prefix of the block's one
+   frame, as zstd's --patch-from does, with the window widened to
+   reach back over all of it */
+static void zstd_setdict(void *p, const void *dict, long len)
+{
+	zstdstate *s = (zstdstate *)p;
+	ZSTD_bounds b;
+	int wlog;
+
+	if (s->cs != NULL) {
+		b = ZSTD_cParam_getBounds(ZSTD_c_windowLog);
+		for (wlog = b.lowerBound;(wlog < b.upperBound) &&
+			((size_t)1 << wlog) < 2 * (size_t)len;wlog++);
+		ZSTD_CCtx_setParameter(s->cs, ZSTD_c_windowLog, wlog);
+		ZSTD_CCtx_refPrefix(s->cs, dict, len);
+	} else {
+		b = ZSTD_dParam_getBounds(ZSTD_d_windowLogMax);
+		ZSTD_DCtx_setParameter(s->ds, ZSTD_d_windowLogMax, b.upperBound);
+		ZSTD_DCtx_refPrefix(s->ds, dict, len);
+	};
+}
+
+static const codec zstd_codec = {
+	CODEC_ZSTD, "zstd",
+	zstd_wopen, zstd_write, zstd_flush, zstd_wclose, zstd_wmemory,
+	zstd_ropen, zstd_read, zstd_rclose,
+	NULL,
+	NULL,
+	NULL,
+	NULL
+};
+
+static const codec zstddict_codec = {
+	CODEC_ZSTDDICT, "zstd-dict",
+	zstd_wopen, zstd_write, zstd_flush, zstd_wclose, zstd_wmemory,
+	zstd_ropen, zstd_read, zstd_rclose,
+	zstd_setdict,
+	NULL,
+	NULL,
+	NULL
+};
+#endif
+
+#ifdef BSDIFF_HAVE_LZMA
+/* xz */
+
+typedef struct xzstate {
+	lzma_stream strm;
+	stream *f;
+	long left;
+	int end;
+	uint8_t buf[IOBUFSIZE];
+} xzstate;
+
+static void *xz_wopen(stream *f, int level)
+{
+	xzstate *s;
+	lzma_stream init = LZMA_STREAM_INIT;
+
+	if ((s = (xzstate *)malloc(sizeof(xzstate))) == NULL)
+		return NULL;
+	s->strm = init;
+	if (lzma_easy_encoder(&s->strm, level ? level : 9,
+		LZMA_CHECK_NONE) != LZMA_OK) {
+		free(s);
+		return NULL;
+	};
+	s->f = f;
+
+	return s;
+}
+
+static int xz_run(xzstate *s, lzma_action action)
+{
+	lzma_ret rc;
+	size_t n;
+
+	do {
+		s->strm.next_out = s->buf;
+		s->strm.avail_out = IOBUFSIZE;
+		rc = lzma_code(&s->strm, action);
+		if ((rc != LZMA_OK) && (rc != LZMA_STREAM_END))
+			return -1;
+		n = IOBUFSIZE - s->strm.avail_out;
+		if ((n > 0) && stream_write(s->f, s->buf, n))
+			return -1;
+	} while ((action == LZMA_RUN) ? (s->strm.avail_in > 0) :
+		(rc != LZMA_STREAM_END));
+
+	return 0;
+}
+
+static int xz_write(void *p, const void *buf, long len)
+{
+	xzstate *s = (xzstate *)p;
+
+	s->strm.next_in = (const uint8_t *)buf;
+	s->strm.avail_in = len;
+
+	return xz_run(s, LZMA_RUN);
+}
+
+static int xz_flush(void *p)
+{
+	return xz_run((xzstate *)p, LZMA_SYNC_FLUSH);
+}
+
+static int xz_wclose(void *p)
+{
+	xzstate *s = (xzstate *)p;
+	int rc;
+
+	rc = xz_run(s, LZMA_FINISH);
+	lzma_end(&s->strm);
+	free(s);
+
+	return rc;
+}
+
+static void *xz_ropen(stream *f, long len)
+{
+	xzstate *s;
+	lzma_stream init = LZMA_STREAM_INIT;
+
+	if ((s = (xzstate *)malloc(sizeof(xzstate))) == NULL)
+		return NULL;
+	s->strm = init;
+	if (lzma_stream_decoder(&s->strm, UINT64_MAX, 0) != LZMA_OK) {
+		free(s);
+		return NULL;
+	};
+	s->f = f;
+	s->left = len;
+	s->end = 0;
+
+	return s;
+}
+
+static long xz_read(void *p, void *buf, long len)
+{
+	xzstate *s = (xzstate *)p;
+	long n;
+	lzma_ret rc;
+
+	s->strm.next_out = (uint8_t *)buf;
+	s->strm.avail_out = len;
+	while ((s->strm.avail_out > 0) && !s->end) {
+		if (s->strm.avail_in == 0) {
+			if ((n = blockfill(s->f, &s->left, (char *)s->buf)) <= 0)
+				return -1;
+			s->strm.next_in = s->buf;
+			s->strm.avail_in = n;
+		};
+		rc = lzma_code(&s->strm, LZMA_RUN);
+		if (rc == LZMA_STREAM_END)
+			s->end = 1;
+		else if (rc != LZMA_OK)
+			return -1;
+	};
+
+	return len - (long)s->strm.avail_out;
+}
+
+static void xz_rclose(void *p)
+{
+	xzstate *s = (xzstate *)p;
+
+	lzma_end(&s->strm);
+	free(s);
+}
+
+static size_t xz_wmemory(int level, long len, long dictlen)
+{
+	return sizeof(xzstate) +
+		(size_t)lzma_easy_encoder_memusage(level ? level : 9);
+}
+
+static const codec xz_codec = {
+	CODEC_XZ, "xz",
+	xz_wopen, xz_write, xz_flush, xz_wclose, xz_wmemory,
+	xz_ropen, xz_read, xz_rclose,
+	NULL,
+	NULL,
+	NULL,
+	NULL
+};
+#endif
+
+static const codec *codecs[] = {
+	&bzip2_codec,
+	&store_codec,
+	&lz_codec,
+	&zdiff_codec,
+#ifdef BSDIFF_HAVE_ZSTD
+	&zstd_codec,
+	&zstddict_codec,
+#endif
+#ifdef BSDIFF_HAVE_LZMA
+	&xz_codec,
+#endif
+	NULL
+};
+
+const codec *codec_find(int id)
+{
+	int i;
+
+	for (i = 0;codecs[i] != NULL;i++)
+		if (codecs[i]->id == id)
+			return codecs[i];
+
+	return NULL;
+}
+
+const codec *codec_byname(const char *name)
+{
+	int i;
+
+	for (i = 0;codecs[i] != NULL;i++)
+		if (strcmp(codecs[i]->name, name) == 0)
+			return codecs[i];
+
+	return NULL;
+}
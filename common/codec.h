@@ -0,0 +1,70 @@
+#pragma once
+/*
+ * Compression codecs for the blocks of a BSDIFF41 patch.
+ *
+ * Each block of a patch names the codec it was written with (see the
+ * header layout in bsdiff.c), so bspatch can pick the matching decoder
+ * per block.  Codec ids are part of the patch format and must never be
+ * renumbered.
+ *
+ * zstd, zstd-dict and xz are only available when the tree is built with
+ * BSDIFF_HAVE_ZSTD or BSDIFF_HAVE_LZMA defined and the libraries linked.
+ */
+
+#include "stream.h"
+
+#define CODEC_BZIP2	0
+#define CODEC_STORE	1
+#define CODEC_LZ	2
+#define CODEC_ZSTD	3
+#define CODEC_XZ	4
+#define CODEC_ZDIFF	5	/* zero-run aware, for diff blocks */
+			/* 6 is not to be used */
+#define CODEC_ZSTDDICT	7	/* zstd with the old file as prefix */
+
+typedef struct codec {
+	int id;
+	const char *name;
+
+	/* Encoder: write compressed data to f, starting at its position;
+	   level 0 picks the codec default */
+	void *(*wopen)(stream *f, int level);
+	int (*write)(void *s, const void *buf, long len);	/* 0, or -1 */
+	int (*flush)(void *s);					/* 0, or -1 */
+	int (*wclose)(void *s);		/* finishes the block; 0, or -1 */
+	/* The most memory an encoder opened at level takes for a block of
+	   up to len bytes, with a dictionary of dictlen bytes */
+	size_t (*wmemory)(int level, long len, long dictlen);
+
+	/* Decoder: read the len compressed bytes at the position of f */
+	void *(*ropen)(stream *f, long len);
+	long (*read)(void *s, void *buf, long len);	/* -1 on error, */
+							/* < len at end */
+	void (*rclose)(void *s);
+
+	/* Optional: gives the encoder or decoder data both sides have,
+	   the old file, before the first write or read.  Codecs that
+	   leave this NULL do not use a dictionary. */
+	void (*setdict)(void *s, const void *dict, long len);
+
+	/* Optional: read, adding add[i] to each byte as it is decoded,
+	   which saves bspatch a second pass over the diff string */
+	long (*readadd)(void *s, void *buf, const void *add, long len);
+
+	/* Optional: start decoding another block of len bytes on f with
+	   the state of a decoder done with its own, keeping the memory it
+	   holds; returns s, or NULL if that fails, which frees s */
+	void *(*rreopen)(void *s, stream *f, long len);
+
+	/* Optional: the level to open an encoder at for a block of up to
+	   len bytes, for codecs whose default sets aside memory for larger
+	   ones; it must compress as the default does */
+	int (*wlevel)(long len);
+} codec;
+
+/* Returns NULL if the codec is unknown or not built in */
+const codec *codec_find(int id);
+const codec *codec_byname(const char *name);
+
+extern const codec lz_codec;
+extern const codec zdiff_codec;
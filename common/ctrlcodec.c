@@ -0,0 +1,161 @@
+/*
+ * Columnar zigzag varint encoding of bsdiff control triples.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "ctrlcodec.h"
+
+/* Largest varint is 10 bytes for a 64-bit value */
+#define VARINT_MAX 10
+
+static unsigned long long zigzag(long x)
+{
+	long long y = x;
+
+	return ((unsigned long long)y << 1) ^ (unsigned long long)(y >> 63);
+}
+
+static long unzigzag(unsigned long long y)
+{
+	return (long)((long long)(y >> 1) ^ -(long long)(y & 1));
+}
+
+static long putvarint(unsigned long long y, unsigned char *buf)
+{
+	long n = 0;
+
+	while (y >= 0x80) {
+		buf[n++] = (unsigned char)(y | 0x80);
+		y >>= 7;
+	};
+	buf[n++] = (unsigned char)y;
+
+	return n;
+}
+
+static int getvarint(const unsigned char **pp, const unsigned char *end,
+	unsigned long long *y)
+{
+	const unsigned char *p = *pp;
+	unsigned long long v = 0;
+	int shift;
+
+	for (shift = 0;shift < 64;shift += 7) {
+		if (p == end)
+			return -1;
+		v |= (unsigned long long)(*p & 0x7F) << shift;
+		if ((*p++ & 0x80) == 0) {
+			*pp = p;
+			*y = v;
+			return 0;
+		};
+	};
+
+	return -1;
+}
+
+void ctrlbuf_init(ctrlbuf *cb)
+{
+	cb->ctrl = NULL;
+	cb->count = 0;
+	cb->alloc = 0;
+}
+
+void ctrlbuf_free(ctrlbuf *cb)
+{
+	free(cb->ctrl);
+	ctrlbuf_init(cb);
+}
+
+int ctrlbuf_push(ctrlbuf *cb, long add, long copy, long seek)
+{
+	long *p;
+	long n;
+
+	if (cb->count == cb->alloc) {
+		n = cb->alloc ? cb->alloc * 2 : 1024;
+		if ((p = (long *)realloc(cb->ctrl, n * 3 * sizeof(long))) == NULL)
+			return -1;
+		cb->ctrl = p;
+		cb->alloc = n;
+	};
+
+	p = cb->ctrl + cb->count * 3;
+	p[0] = add;
+	p[1] = copy;
+	p[2] = seek;
+	cb->count++;
+
+	return 0;
+}
+
+unsigned char *ctrl_encode(const ctrlbuf *cb, long *lenp)
+{
+	unsigned char *buf, *p;
+	long collen[3];
+	long i, j;
+
+	if ((buf = (unsigned char *)malloc(3 * VARINT_MAX +
+		cb->count * 3 * VARINT_MAX)) == NULL)
+		return NULL;
+
+	/* Columns go after the prefix, which is at most 3 varints long */
+	p = buf + 3 * VARINT_MAX;
+	for (j = 0;j < 3;j++) {
+		collen[j] = 0;
+		for (i = 0;i < cb->count;i++)
+			collen[j] += putvarint(zigzag(cb->ctrl[i * 3 + j]),
+				p + collen[j]);
+		p += collen[j];
+	};
+
+	/* Write the prefix and slide the columns down against it */
+	i = putvarint(cb->count, buf);
+	i += putvarint(collen[0], buf + i);
+	i += putvarint(collen[1], buf + i);
+	memmove(buf + i, buf + 3 * VARINT_MAX, collen[0] + collen[1] + collen[2]);
+
+	*lenp = i + collen[0] + collen[1] + collen[2];
+	return buf;
+}
+
+int ctrl_open(ctrlreader *cr, const unsigned char *buf, long len)
+{
+	const unsigned char *p = buf, *end = buf + len;
+	unsigned long long count, len0, len1;
+
+	if (getvarint(&p, end, &count) || getvarint(&p, end, &len0) ||
+		getvarint(&p, end, &len1))
+		return -1;
+	if ((len0 > (unsigned long long)(end - p)) ||
+		(len1 > (unsigned long long)(end - p) - len0) ||
+		(count > (unsigned long long)len))
+		return -1;
+
+	cr->col[0] = p;
+	cr->end[0] = cr->col[1] = p + len0;
+	cr->end[1] = cr->col[2] = p + len0 + len1;
+	cr->end[2] = end;
+	cr->left = (long)count;
+
+	return 0;
+}
+
+int ctrl_next(ctrlreader *cr, long ctrl[3])
+{
+	unsigned long long y;
+	int i;
+
+	if (cr->left == 0)
+		return 0;
+
+	for (i = 0;i <= 2;i++) {
+		if (getvarint(&cr->col[i], cr->end[i], &y))
+			return -1;
+		ctrl[i] = unzigzag(y);
+	};
+	cr->left--;
+
+	return 1;
+}
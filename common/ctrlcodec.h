@@ -0,0 +1,41 @@
+#pragma once
+/*
+ * Control block encoding for BSDIFF41 patches.
+ *
+ * BSDIFF40 stores every (add, copy, seek) triple as three 8-byte
+ * sign-magnitude integers, interleaved.  BSDIFF41 stores the triples as
+ * three separate columns of zigzag varints, so that each column holds
+ * values of similar magnitude and compresses well:
+ *
+ *	varint	number of triples
+ *	varint	length in bytes of the add column
+ *	varint	length in bytes of the copy column
+ *	??	add column	(zigzag varints)
+ *	??	copy column	(zigzag varints)
+ *	??	seek column	(zigzag varints, rest of the block)
+ */
+
+typedef struct ctrlbuf {
+	long *ctrl;		/* triples, 3 longs each */
+	long count;		/* number of triples */
+	long alloc;		/* triples allocated */
+} ctrlbuf;
+
+typedef struct ctrlreader {
+	const unsigned char *col[3];	/* cursor in each column */
+	const unsigned char *end[3];	/* end of each column */
+	long left;			/* triples not yet returned */
+} ctrlreader;
+
+void ctrlbuf_init(ctrlbuf *cb);
+void ctrlbuf_free(ctrlbuf *cb);
+/* Returns 0 on success, -1 if out of memory */
+int ctrlbuf_push(ctrlbuf *cb, long add, long copy, long seek);
+
+/* Returns a malloc()ed encoded block, or NULL if out of memory */
+unsigned char *ctrl_encode(const ctrlbuf *cb, long *lenp);
+
+/* Returns 0 on success, -1 if the block is corrupt */
+int ctrl_open(ctrlreader *cr, const unsigned char *buf, long len);
+/* Returns 1 and fills ctrl[3], 0 at the end of the block, -1 if corrupt */
+int ctrl_next(ctrlreader *cr, long ctrl[3]);
@@ -0,0 +1,244 @@
+/*
+ * XXH64 (seed 0) and SHA-256.
+ */
+
+#include <string.h>
+#include "hash.h"
+
+/* XXH64 */
+
+#define P64_1	0x9E3779B185EBCA87ULL
+#define P64_2	0xC2B2AE3D27D4EB4FULL
+#define P64_3	0x165667B19E3779F9ULL
+#define P64_4	0x85EBCA77C2B2AE63ULL
+#define P64_5	0x27D4EB2F165667C5ULL
+
+#define ROTL64(x, r)	(((x) << (r)) | ((x) >> (64 - (r))))
+
+static unsigned long long get64le(const unsigned char *p)
+{
+	return (unsigned long long)p[0] | ((unsigned long long)p[1] << 8) |
+		((unsigned long long)p[2] << 16) | ((unsigned long long)p[3] << 24) |
+		((unsigned long long)p[4] << 32) | ((unsigned long long)p[5] << 40) |
+		((unsigned long long)p[6] << 48) | ((unsigned long long)p[7] << 56);
+}
+
+static unsigned long long get32le(const unsigned char *p)
+{
+	return (unsigned long long)p[0] | ((unsigned long long)p[1] << 8) |
+		((unsigned long long)p[2] << 16) | ((unsigned long long)p[3] << 24);
+}
+
+static unsigned long long xxh64_round(unsigned long long acc,
+	unsigned long long in)
+{
+	acc += in * P64_2;
+	acc = ROTL64(acc, 31);
+
+	return acc * P64_1;
+}
+
+static unsigned long long xxh64_merge(unsigned long long acc,
+	unsigned long long v)
+{
+	acc ^= xxh64_round(0, v);
+
+	return acc * P64_1 + P64_4;
+}
+
+/* Consume whole 32-byte stripes of p */
+static const unsigned char *xxh64_stripes(xxh64_state *s,
+	const unsigned char *p, const unsigned char *end)
+{
+	unsigned long long v0 = s->v[0], v1 = s->v[1], v2 = s->v[2], v3 = s->v[3];
+
+	for (;end - p >= 32;p += 32) {
+		v0 = xxh64_round(v0, get64le(p));
+		v1 = xxh64_round(v1, get64le(p + 8));
+		v2 = xxh64_round(v2, get64le(p + 16));
+		v3 = xxh64_round(v3, get64le(p + 24));
+	};
+	s->v[0] = v0;s->v[1] = v1;s->v[2] = v2;s->v[3] = v3;
+
+	return p;
+}
+
+void xxh64_init(xxh64_state *s)
+{
+	s->v[0] = P64_1 + P64_2;
+	s->v[1] = P64_2;
+	s->v[2] = 0;
+	s->v[3] = 0 - P64_1;
+	s->total = 0;
+	s->buflen = 0;
+}
+
+void xxh64_update(xxh64_state *s, const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)data, *end = p + len;
+	size_t n;
+
+	s->total += len;
+	if (s->buflen > 0) {
+		n = 32 - s->buflen;
+		if (n > len)
+			n = len;
+		memcpy(s->buf + s->buflen, p, n);
+		s->buflen += (int)n;
+		p += n;
+		if (s->buflen < 32)
+			return;
+		xxh64_stripes(s, s->buf, s->buf + 32);
+		s->buflen = 0;
+	};
+	p = xxh64_stripes(s, p, end);
+	memcpy(s->buf, p, end - p);
+	s->buflen = (int)(end - p);
+}
+
+unsigned long long xxh64_final(const xxh64_state *s)
+{
+	const unsigned char *p = s->buf, *end = s->buf + s->buflen;
+	unsigned long long h;
+
+	if (s->total >= 32) {
+		h = ROTL64(s->v[0], 1) + ROTL64(s->v[1], 7) +
+			ROTL64(s->v[2], 12) + ROTL64(s->v[3], 18);
+		h = xxh64_merge(h, s->v[0]);
+		h = xxh64_merge(h, s->v[1]);
+		h = xxh64_merge(h, s->v[2]);
+		h = xxh64_merge(h, s->v[3]);
+	} else
+		h = P64_5;
+	h += s->total;
+
+	for (;end - p >= 8;p += 8) {
+		h ^= xxh64_round(0, get64le(p));
+		h = ROTL64(h, 27) * P64_1 + P64_4;
+	};
+	if (end - p >= 4) {
+		h ^= get32le(p) * P64_1;
+		h = ROTL64(h, 23) * P64_2 + P64_3;
+		p += 4;
+	};
+	for (;p < end;p++) {
+		h ^= *p * P64_5;
+		h = ROTL64(h, 11) * P64_1;
+	};
+
+	h ^= h >> 33;
+	h *= P64_2;
+	h ^= h >> 29;
+	h *= P64_3;
+	h ^= h >> 32;
+
+	return h;
+}
+
+/* SHA-256 */
+
+static const unsigned int sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR32(x, r)	(((x) >> (r)) | ((x) << (32 - (r))))
+
+static void sha256_block(sha256_state *s, const unsigned char *p)
+{
+	unsigned int w[64], a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for (i = 0;i < 16;i++)
+		w[i] = ((unsigned int)p[4 * i] << 24) | (p[4 * i + 1] << 16) |
+			(p[4 * i + 2] << 8) | p[4 * i + 3];
+	for (i = 16;i < 64;i++)
+		w[i] = w[i - 16] + w[i - 7] +
+			(ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+			(ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+	a = s->h[0];b = s->h[1];c = s->h[2];d = s->h[3];
+	e = s->h[4];f = s->h[5];g = s->h[6];h = s->h[7];
+	for (i = 0;i < 64;i++) {
+		t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) +
+			((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) +
+			((a & b) ^ (a & c) ^ (b & c));
+		h = g;g = f;f = e;e = d + t1;
+		d = c;c = b;b = a;a = t1 + t2;
+	};
+	s->h[0] += a;s->h[1] += b;s->h[2] += c;s->h[3] += d;
+	s->h[4] += e;s->h[5] += f;s->h[6] += g;s->h[7] += h;
+}
+
+void sha256_init(sha256_state *s)
+{
+	static const unsigned int iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memcpy(s->h, iv, sizeof(iv));
+	s->total = 0;
+	s->buflen = 0;
+}
+
+void sha256_update(sha256_state *s, const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	size_t n;
+
+	s->total += len;
+	while (len > 0) {
+		if ((s->buflen == 0) && (len >= 64)) {
+			sha256_block(s, p);
+			p += 64;
+			len -= 64;
+			continue;
+		};
+		n = 64 - s->buflen;
+		if (n > len)
+			n = len;
+		memcpy(s->buf + s->buflen, p, n);
+		s->buflen += (int)n;
+		p += n;
+		len -= n;
+		if (s->buflen == 64) {
+			sha256_block(s, s->buf);
+			s->buflen = 0;
+		};
+	};
+}
+
+void sha256_final(sha256_state *s, unsigned char out[SHA256_LEN])
+{
+	unsigned long long bits = s->total * 8;
+	int i;
+
+	s->buf[s->buflen++] = 0x80;
+	if (s->buflen > 56) {
+		memset(s->buf + s->buflen, 0, 64 - s->buflen);
+		sha256_block(s, s->buf);
+		s->buflen = 0;
+	};
+	memset(s->buf + s->buflen, 0, 56 - s->buflen);
+	for (i = 0;i < 8;i++)
+		s->buf[56 + i] = (unsigned char)(bits >> (56 - 8 * i));
+	sha256_block(s, s->buf);
+
+	for (i = 0;i < 8;i++) {
+		out[4 * i] = (unsigned char)(s->h[i] >> 24);
+		out[4 * i + 1] = (unsigned char)(s->h[i] >> 16);
+		out[4 * i + 2] = (unsigned char)(s->h[i] >> 8);
+		out[4 * i + 3] = (unsigned char)s->h[i];
+	};
+}
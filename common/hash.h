@@ -0,0 +1,33 @@
+#pragma once
+/*
+ * Content hashes for patch headers: XXH64, which is fast enough to run
+ * over every byte of the old and new files at little cost, and SHA-256
+ * for when a collision-resistant check is wanted.  Both are streaming,
+ * so data can be hashed as it is read or produced.
+ */
+
+#include <stddef.h>
+
+typedef struct xxh64_state {
+	unsigned long long v[4];
+	unsigned long long total;
+	unsigned char buf[32];
+	int buflen;
+} xxh64_state;
+
+void xxh64_init(xxh64_state *s);
+void xxh64_update(xxh64_state *s, const void *data, size_t len);
+unsigned long long xxh64_final(const xxh64_state *s);
+
+#define SHA256_LEN	32
+
+typedef struct sha256_state {
+	unsigned int h[8];
+	unsigned long long total;
+	unsigned char buf[64];
+	int buflen;
+} sha256_state;
+
+void sha256_init(sha256_state *s);
+void sha256_update(sha256_state *s, const void *data, size_t len);
+void sha256_final(sha256_state *s, unsigned char out[SHA256_LEN]);
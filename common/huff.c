@@ -0,0 +1,277 @@
+/*
+ * Length-limited canonical Huffman coding of byte strings.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "huff.h"
+
+/* Compute code lengths of at most HUFF_MAXBITS for the used symbols */
+static void huff_lengths(const long freq[256], unsigned char len[256])
+{
+	long weight[512];
+	int parent[512], sym[256], count[HUFF_MAXBITS + 2];
+	int nsym, nnode, i, j, a, b, d, tmp;
+	long total;
+
+	memset(len, 0, 256);
+	nsym = 0;
+	for (i = 0;i < 256;i++)
+		if (freq[i] > 0) {
+			sym[nsym] = i;
+			weight[nsym++] = freq[i];
+		};
+	if (nsym == 1)
+		len[sym[0]] = 1;
+	if (nsym <= 1)
+		return;
+
+	/* Plain Huffman tree, merging the two lightest live nodes;
+	   a merged node's weight goes negative once it has a parent */
+	for (nnode = nsym;nnode < 2 * nsym - 1;nnode++) {
+		a = b = -1;
+		for (i = 0;i < nnode;i++) {
+			if (weight[i] < 0)
+				continue;
+			if ((a < 0) || (weight[i] < weight[a])) {
+				b = a;
+				a = i;
+			} else if ((b < 0) || (weight[i] < weight[b]))
+				b = i;
+		};
+		weight[nnode] = weight[a] + weight[b];
+		parent[a] = parent[b] = nnode;
+		weight[a] = weight[b] = -1;
+	};
+
+	/* Depth of every leaf, clamped and counted per length */
+	memset(count, 0, sizeof(count));
+	for (i = 0;i < nsym;i++) {
+		for (d = 0, j = i;j != 2 * nsym - 2;j = parent[j])
+			d++;
+		count[d > HUFF_MAXBITS ? HUFF_MAXBITS : d]++;
+	};
+
+	/* Restore the Kraft equality after clamping by pushing
+	   leaves down from shorter lengths */
+	total = 0;
+	for (i = 1;i <= HUFF_MAXBITS;i++)
+		total += (long)count[i] << (HUFF_MAXBITS - i);
+	while (total > (1L << HUFF_MAXBITS)) {
+		count[HUFF_MAXBITS]--;
+		for (i = HUFF_MAXBITS - 1;i > 0;i--)
+			if (count[i] > 0) {
+				count[i]--;
+				count[i + 1] += 2;
+				break;
+			};
+		total--;
+	};
+
+	/* Hand the lengths out, shortest to the most frequent symbols */
+	for (i = 1;i < nsym;i++)
+		for (j = i;(j > 0) && (freq[sym[j - 1]] < freq[sym[j]]);j--) {
+			tmp = sym[j];
+			sym[j] = sym[j - 1];
+			sym[j - 1] = tmp;
+		};
+	for (i = 0, d = 1;d <= HUFF_MAXBITS;d++)
+		for (j = 0;j < count[d];j++)
+			len[sym[i++]] = (unsigned char)d;
+}
+
+/* Canonical codes from lengths; returns -1 if they oversubscribe */
+static int huff_codes(const unsigned char len[256], unsigned int code[256])
+{
+	unsigned int next, count[HUFF_MAXBITS + 1];
+	int i, d;
+
+	memset(count, 0, sizeof(count));
+	for (i = 0;i < 256;i++)
+		count[len[i]]++;
+	count[0] = 0;
+
+	next = 0;
+	for (d = 1;d <= HUFF_MAXBITS;d++) {
+		next = (next + count[d - 1]) << 1;
+		if (next + count[d] > (1U << d))
+			return -1;
+		for (i = 0;i < 256;i++)
+			if (len[i] == d)
+				code[i] = next++;
+		next -= count[d];
+	};
+
+	return 0;
+}
+
+long huff_encode(const unsigned char *src, long n, unsigned char *dst)
+{
+	long freq[256];
+	unsigned char len[256];
+	unsigned int code[256];
+	unsigned long long acc;
+	unsigned char *op;
+	long i, bits;
+	int nbits, used;
+
+	memset(freq, 0, sizeof(freq));
+	for (i = 0;i < n;i++)
+		freq[src[i]]++;
+	for (i = 0, used = 0;i < 256;i++)
+		if (freq[i] > 0)
+			used++;
+
+	if ((n > 0) && (used == 1)) {
+		dst[0] = HUFF_RLE;
+		dst[1] = src[0];
+		return 2;
+	};
+
+	huff_lengths(freq, len);
+	for (i = 0, bits = 0;i < 256;i++)
+		bits += freq[i] * len[i];
+	if ((n == 0) || (1 + 128 + (bits + 7) / 8 >= 1 + n) ||
+		huff_codes(len, code)) {
+		dst[0] = HUFF_RAW;
+		memcpy(dst + 1, src, n);
+		return 1 + n;
+	};
+
+	dst[0] = HUFF_CODED;
+	for (i = 0;i < 128;i++)
+		dst[1 + i] = (unsigned char)(len[2 * i] | (len[2 * i + 1] << 4));
+	op = dst + 129;
+	acc = 0;nbits = 0;
+	for (i = 0;i < n;i++) {
+		acc = (acc << len[src[i]]) | code[src[i]];
+		nbits += len[src[i]];
+		while (nbits >= 8) {
+			nbits -= 8;
+			*op++ = (unsigned char)(acc >> nbits);
+		};
+	};
+	if (nbits > 0)
+		*op++ = (unsigned char)(acc << (8 - nbits));
+
+	return (long)(op - dst);
+}
+
+int huff_decode(const unsigned char *src, long srclen,
+	unsigned char *dst, long n)
+{
+	unsigned short table[1 << HUFF_MAXBITS];
+	unsigned char len[256];
+	unsigned int code[256];
+	const unsigned char *ip, *iend;
+	unsigned char *op, *oend;
+	unsigned long long acc;
+	unsigned int e;
+	long i, j;
+	int nbits;
+
+	if (srclen < 1)
+		return (n == 0) ? 0 : -1;
+
+	switch (src[0]) {
+	case HUFF_RAW:
+		if (srclen != 1 + n)
+			return -1;
+		memcpy(dst, src + 1, n);
+		return 0;
+	case HUFF_RLE:
+		if (srclen != 2)
+			return -1;
+		memset(dst, src[1], n);
+		return 0;
+	case HUFF_CODED:
+		if (srclen < 129)
+			return -1;
+		break;
+	default:
+		return -1;
+	};
+
+	for (i = 0;i < 128;i++) {
+		len[2 * i] = src[1 + i] & 15;
+		len[2 * i + 1] = src[1 + i] >> 4;
+		if ((len[2 * i] > HUFF_MAXBITS) || (len[2 * i + 1] > HUFF_MAXBITS))
+			return -1;
+	};
+	if (huff_codes(len, code))
+		return -1;
+
+	/* Each entry is symbol | length << 8; length 0 marks a hole */
+	memset(table, 0, sizeof(table));
+	for (i = 0;i < 256;i++)
+		if (len[i] > 0)
+			for (j = 0;j < (1L << (HUFF_MAXBITS - len[i]));j++)
+				table[(code[i] << (HUFF_MAXBITS - len[i])) + j] =
+					(unsigned short)(i | (len[i] << 8));
+
+	ip = src + 129;iend = src + srclen;
+	op = dst;oend = dst + n;
+	acc = 0;nbits = 0;
+	while (op < oend) {
+		/* Keep the accumulator topped up, left aligned */
+		while ((nbits <= 56) && (ip < iend)) {
+			acc |= (unsigned long long)*ip++ << (56 - nbits);
+			nbits += 8;
+		};
+		e = table[acc >> (64 - HUFF_MAXBITS)];
+		if (((e >> 8) == 0) || ((int)(e >> 8) > nbits))
+			return -1;
+		*op++ = (unsigned char)e;
+		acc <<= e >> 8;
+		nbits -= e >> 8;
+	};
+
+	return ((ip == iend) && (nbits < 8)) ? 0 : -1;
+}
+
+static unsigned int get32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static void put32(unsigned char *p, unsigned int x)
+{
+	p[0] = (unsigned char)x;
+	p[1] = (unsigned char)(x >> 8);
+	p[2] = (unsigned char)(x >> 16);
+	p[3] = (unsigned char)(x >> 24);
+}
+
+unsigned char *huff_put(unsigned char *op, const unsigned char *src, long n)
+{
+	long len;
+
+	len = huff_encode(src, n, op + 8);
+	put32(op, (unsigned int)n);
+	put32(op + 4, (unsigned int)len);
+
+	return op + 8 + len;
+}
+
+unsigned char *huff_get(const unsigned char **ip, const unsigned char *iend,
+	long max, long *np)
+{
+	unsigned char *buf;
+	long n, len;
+
+	if (iend - *ip < 8)
+		return NULL;
+	n = get32(*ip);
+	len = get32(*ip + 4);
+	if ((n > max) || (len > iend - *ip - 8) ||
+		((buf = (unsigned char *)malloc(n + 1)) == NULL))
+		return NULL;
+	if (huff_decode(*ip + 8, len, buf, n)) {
+		free(buf);
+		return NULL;
+	};
+	*ip += 8 + len;
+	*np = n;
+
+	return buf;
+}
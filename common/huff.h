@@ -0,0 +1,39 @@
+#pragma once
+/*
+ * Order-0 canonical Huffman coding of byte strings.
+ *
+ * An encoded string is a mode byte followed by
+ *	HUFF_RAW	the bytes themselves
+ *	HUFF_RLE	the one byte value that all bytes have
+ *	HUFF_CODED	256 code lengths packed in 128 bytes, then the
+ *			codes, most significant bit first
+ * The number of bytes is not stored; callers keep it alongside, or use
+ * huff_put and huff_get, which frame the string with its decoded and
+ * encoded lengths as 4-byte little endian integers.
+ */
+
+#define HUFF_RAW	0
+#define HUFF_RLE	1
+#define HUFF_CODED	2
+
+/* Codes are at most this long, so decoding is one table lookup */
+#define HUFF_MAXBITS	11
+
+/* Worst case size of an encoded string of n bytes */
+#define HUFF_BOUND(n)	((n) + 1)
+
+/* Returns the encoded length */
+long huff_encode(const unsigned char *src, long n, unsigned char *dst);
+/* Returns 0 if n bytes were decoded into dst, -1 if corrupt */
+int huff_decode(const unsigned char *src, long srclen,
+	unsigned char *dst, long n);
+
+/* Worst case size of a framed string of n bytes */
+#define HUFF_PUTBOUND(n)	((n) + 9)
+
+/* Frames and encodes n bytes of src at op; returns the end of the output */
+unsigned char *huff_put(unsigned char *op, const unsigned char *src, long n);
+/* Decodes the framed string at *ip, advancing it, into a malloc()ed
+   buffer; returns NULL if corrupt, longer than max, or out of memory */
+unsigned char *huff_get(const unsigned char **ip, const unsigned char *iend,
+	long max, long *np);
@@ -0,0 +1,381 @@
+/*
+ * Planning in-place patches.
+ *
+ * Every byte of the new file is written by one command: a copy from
+ * the old file (plus diff bytes), or a literal.  Applied over the old
+ * file itself, a copy must read its source before any other command
+ * overwrites it, so copy u goes before copy v whenever u's source
+ * overlaps v's destination.  The copies are ordered by a topological
+ * sort of that graph, and literals, which read nothing, go last.  A
+ * cycle is broken at its shortest copy, which either has its source
+ * preloaded into the scratch buffer before anything is written, or,
+ * once the scratch budget is spent, becomes a literal.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "inplace.h"
+
+/* Commands are split to this length, so that len << 2 fits a long */
+#define INPLACE_MAXLEN	(1L << 28)
+
+typedef struct node {
+	long dst, src, len;
+	const unsigned char *bytes;	/* diff bytes, or a literal's */
+	int kind;			/* INPLACE_COPY or INPLACE_LITERAL */
+	int state;			/* see below */
+	long scr;			/* scratch offset, if preloaded */
+} node;
+
+#define ST_LEFT		0
+#define ST_DONE		1
+#define ST_SCRATCH	2
+#define ST_LITERAL	3
+
+typedef struct plan {
+	node *n;
+	long count, alloc;
+} plan;
+
+static int addnode(plan *p, long dst, long src, long len,
+	const unsigned char *bytes, int kind)
+{
+	node *q;
+
+	if (p->count == p->alloc) {
+		p->alloc = p->alloc ? p->alloc * 2 : 1024;
+		if ((q = (node *)realloc(p->n, p->alloc * sizeof(node))) == NULL)
+			return -1;
+		p->n = q;
+	};
+	q = p->n + p->count++;
+	q->dst = dst;
+	q->src = src;
+	q->len = len;
+	q->bytes = bytes;
+	q->kind = kind;
+	q->state = ST_LEFT;
+	q->scr = 0;
+
+	return 0;
+}
+
+static int addliteral(plan *p, long dst, long len, const unsigned char *bytes)
+{
+	long j, n;
+
+	for (j = 0;j < len;j += n) {
+		n = (len - j < INPLACE_MAXLEN) ? len - j : INPLACE_MAXLEN;
+		if (addnode(p, dst + j, 0, n, bytes + j, INPLACE_LITERAL))
+			return -1;
+	};
+
+	return 0;
+}
+
+static int addcopy(plan *p, long dst, long src, long len,
+	const unsigned char *diff)
+{
+	long j, n, step;
+
+	/* Bytes that would stay as they are need no command */
+	if (src == dst) {
+		for (j = 0;(j < len) && (diff[j] == 0);j++);
+		if (j == len)
+			return 0;
+	};
+
+	/* bspatch reads only one chunk ahead, so a copy overlapping its
+	   own destination further ahead than that is cut into pieces
+	   that do not overlap themselves; the graph orders them */
+	step = INPLACE_MAXLEN;
+	if ((dst - src > INPLACE_CHUNK) && (dst - src < len))
+		step = dst - src;
+
+	for (j = 0;j < len;j += n) {
+		n = (len - j < step) ? len - j : step;
+		if (addnode(p, dst + j, src + j, n, diff + j, INPLACE_COPY))
+			return -1;
+	};
+
+	return 0;
+}
+
+/* Split the triples into commands, in order of destination */
+static int commands(plan *p, const ctrlbuf *cb, const unsigned char *db,
+	const unsigned char *eb, long oldsize, long newsize)
+{
+	long oldpos, newpos, dpos, epos;
+	long i, j, n, *ctrl;
+
+	oldpos = 0;newpos = 0;dpos = 0;epos = 0;
+	for (i = 0;(i < cb->count) && (newpos < newsize);i++) {
+		ctrl = cb->ctrl + 3 * i;
+
+		/* Only the part of the add run inside the old file reads it */
+		for (j = 0;j < ctrl[0];j += n) {
+			if (oldpos + j < 0) {
+				n = (ctrl[0] - j < -(oldpos + j)) ? ctrl[0] - j : -(oldpos + j);
+				if (addliteral(p, newpos + j, n, db + dpos + j))
+					return -1;
+			} else if (oldpos + j >= oldsize) {
+				n = ctrl[0] - j;
+				if (addliteral(p, newpos + j, n, db + dpos + j))
+					return -1;
+			} else {
+				n = (ctrl[0] - j < oldsize - (oldpos + j)) ?
+					ctrl[0] - j : oldsize - (oldpos + j);
+				if (addcopy(p, newpos + j, oldpos + j, n, db + dpos + j))
+					return -1;
+			};
+		};
+		newpos += ctrl[0];
+		oldpos += ctrl[0];
+		dpos += ctrl[0];
+
+		if ((ctrl[1] > 0) && addliteral(p, newpos, ctrl[1], eb + epos))
+			return -1;
+		newpos += ctrl[1];
+		epos += ctrl[1];
+		oldpos += ctrl[2];
+	};
+
+	return 0;
+}
+
+/* Walk back along edges from copies still left, starting at a copy
+   that has some, until the walk comes round; returns the shortest copy
+   on that cycle */
+static long findcycle(const plan *p, const long *cp, const long *instart,
+	const long *ins, long start, long *stamp, long *pathpos, long *path,
+	long walk)
+{
+	long cur, len, best, k;
+
+	cur = start;len = 0;
+	while (stamp[cur] != walk) {
+		stamp[cur] = walk;
+		pathpos[cur] = len;
+		path[len++] = cur;
+		for (k = instart[cur];p->n[cp[ins[k]]].state != ST_LEFT;k++);
+		cur = ins[k];
+	};
+
+	best = cur;
+	for (k = pathpos[cur];k < len;k++)
+		if (p->n[cp[path[k]]].len < p->n[cp[best]].len)
+			best = path[k];
+
+	return best;
+}
+
+/* Order the copies; order gets the indices in cp of the *nordp copies
+   left as copies, the others are marked for scratch or as literals */
+static int sortcopies(plan *p, const long *cp, long ncopy, long scratch,
+	long *order, long *nordp, inplace_stats *st)
+{
+	long *outstart, *outs, *instart, *ins, *indeg, *queue;
+	long *stamp, *pathpos, *path;
+	long nedge, i, j, k, lo, hi, mid, head, tail, done, scan, walk;
+	long used, nord;
+	node *u, *v;
+	int rc = -1;
+
+	outstart = outs = instart = ins = indeg = queue = NULL;
+	stamp = pathpos = path = NULL;
+	if (((outstart = (long *)malloc((ncopy + 1) * sizeof(long))) == NULL) ||
+		((instart = (long *)calloc(ncopy + 1, sizeof(long))) == NULL) ||
+		((indeg = (long *)calloc(ncopy + 1, sizeof(long))) == NULL) ||
+		((queue = (long *)malloc((ncopy + 1) * sizeof(long))) == NULL) ||
+		((stamp = (long *)calloc(ncopy + 1, sizeof(long))) == NULL) ||
+		((pathpos = (long *)malloc((ncopy + 1) * sizeof(long))) == NULL) ||
+		((path = (long *)malloc((ncopy + 1) * sizeof(long))) == NULL))
+		goto out;
+
+	/* Edge u -> v where u reads what v writes; the destinations are
+	   sorted, so those v are found by binary search.  Counted first,
+	   then filled in. */
+	for (k = 0;k < 2;k++) {
+		nedge = 0;
+		for (i = 0;i < ncopy;i++) {
+			u = p->n + cp[i];
+			outstart[i] = nedge;
+			lo = 0;hi = ncopy;
+			while (lo < hi) {
+				mid = lo + (hi - lo) / 2;
+				v = p->n + cp[mid];
+				if (v->dst + v->len <= u->src) lo = mid + 1; else hi = mid;
+			};
+			for (j = lo;(j < ncopy) && (p->n[cp[j]].dst < u->src + u->len);j++)
+				if (j != i) {
+					if (k == 0)
+						instart[j]++;
+					else {
+						outs[nedge] = j;
+						ins[--instart[j]] = i;
+					};
+					nedge++;
+				};
+		};
+		outstart[ncopy] = nedge;
+		if (k == 0) {
+			if (((outs = (long *)malloc((nedge + 1) * sizeof(long))) == NULL) ||
+				((ins = (long *)malloc((nedge + 1) * sizeof(long))) == NULL))
+				goto out;
+
+			/* instart[j] ends up at the start of j's in-edges once
+			   the second pass has counted them back down */
+			for (j = 0;j < ncopy;j++)
+				indeg[j] = instart[j];
+			for (j = 1;j <= ncopy;j++)
+				instart[j] += instart[j - 1];
+		};
+	};
+
+	/* Kahn's algorithm, breaking a cycle whenever it runs dry */
+	head = tail = 0;
+	for (i = 0;i < ncopy;i++)
+		if (indeg[i] == 0)
+			queue[tail++] = i;
+	done = 0;scan = 0;walk = 0;used = 0;nord = 0;
+	while (done < ncopy) {
+		if (head == tail) {
+			while (p->n[cp[scan]].state != ST_LEFT)
+				scan++;
+			i = findcycle(p, cp, instart, ins, scan, stamp, pathpos, path,
+				++walk);
+			u = p->n + cp[i];
+			if (used + u->len <= scratch) {
+				u->state = ST_SCRATCH;
+				used += u->len;
+				st->preloaded += u->len;
+			} else {
+				u->state = ST_LITERAL;
+				st->converted += u->len;
+			};
+		} else {
+			i = queue[head++];
+			u = p->n + cp[i];
+			u->state = ST_DONE;
+			order[nord++] = i;
+		};
+		done++;
+
+		for (k = outstart[i];k < outstart[i + 1];k++)
+			if ((p->n[cp[outs[k]]].state == ST_LEFT) && (--indeg[outs[k]] == 0))
+				queue[tail++] = outs[k];
+	};
+	*nordp = nord;
+	rc = 0;
+
+out:
+	free(outstart);
+	free(outs);
+	free(instart);
+	free(ins);
+	free(indeg);
+	free(queue);
+	free(stamp);
+	free(pathpos);
+	free(path);
+
+	return rc;
+}
+
+static int emit(ctrlbuf *cmd, long *end, const node *u, int kind, long b)
+{
+	long a;
+
+	a = (kind == INPLACE_PRELOAD) ? 0 : u->dst - *end;
+	if (kind != INPLACE_PRELOAD)
+		*end = u->dst + u->len;
+
+	return ctrlbuf_push(cmd, a, b, (u->len << 2) | kind);
+}
+
+int inplace_plan(const ctrlbuf *cb, const unsigned char *db,
+	const unsigned char *eb, const unsigned char *pold, long oldsize,
+	long newsize, long scratch, ctrlbuf *cmd, unsigned char **dbp,
+	long *dblenp, unsigned char **ebp, long *eblenp, inplace_stats *st)
+{
+	plan p;
+	long *cp, *order, ncopy, nord, i, j, end, dblen, eblen;
+	unsigned char *ndb, *neb;
+	const node *u;
+	int rc = -1;
+
+	memset(&p, 0, sizeof(p));
+	memset(st, 0, sizeof(*st));
+	cp = order = NULL;ndb = neb = NULL;
+	ctrlbuf_init(cmd);
+
+	if (commands(&p, cb, db, eb, oldsize, newsize) ||
+		((cp = (long *)malloc((p.count + 1) * sizeof(long))) == NULL) ||
+		((order = (long *)malloc((p.count + 1) * sizeof(long))) == NULL) ||
+		((ndb = (unsigned char *)malloc(newsize + 1)) == NULL) ||
+		((neb = (unsigned char *)malloc(newsize + 1)) == NULL))
+		goto out;
+
+	for (i = 0, ncopy = 0;i < p.count;i++)
+		if (p.n[i].kind == INPLACE_COPY)
+			cp[ncopy++] = i;
+	if (sortcopies(&p, cp, ncopy, scratch, order, &nord, st))
+		goto out;
+
+	/* Preloads first, copies in order, then everything that reads
+	   nothing of the file any more */
+	end = 0;dblen = 0;eblen = 0;
+	for (i = 0, j = 0;i < ncopy;i++) {
+		u = p.n + cp[i];
+		if (u->state != ST_SCRATCH)
+			continue;
+		p.n[cp[i]].scr = j;
+		j += u->len;
+		if (emit(cmd, &end, u, INPLACE_PRELOAD, u->src))
+			goto out;
+	};
+	for (i = 0;i < nord;i++) {
+		u = p.n + cp[order[i]];
+		if (emit(cmd, &end, u, INPLACE_COPY, u->src - u->dst))
+			goto out;
+		memcpy(ndb + dblen, u->bytes, u->len);
+		dblen += u->len;
+	};
+	for (i = 0;i < p.count;i++) {
+		u = p.n + i;
+		if (u->state == ST_SCRATCH) {
+			if (emit(cmd, &end, u, INPLACE_SCRATCH, u->scr))
+				goto out;
+			memcpy(ndb + dblen, u->bytes, u->len);
+			dblen += u->len;
+		} else if (u->state == ST_LITERAL) {
+			if (emit(cmd, &end, u, INPLACE_LITERAL, 0))
+				goto out;
+			for (j = 0;j < u->len;j++)
+				neb[eblen + j] = pold[u->src + j] + u->bytes[j];
+			eblen += u->len;
+		} else if (u->kind == INPLACE_LITERAL) {
+			if (emit(cmd, &end, u, INPLACE_LITERAL, 0))
+				goto out;
+			memcpy(neb + eblen, u->bytes, u->len);
+			eblen += u->len;
+		};
+	};
+	st->commands = cmd->count;
+
+	*dbp = ndb;*dblenp = dblen;
+	*ebp = neb;*eblenp = eblen;
+	ndb = neb = NULL;
+	rc = 0;
+
+out:
+	if (rc)
+		ctrlbuf_free(cmd);
+	free(p.n);
+	free(cp);
+	free(order);
+	free(ndb);
+	free(neb);
+
+	return rc;
+}
@@ -0,0 +1,53 @@
+#pragma once
+/*
+ * In-place patches, which bspatch can apply over the old file's own
+ * storage with a small, fixed amount of extra space.
+ *
+ * An in-place patch is a BSDIFF41 patch with bit 1 of the flags byte
+ * set.  Its ctrl block holds commands instead of (add, copy, seek)
+ * triples, encoded as triples (a, b, c) with ctrl_encode, where the
+ * command writes len = c >> 2 bytes at dst = a + the end of the last
+ * command's write, and c & 3 is
+ *	INPLACE_COPY	file[dst + b ...] plus the next len diff bytes
+ *	INPLACE_SCRATCH	scratch[b ...] plus the next len diff bytes
+ *	INPLACE_LITERAL	the next len extra bytes
+ *	INPLACE_PRELOAD	no write; append file[b ...] to the scratch buffer
+ * Commands run in order, each reading all of its source before the
+ * write reaches it; bsdiff orders them so that no command reads what
+ * an earlier one has overwritten.  The file is then cut or extended
+ * to the new size.
+ */
+
+#include "ctrlcodec.h"
+
+#define INPLACE_COPY	0
+#define INPLACE_SCRATCH	1
+#define INPLACE_LITERAL	2
+#define INPLACE_PRELOAD	3
+
+/* The flag bit in byte 72 of the header */
+#define INPLACE_FLAG	2
+
+/* bspatch copies through two buffers of this size, reading one ahead;
+   a copy whose destination is less than this far past its source is
+   safe, one further ahead is split up by the planner */
+#define INPLACE_CHUNK	65536
+
+/* Scratch space bsdiff plans with unless told otherwise */
+#define INPLACE_DEFSCRATCH	(1L << 20)
+
+typedef struct inplace_stats {
+	long commands;		/* commands in the patch */
+	long preloaded;		/* bytes held in scratch to break cycles */
+	long converted;		/* copy bytes turned into literals */
+} inplace_stats;
+
+/* Turn the triples of a patch from pold to a file of newsize bytes,
+   with diff string db and extra string eb, into in-place commands in
+   cmd and new diff and extra strings in *dbp and *ebp (malloc()ed).
+   Cycles are broken by preloading up to scratch bytes, then by turning
+   copies into literals.  Returns 0, or -1 if out of memory. */
+int inplace_plan(const ctrlbuf *cb, const unsigned char *db,
+	const unsigned char *eb, const unsigned char *pold, long oldsize,
+	long newsize, long scratch, ctrlbuf *cmd, unsigned char **dbp,
+	long *dblenp, unsigned char **ebp, long *eblenp, inplace_stats *st);
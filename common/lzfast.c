@@ -0,0 +1,358 @@
+/*
+ * A fast byte-oriented LZ77 codec in the style of LZ4.
+ *
+ * The block is a sequence of frames, each holding up to LZ_FRAMESIZE
+ * bytes of input:
+ *
+ *	0	4	raw length R (little endian)
+ *	4	4	compressed length C
+ *	8	C	sequences, or R raw bytes if C == R
+ *
+ * and each sequence is a token byte (literal length in the high nibble,
+ * match length - LZ_MINMATCH in the low one, 15 meaning "more follows
+ * as a run of 255s and a final byte"), the literals, a 2-byte offset
+ * and the rest of the match length.  The last sequence of a frame has
+ * literals only.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "codec.h"
+
+#define LZ_FRAMESIZE	(1 << 20)
+#define LZ_MINMATCH	4
+#define LZ_MAXOFFSET	65535
+#define LZ_HASHLOG	16
+#define LZ_BOUND(n)	((n) + (n) / 255 + 16)
+
+typedef struct lzstate {
+	stream *f;
+	long left;		/* compressed bytes left in the block */
+	long rawlen;		/* bytes in raw */
+	long rawpos;		/* next byte of raw to return */
+	unsigned char *raw;
+	unsigned char *comp;
+	unsigned int *hash;
+} lzstate;
+
+static unsigned int get32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static void put32(unsigned char *p, unsigned int x)
+{
+	p[0] = (unsigned char)x;
+	p[1] = (unsigned char)(x >> 8);
+	p[2] = (unsigned char)(x >> 16);
+	p[3] = (unsigned char)(x >> 24);
+}
+
+static unsigned int lzhash(const unsigned char *p)
+{
+	return (get32(p) * 2654435761U) >> (32 - LZ_HASHLOG);
+}
+
+static unsigned char *putlen(unsigned char *op, long len)
+{
+	for (;len >= 255;len -= 255)
+		*op++ = 255;
+	*op++ = (unsigned char)len;
+
+	return op;
+}
+
+/* Compress n bytes of src into dst; returns the compressed length */
+static long lz_compress(unsigned int *hash, const unsigned char *src, long n,
+	unsigned char *dst)
+{
+	const unsigned char *ip = src, *anchor = src, *ref;
+	unsigned char *op = dst, *token;
+	long lit, mlen;
+	unsigned int h;
+
+	memset(hash, 0, sizeof(unsigned int) << LZ_HASHLOG);
+
+	while (src + n - ip > LZ_MINMATCH) {
+		h = lzhash(ip);
+		ref = src + hash[h];
+		hash[h] = (unsigned int)(ip - src);
+		if ((ref >= ip) || (ip - ref > LZ_MAXOFFSET) ||
+			(get32(ref) != get32(ip))) {
+			ip++;
+			continue;
+		};
+
+		/* Extend the match backwards over pending literals... */
+		while ((ip > anchor) && (ref > src) && (ip[-1] == ref[-1])) {
+			ip--;
+			ref--;
+		};
+		/* ...and forwards as far as it goes */
+		for (mlen = LZ_MINMATCH;(ip + mlen < src + n) &&
+			(ip[mlen] == ref[mlen]);mlen++);
+
+		lit = (long)(ip - anchor);
+		token = op++;
+		*token = (unsigned char)(((lit < 15 ? lit : 15) << 4) |
+			(mlen - LZ_MINMATCH < 15 ? mlen - LZ_MINMATCH : 15));
+		if (lit >= 15)
+			op = putlen(op, lit - 15);
+		memcpy(op, anchor, lit);
+		op += lit;
+		*op++ = (unsigned char)(ip - ref);
+		*op++ = (unsigned char)((ip - ref) >> 8);
+		if (mlen - LZ_MINMATCH >= 15)
+			op = putlen(op, mlen - LZ_MINMATCH - 15);
+
+		ip += mlen;
+		anchor = ip;
+	};
+
+	/* Trailing literals */
+	lit = (long)(src + n - anchor);
+	token = op++;
+	*token = (unsigned char)((lit < 15 ? lit : 15) << 4);
+	if (lit >= 15)
+		op = putlen(op, lit - 15);
+	memcpy(op, anchor, lit);
+	op += lit;
+
+	return (long)(op - dst);
+}
+
+/* Returns 0 if n bytes were decoded into dst, -1 if the frame is corrupt */
+static int lz_decompress(const unsigned char *src, long srclen,
+	unsigned char *dst, long n)
+{
+	const unsigned char *ip = src, *iend = src + srclen;
+	unsigned char *op = dst, *oend = dst + n;
+	const unsigned char *ref;
+	long lit, mlen;
+	unsigned int token;
+
+	for (;;) {
+		if (ip == iend)
+			return -1;
+		token = *ip++;
+
+		lit = token >> 4;
+		if (lit == 15) {
+			do {
+				if (ip == iend)
+					return -1;
+				lit += *ip;
+			} while (*ip++ == 255);
+		};
+		if ((lit > iend - ip) || (lit > oend - op))
+			return -1;
+		memcpy(op, ip, lit);
+		ip += lit;
+		op += lit;
+
+		if (ip == iend)
+			return (op == oend) ? 0 : -1;
+
+		if (iend - ip < 2)
+			return -1;
+		ref = op - (ip[0] | (ip[1] << 8));
+		ip += 2;
+		if ((ref == op) || (ref < dst))
+			return -1;
+
+		mlen = token & 15;
+		if (mlen == 15) {
+			do {
+				if (ip == iend)
+					return -1;
+				mlen += *ip;
+			} while (*ip++ == 255);
+		};
+		mlen += LZ_MINMATCH;
+		if (mlen > oend - op)
+			return -1;
+
+		/* The match may overlap what it produces */
+		if (op - ref >= mlen) {
+			memcpy(op, ref, mlen);
+			op += mlen;
+		} else {
+			while (mlen-- > 0)
+				*op++ = *ref++;
+		};
+	};
+}
+
+static lzstate *lz_alloc(stream *f, int encode)
+{
+	lzstate *s;
+
+	if ((s = (lzstate *)malloc(sizeof(lzstate))) == NULL)
+		return NULL;
+	s->f = f;
+	s->left = 0;
+	s->rawlen = 0;
+	s->rawpos = 0;
+	s->raw = (unsigned char *)malloc(LZ_FRAMESIZE);
+	s->comp = (unsigned char *)malloc(LZ_BOUND(LZ_FRAMESIZE));
+	s->hash = encode ?
+		(unsigned int *)malloc(sizeof(unsigned int) << LZ_HASHLOG) : NULL;
+	if ((s->raw == NULL) || (s->comp == NULL) ||
+		(encode && (s->hash == NULL))) {
+		free(s->raw);
+		free(s->comp);
+		free(s->hash);
+		free(s);
+		return NULL;
+	};
+
+	return s;
+}
+
+static void lz_free(lzstate *s)
+{
+	free(s->raw);
+	free(s->comp);
+	free(s->hash);
+	free(s);
+}
+
+static void *lz_wopen(stream *f, int level)
+{
+	return lz_alloc(f, 1);
+}
+
+static int lz_flush(void *p)
+{
+	lzstate *s = (lzstate *)p;
+	unsigned char hdr[8];
+	long clen;
+
+	if (s->rawlen == 0)
+		return 0;
+
+	clen = lz_compress(s->hash, s->raw, s->rawlen, s->comp);
+	if (clen >= s->rawlen) {
+		clen = s->rawlen;
+		memcpy(s->comp, s->raw, clen);
+	};
+	put32(hdr, (unsigned int)s->rawlen);
+	put32(hdr + 4, (unsigned int)clen);
+	if (stream_write(s->f, hdr, 8) || stream_write(s->f, s->comp, clen))
+		return -1;
+	s->rawlen = 0;
+
+	return 0;
+}
+
+static int lz_write(void *p, const void *buf, long len)
+{
+	lzstate *s = (lzstate *)p;
+	long n;
+
+	while (len > 0) {
+		n = LZ_FRAMESIZE - s->rawlen;
+		if (n > len)
+			n = len;
+		memcpy(s->raw + s->rawlen, buf, n);
+		s->rawlen += n;
+		buf = (const unsigned char *)buf + n;
+		len -= n;
+		if ((s->rawlen == LZ_FRAMESIZE) && lz_flush(s))
+			return -1;
+	};
+
+	return 0;
+}
+
+static int lz_wclose(void *p)
+{
+	int rc;
+
+	rc = lz_flush(p);
+	lz_free((lzstate *)p);
+
+	return rc;
+}
+
+static void *lz_ropen(stream *f, long len)
+{
+	lzstate *s;
+
+	if ((s = lz_alloc(f, 0)) != NULL)
+		s->left = len;
+
+	return s;
+}
+
+/* Decode the next frame into raw; returns 0, or -1 if corrupt */
+static int lz_nextframe(lzstate *s)
+{
+	unsigned char hdr[8];
+	long rlen, clen;
+
+	if ((s->left < 8) || (stream_read(s->f, hdr, 8) != 8))
+		return -1;
+	rlen = get32(hdr);
+	clen = get32(hdr + 4);
+	s->left -= 8;
+	if ((rlen == 0) || (rlen > LZ_FRAMESIZE) || (clen > rlen) ||
+		(clen > s->left))
+		return -1;
+	if (clen == rlen) {
+		if (stream_read(s->f, s->raw, rlen) != rlen)
+			return -1;
+	} else {
+		if ((stream_read(s->f, s->comp, clen) != clen) ||
+			lz_decompress(s->comp, clen, s->raw, rlen))
+			return -1;
+	};
+	s->left -= clen;
+	s->rawlen = rlen;
+	s->rawpos = 0;
+
+	return 0;
+}
+
+static long lz_read(void *p, void *buf, long len)
+{
+	lzstate *s = (lzstate *)p;
+	long n, done;
+
+	for (done = 0;done < len;done += n) {
+		if (s->rawpos == s->rawlen) {
+			if (s->left == 0)
+				break;
+			if (lz_nextframe(s))
+				return -1;
+		};
+		n = s->rawlen - s->rawpos;
+		if (n > len - done)
+			n = len - done;
+		memcpy((unsigned char *)buf + done, s->raw + s->rawpos, n);
+		s->rawpos += n;
+	};
+
+	return done;
+}
+
+static void lz_rclose(void *p)
+{
+	lz_free((lzstate *)p);
+}
+
+static size_t lz_wmemory(int level, long len, long dictlen)
+{
+	return sizeof(lzstate) + LZ_FRAMESIZE + LZ_BOUND(LZ_FRAMESIZE) +
+		(sizeof(unsigned int) << LZ_HASHLOG);
+}
+
+const codec lz_codec = {
+	CODEC_LZ, "lz",
+	lz_wopen, lz_write, lz_flush, lz_wclose, lz_wmemory,
+	lz_ropen, lz_read, lz_rclose,
+	NULL,
+	NULL,
+	NULL,
+	NULL
+};
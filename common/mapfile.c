@@ -0,0 +1,166 @@
+/*
+ * Read-only file mappings: MapViewOfFile on Windows, mmap elsewhere.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "mapfile.h"
+
+/* Hints are rounded out to pages of this size */
+#define MAP_PAGE	4096
+
+static int readin(mapfile *m, const char *name)
+{
+	FILE *f;
+
+	if ((f = fopen(name, "rb")) == NULL)
+		return -1;
+	if (fseek(f, 0, SEEK_END) || ((m->size = ftell(f)) < 0) ||
+		fseek(f, 0, SEEK_SET)) {
+		fclose(f);
+		return -1;
+	};
+	if ((m->p = (unsigned char *)malloc(m->size + 1)) == NULL) {
+		fclose(f);
+		errno = ENOMEM;
+		return -1;
+	};
+	if (fread(m->p, 1, m->size, f) != (size_t)m->size) {
+		free(m->p);
+		fclose(f);
+		errno = EIO;
+		return -1;
+	};
+	fclose(f);
+	m->mapped = 0;
+
+	return 0;
+}
+
+#ifdef _WIN32
+/* PrefetchVirtualMemory is only there from Windows 8 on */
+typedef struct map_range {
+	PVOID addr;
+	SIZE_T len;
+} map_range;
+typedef BOOL (WINAPI *prefetchfn)(HANDLE, ULONG_PTR, map_range *, ULONG);
+
+int map_open(mapfile *m, const char *name, int map)
+{
+	HANDLE f;
+	LARGE_INTEGER size;
+
+	m->p = NULL;
+	m->h = NULL;
+	if (!map)
+		return readin(m, name);
+
+	f = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (f == INVALID_HANDLE_VALUE)
+		return readin(m, name);
+	if (GetFileSizeEx(f, &size) && (size.QuadPart > 0) &&
+		(size.QuadPart < 0x7fffffff) &&
+		((m->h = CreateFileMappingA(f, NULL, PAGE_READONLY, 0, 0,
+		NULL)) != NULL)) {
+		if ((m->p = (unsigned char *)MapViewOfFile(m->h, FILE_MAP_READ,
+			0, 0, 0)) == NULL) {
+			CloseHandle(m->h);
+			m->h = NULL;
+		};
+	};
+	CloseHandle(f);
+	if (m->p == NULL)
+		return readin(m, name);
+	m->size = (long)size.QuadPart;
+	m->mapped = 1;
+
+	return 0;
+}
+
+void map_willneed(const mapfile *m, long off, long len)
+{
+	static prefetchfn prefetch;
+	static int looked;
+	map_range r;
+
+	if (!m->mapped || (off >= m->size) || (len <= 0))
+		return;
+	if (!looked) {
+		prefetch = (prefetchfn)GetProcAddress(GetModuleHandleA("kernel32.dll"),
+			"PrefetchVirtualMemory");
+		looked = 1;
+	};
+	if (prefetch == NULL)
+		return;
+	if (len > m->size - off)
+		len = m->size - off;
+	r.addr = m->p + off;
+	r.len = len;
+	prefetch(GetCurrentProcess(), 1, &r, 0);
+}
+
+void map_close(mapfile *m)
+{
+	if (m->mapped) {
+		UnmapViewOfFile(m->p);
+		CloseHandle(m->h);
+	} else
+		free(m->p);
+	m->p = NULL;
+}
+#else
+int map_open(mapfile *m, const char *name, int map)
+{
+	struct stat st;
+	void *p;
+	int fd;
+
+	m->p = NULL;
+	if (!map)
+		return readin(m, name);
+
+	if ((fd = open(name, O_RDONLY)) < 0)
+		return -1;
+	p = MAP_FAILED;
+	if ((fstat(fd, &st) == 0) && (st.st_size > 0) &&
+		(st.st_size < 0x7fffffff))
+		p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return readin(m, name);
+	m->p = (unsigned char *)p;
+	m->size = (long)st.st_size;
+	m->mapped = 1;
+
+	return 0;
+}
+
+void map_willneed(const mapfile *m, long off, long len)
+{
+	long lo;
+
+	if (!m->mapped || (off >= m->size) || (len <= 0))
+		return;
+	if (len > m->size - off)
+		len = m->size - off;
+	lo = off - off % MAP_PAGE;
+	madvise(m->p + lo, len + (off - lo), MADV_WILLNEED);
+}
+
+void map_close(mapfile *m)
+{
+	if (m->mapped)
+		munmap(m->p, m->size);
+	else
+		free(m->p);
+	m->p = NULL;
+}
+#endif
@@ -0,0 +1,28 @@
+#pragma once
+/*
+ * Read-only file mappings: MapViewOfFile on Windows, mmap elsewhere.
+ *
+ * A file that cannot be mapped, such as an empty one, is read into
+ * memory instead, so callers see the same bytes either way.
+ */
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+typedef struct mapfile {
+	unsigned char *p;
+	long size;
+	int mapped;		/* 0 if p was malloc()ed and read */
+#ifdef _WIN32
+	HANDLE h;		/* the file mapping */
+#endif
+} mapfile;
+
+/* Map name, or read it if map is 0 or mapping fails; returns 0, or -1
+   with errno set */
+int map_open(mapfile *m, const char *name, int map);
+/* Ask for the len bytes at off to be paged in in the background, so
+   that touching them later does not wait on the disk */
+void map_willneed(const mapfile *m, long off, long len);
+void map_close(mapfile *m);
@@ -0,0 +1,21 @@
+/*
+ * Sizes given on the command line (see parsesize.h).
+ */
+
+#include <stdlib.h>
+#include "parsesize.h"
+
+double parsesize(const char *str, double max)
+{
+	char *end;
+	double x;
+
+	x = strtod(str, &end);
+	switch (*end) {
+	case 'k': case 'K': x *= 1 << 10; end++; break;
+	case 'm': case 'M': x *= 1 << 20; end++; break;
+	case 'g': case 'G': x *= 1 << 30; end++; break;
+	};
+
+	return ((end == str) || (*end != 0) || !(x >= 0) || (x > max)) ? -1 : x;
+}
@@ -0,0 +1,8 @@
+#pragma once
+/*
+ * Sizes given on the command line, shared by bsdiff and bspatch.
+ */
+
+/* Parse a size in bytes with an optional k, m or g suffix; returns it,
+   or -1 if str is not one or it is over max */
+double parsesize(const char *str, double max);
@@ -0,0 +1,227 @@
+/*
+ * Reading BSDIFF40 and BSDIFF41 patch files.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "patchfile.h"
+
+long patch_offtin(const unsigned char *buf)
+{
+	long y;
+
+	y = buf[7] & 0x7F;
+	y = y * 256;y += buf[6];
+	y = y * 256;y += buf[5];
+	y = y * 256;y += buf[4];
+	y = y * 256;y += buf[3];
+	y = y * 256;y += buf[2];
+	y = y * 256;y += buf[1];
+	y = y * 256;y += buf[0];
+
+	if (buf[7] & 0x80) y = -y;
+
+	return y;
+}
+
+void patch_offtout(long x, unsigned char *buf)
+{
+	long y;
+	int i;
+
+	if (x < 0) y = -x; else y = x;
+
+	for (i = 0;i < 8;i++) {
+		buf[i] = y % 256;
+		y = y / 256;
+	};
+
+	if (x < 0) buf[7] |= 0x80;
+}
+
+int patch_readheader(stream *f, patchhdr *h)
+{
+	unsigned char *header = h->raw;
+	long size;
+	int i;
+
+	memset(h, 0, sizeof(patchhdr));
+	if (stream_read(f, header, 32) < 32)
+		return -1;
+
+	h->c[0] = h->c[1] = h->c[2] = codec_find(CODEC_BZIP2);
+	if (memcmp(header, "BSDIFF40", 8) == 0) {
+		h->hdrlen = 32;
+		h->ctrllen = patch_offtin(header + 8);
+		h->datalen = patch_offtin(header + 16);
+		h->newsize = patch_offtin(header + 24);
+
+		/* The extra block runs to the end of the file */
+		if ((size = stream_size(f)) == -1)
+			return -1;
+		h->extralen = size - h->hdrlen - h->ctrllen - h->datalen;
+	} else if (memcmp(header, "BSDIFF41", 8) == 0) {
+		h->hdrlen = patch_offtin(header + 8);
+		if ((h->hdrlen < 48) || (stream_read(f, header + 32, 16) < 16))
+			return -1;
+		h->newsize = patch_offtin(header + 16);
+		h->ctrllen = patch_offtin(header + 24);
+		h->datalen = patch_offtin(header + 32);
+		h->extralen = patch_offtin(header + 40);
+		if (h->hdrlen >= 56) {
+			if (stream_read(f, header + 48, 8) < 8)
+				return -1;
+			for (i = 0;i < 3;i++)
+				if ((h->c[i] = codec_find(header[48 + i])) == NULL)
+					return -2;
+		};
+		if (h->hdrlen >= 80) {
+			if (stream_read(f, header + 56, 24) < 24)
+				return -1;
+			h->hashes = 1;
+			h->sha = header[72] & 1;
+			h->inplace = (header[72] & INPLACE_FLAG) != 0;
+			if (h->sha && ((h->hdrlen < 144) ||
+				(stream_read(f, header + 80, 64) < 64)))
+				return -1;
+		};
+	} else
+		return -1;
+
+	if ((h->ctrllen < 0) || (h->datalen < 0) || (h->extralen < 0) ||
+		(h->newsize < 0))
+		return -1;
+
+	return 0;
+}
+
+unsigned char *patch_readall(const codec *c, void *cs, long *lenp)
+{
+	unsigned char *buf, *p;
+	long len, alloc, lenread;
+
+	len = 0;alloc = 0;buf = NULL;
+	do {
+		if (len == alloc) {
+			alloc = alloc ? alloc * 2 : 65536;
+			if ((p = (unsigned char *)realloc(buf, alloc)) == NULL) {
+				free(buf);
+				return NULL;
+			};
+			buf = p;
+		};
+		if ((lenread = c->read(cs, buf + len, alloc - len)) < 0) {
+			free(buf);
+			return NULL;
+		};
+		len += lenread;
+	} while (len == alloc);
+
+	*lenp = len;
+	return buf;
+}
+
+unsigned char *patch_readblock(stream *f, long off, long len, const codec *c,
+	const void *dict, long dictlen, long *lenp)
+{
+	unsigned char *buf;
+	void *cs;
+
+	if (stream_seek(f, off) || ((cs = c->ropen(f, len)) == NULL))
+		return NULL;
+	if ((dict != NULL) && (c->setdict != NULL))
+		c->setdict(cs, dict, dictlen);
+	buf = patch_readall(c, cs, lenp);
+	c->rclose(cs);
+
+	return buf;
+}
+
+int patch_readctrl(const patchhdr *h, const unsigned char *buf, long len,
+	ctrlbuf *cb)
+{
+	ctrlreader cr;
+	long ctrl[3];
+	long i;
+	int rc;
+
+	if (h->hdrlen == 32) {
+		if (len % 24 != 0)
+			return -1;
+		for (i = 0;i < len;i += 24)
+			if (ctrlbuf_push(cb, patch_offtin(buf + i),
+				patch_offtin(buf + i + 8), patch_offtin(buf + i + 16)))
+				return -1;
+		return 0;
+	};
+
+	if (ctrl_open(&cr, buf, len))
+		return -1;
+	while ((rc = ctrl_next(&cr, ctrl)) == 1)
+		if (ctrlbuf_push(cb, ctrl[0], ctrl[1], ctrl[2]))
+			return -1;
+
+	return rc;
+}
+
+int patch_needsdict(const patchhdr *h)
+{
+	return (h->c[1]->setdict != NULL) || (h->c[2]->setdict != NULL);
+}
+
+int patch_load(stream *f, patchdata *p, const void *dict, long dictlen)
+{
+	unsigned char *ctrlblock;
+	long ctrlblocklen;
+	int rc;
+
+	p->db = p->eb = NULL;
+	ctrlbuf_init(&p->cb);
+	if ((rc = patch_readheader(f, &p->h)) != 0)
+		return rc;
+	if ((dict == NULL) && patch_needsdict(&p->h))
+		return -3;
+
+	if ((ctrlblock = patch_readblock(f, p->h.hdrlen, p->h.ctrllen,
+		p->h.c[0], NULL, 0, &ctrlblocklen)) == NULL)
+		return -1;
+	rc = patch_readctrl(&p->h, ctrlblock, ctrlblocklen, &p->cb);
+	free(ctrlblock);
+	if ((rc != 0) ||
+		((p->db = patch_readblock(f, p->h.hdrlen + p->h.ctrllen,
+		p->h.datalen, p->h.c[1], dict, dictlen, &p->dblen)) == NULL) ||
+		((p->eb = patch_readblock(f, p->h.hdrlen + p->h.ctrllen +
+		p->h.datalen, p->h.extralen, p->h.c[2], dict, dictlen,
+		&p->eblen)) == NULL))
+		return -1;
+
+	return 0;
+}
+
+void patch_free(patchdata *p)
+{
+	ctrlbuf_free(&p->cb);
+	free(p->db);
+	free(p->eb);
+	p->db = p->eb = NULL;
+}
+
+int patch_checkhash(xxh64_state *xs, sha256_state *ss,
+	const unsigned char *x, const unsigned char *sha)
+{
+	unsigned long long h;
+	unsigned char digest[SHA256_LEN];
+	int i;
+
+	h = xxh64_final(xs);
+	for (i = 0;i < 8;i++)
+		if (x[i] != (unsigned char)(h >> (i * 8)))
+			return 0;
+	if (sha != NULL) {
+		sha256_final(ss, digest);
+		if (memcmp(digest, sha, SHA256_LEN) != 0)
+			return 0;
+	};
+
+	return 1;
+}
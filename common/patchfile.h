@@ -0,0 +1,69 @@
+#pragma once
+/*
+ * Reading BSDIFF40 and BSDIFF41 patch files.
+ *
+ * The header layouts are described in bsdiff.c and bspatch.c.
+ */
+
+#include "codec.h"
+#include "ctrlcodec.h"
+#include "hash.h"
+#include "inplace.h"
+
+#define PATCH_MAXHDR	144
+
+typedef struct patchhdr {
+	long hdrlen;			/* 32 for BSDIFF40 */
+	long newsize;
+	long ctrllen;			/* compressed block lengths */
+	long datalen;
+	long extralen;
+	const codec *c[3];		/* ctrl, diff and extra codecs */
+	int hashes;			/* XXH64s at raw + 56 and 64 */
+	int sha;			/* SHA-256s at raw + 80 and 112 */
+	int inplace;			/* ctrl holds in-place commands */
+	unsigned char raw[PATCH_MAXHDR];	/* the header as read */
+} patchhdr;
+
+long patch_offtin(const unsigned char *buf);
+void patch_offtout(long x, unsigned char *buf);
+
+/* Read the header at the start of f; returns 0, -1 if f is not a
+   patch or is corrupt, or -2 if it uses a codec that is not built in */
+int patch_readheader(stream *f, patchhdr *h);
+
+/* Decompress the rest of the block open on cs into a malloc()ed
+   buffer; returns NULL if corrupt or out of memory */
+unsigned char *patch_readall(const codec *c, void *cs, long *lenp);
+
+/* Decompress the len bytes at offset off of f with c, offering it dict
+   if it takes one */
+unsigned char *patch_readblock(stream *f, long off, long len, const codec *c,
+	const void *dict, long dictlen, long *lenp);
+
+/* Decode a whole ctrl block of either format into cb; returns 0, or -1
+   if corrupt or out of memory */
+int patch_readctrl(const patchhdr *h, const unsigned char *buf, long len,
+	ctrlbuf *cb);
+
+/* A patch decoded whole */
+typedef struct patchdata {
+	patchhdr h;
+	ctrlbuf cb;
+	unsigned char *db, *eb;
+	long dblen, eblen;
+} patchdata;
+
+/* Returns 1 if the diff or extra codec takes the old file as dictionary */
+int patch_needsdict(const patchhdr *h);
+
+/* Read and decode all of f, with dict as the old file for codecs that
+   take one; returns 0, -1 if corrupt or out of memory, -2 if it uses a
+   codec that is not built in, or -3 if it needs dict and that is NULL */
+int patch_load(stream *f, patchdata *p, const void *dict, long dictlen);
+void patch_free(patchdata *p);
+
+/* Compare finished hashes with the XXH64 at x and the SHA-256 at sha,
+   if not NULL; returns 1 if they match */
+int patch_checkhash(xxh64_state *xs, sha256_state *ss,
+	const unsigned char *x, const unsigned char *sha);
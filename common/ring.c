@@ -0,0 +1,155 @@
+/*
+ * A block decoder running on its own thread.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "addbytes.h"
+#include "ring.h"
+
+/* The worker hands over at most this much at a time, so that the
+   reader can start early, and the reader gives back room as often */
+#define RING_STEP	65536
+
+static void producer(void *arg)
+{
+	ring *r = (ring *)arg;
+	long pos, n, got;
+
+	mutex_lock(&r->m);
+	while (!r->stop) {
+		if (r->head - r->tail == r->size) {
+			cond_wait(&r->room, &r->m);
+			continue;
+		};
+
+		/* Decode into the free space up to the end of the buffer;
+		   the reader never touches it, so the lock can go */
+		pos = r->head & (r->size - 1);
+		n = r->size - (r->head - r->tail);
+		if (n > r->size - pos)
+			n = r->size - pos;
+		if (n > RING_STEP)
+			n = RING_STEP;
+		mutex_unlock(&r->m);
+		got = r->c->read(r->cs, r->buf + pos, n);
+		mutex_lock(&r->m);
+
+		if (got < 0)
+			r->error = 1;
+		else
+			r->head += got;
+		if (got < n)
+			r->eof = 1;
+		cond_broadcast(&r->more);
+		if (r->eof)
+			break;
+	};
+	mutex_unlock(&r->m);
+}
+
+int ring_start(ring *r, const codec *c, void *cs, long size)
+{
+	r->c = c;
+	r->cs = cs;
+	r->size = size;
+	r->head = r->tail = 0;
+	r->seen = r->taken = 0;
+	r->eof = r->error = r->stop = 0;
+	r->buf = NULL;
+	if ((size > 0) && ((r->buf = (unsigned char *)malloc(size)) == NULL))
+		return -1;
+	mutex_init(&r->m);
+	cond_init(&r->more);
+	cond_init(&r->room);
+	r->threaded = (size > 0) && (thread_start(&r->t, producer, r) == 0);
+
+	return 0;
+}
+
+static long ring_get(ring *r, unsigned char *buf, const unsigned char *add,
+	long len)
+{
+	long done, pos, n;
+
+	for (done = 0;done < len;done += n) {
+		/* Give back what was taken and see what came in since, waiting
+		   for it if nothing did */
+		if ((r->taken == r->seen) || (r->taken - r->tail >= RING_STEP)) {
+			mutex_lock(&r->m);
+			r->tail = r->taken;
+			cond_broadcast(&r->room);
+			while ((r->head == r->taken) && !r->eof)
+				cond_wait(&r->more, &r->m);
+			r->seen = r->head;
+			mutex_unlock(&r->m);
+			if (r->seen == r->taken)
+				break;
+		};
+
+		/* Take what is there up to the end of the buffer; the worker
+		   leaves it alone until it is given back */
+		pos = r->taken & (r->size - 1);
+		n = r->seen - r->taken;
+		if (n > r->size - pos)
+			n = r->size - pos;
+		if (n > len - done)
+			n = len - done;
+		memcpy(buf + done, r->buf + pos, n);
+		if (add != NULL)
+			add_bytes(buf + done, add + done, n);
+		r->taken += n;
+	};
+
+	/* The worker only fails at its end, which was seen under the lock */
+	return ((done < len) && r->error) ? -1 : done;
+}
+
+long ring_read(ring *r, void *buf, long len)
+{
+	if (!r->threaded)
+		return r->c->read(r->cs, buf, len);
+
+	return ring_get(r, (unsigned char *)buf, NULL, len);
+}
+
+long ring_readadd(ring *r, void *buf, const void *add, long len)
+{
+	long n;
+
+	if (!r->threaded) {
+		if (r->c->readadd != NULL)
+			return r->c->readadd(r->cs, buf, add, len);
+		if ((n = r->c->read(r->cs, buf, len)) > 0)
+			add_bytes((unsigned char *)buf, (const unsigned char *)add, n);
+		return n;
+	};
+
+	return ring_get(r, (unsigned char *)buf, (const unsigned char *)add, len);
+}
+
+int ring_threaddiff(const codec *c, long datalen, long extralen)
+{
+	int n;
+
+	if (c->readadd == NULL)
+		return 1;
+	n = thread_cpus();
+
+	return (n >= 3) || ((n == 2) && (extralen < datalen / 8));
+}
+
+void ring_stop(ring *r)
+{
+	if (r->threaded) {
+		mutex_lock(&r->m);
+		r->stop = 1;
+		cond_broadcast(&r->room);
+		mutex_unlock(&r->m);
+		thread_join(&r->t);
+	};
+	cond_destroy(&r->more);
+	cond_destroy(&r->room);
+	mutex_destroy(&r->m);
+	free(r->buf);
+}
@@ -0,0 +1,50 @@
+#pragma once
+/*
+ * A block decoder running on its own thread.
+ *
+ * The worker decodes into a bounded single-producer, single-consumer
+ * ring, and the reader takes bytes out of it, so the blocks of a patch
+ * decode in parallel while the reader only applies them.  The reader
+ * only takes the lock once it has used up what it last saw there, or
+ * every RING_STEP bytes to make room, so small reads cost a copy.  If
+ * no thread can be started, or the ring is given no room, reads go
+ * straight to the codec instead; a diff block is read that way where
+ * its codec has readadd, which adds the old data as it decodes rather
+ * than in a pass of its own over the copy out of the ring, and there
+ * is no processor to spare for it (ring_threaddiff).
+ */
+
+#include "codec.h"
+#include "thread.h"
+
+typedef struct ring {
+	const codec *c;
+	void *cs;
+	unsigned char *buf;
+	long size;			/* a power of two */
+	long head, tail;		/* bytes put in and taken out */
+	long seen, taken;		/* the reader's own head and tail */
+	int eof, error, stop;
+	int threaded;
+	mutex m;
+	cond more, room;		/* signalled as head and tail move */
+	thread t;
+} ring;
+
+/* Whether a diff block in codec c, of datalen bytes in a patch whose
+   extra block is extralen, is better decoded on a thread than read
+   through c's readadd: the thread takes the decoding off the reader,
+   but readadd saves a pass over the diff bytes, which wins unless a
+   processor is left for the thread besides the reader's and the extra
+   block's, or the extra block is small enough to leave its own */
+int ring_threaddiff(const codec *c, long datalen, long extralen);
+
+/* Start decoding the block open on cs into a ring of size bytes, or
+   with size 0 leave it to be decoded as it is read; returns 0, or -1
+   if out of memory */
+int ring_start(ring *r, const codec *c, void *cs, long size);
+/* As the codec's read and readadd */
+long ring_read(ring *r, void *buf, long len);
+long ring_readadd(ring *r, void *buf, const void *add, long len);
+/* Stop the worker; the codec state is still the caller's to close */
+void ring_stop(ring *r);
@@ -0,0 +1,117 @@
+/*
+ * Byte streams over a FILE, a span of memory, or callbacks.
+ */
+
+#include <string.h>
+#include "stream.h"
+
+void stream_file(stream *s, FILE *f)
+{
+	memset(s, 0, sizeof(stream));
+	s->kind = STREAM_FILE;
+	s->f = f;
+	s->size = -1;
+}
+
+void stream_span(stream *s, const void *p, long size)
+{
+	memset(s, 0, sizeof(stream));
+	s->kind = STREAM_SPAN;
+	s->p = (unsigned char *)p;
+	s->size = size;
+}
+
+void stream_callback(stream *s, stream_readfn read, stream_writefn write,
+	void *arg, long size)
+{
+	memset(s, 0, sizeof(stream));
+	s->kind = STREAM_CALLBACK;
+	s->read = read;
+	s->write = write;
+	s->arg = arg;
+	s->size = size;
+}
+
+long stream_read(stream *s, void *buf, long len)
+{
+	size_t n;
+	long got, r;
+
+	switch (s->kind) {
+	case STREAM_FILE:
+		n = fread(buf, 1, len, s->f);
+		return ((n < (size_t)len) && ferror(s->f)) ? -1 : (long)n;
+	case STREAM_SPAN:
+		if (len > s->size - s->pos)
+			len = (s->pos < s->size) ? s->size - s->pos : 0;
+		memcpy(buf, s->p + s->pos, len);
+		s->pos += len;
+		return len;
+	};
+
+	/* Callbacks may return short reads before the end */
+	if (s->read == NULL)
+		return -1;
+	for (got = 0;got < len;got += r) {
+		if ((r = s->read(s->arg, s->pos, (char *)buf + got, len - got)) < 0)
+			return -1;
+		if (r == 0)
+			break;
+		s->pos += r;
+	};
+
+	return got;
+}
+
+int stream_write(stream *s, const void *buf, long len)
+{
+	switch (s->kind) {
+	case STREAM_FILE:
+		return (fwrite(buf, 1, len, s->f) == (size_t)len) ? 0 : -1;
+	case STREAM_SPAN:
+		if (len > s->size - s->pos)
+			return -1;
+		memcpy(s->p + s->pos, buf, len);
+		break;
+	default:
+		if ((s->write == NULL) || s->write(s->arg, buf, len))
+			return -1;
+		break;
+	};
+	s->pos += len;
+
+	return 0;
+}
+
+int stream_seek(stream *s, long off)
+{
+	if (s->kind == STREAM_FILE)
+		return fseek(s->f, off, SEEK_SET) ? -1 : 0;
+
+	/* What has gone out through a write callback cannot be revisited */
+	if ((off < 0) || ((s->kind == STREAM_CALLBACK) && (s->read == NULL)))
+		return -1;
+	s->pos = off;
+
+	return 0;
+}
+
+long stream_tell(stream *s)
+{
+	return (s->kind == STREAM_FILE) ? ftell(s->f) : s->pos;
+}
+
+long stream_size(stream *s)
+{
+	long pos, size;
+
+	if (s->kind != STREAM_FILE)
+		return s->size;
+	if (((pos = ftell(s->f)) == -1) || fseek(s->f, 0, SEEK_END))
+		return -1;
+	size = ftell(s->f);
+	if (fseek(s->f, pos, SEEK_SET))
+		return -1;
+
+	return size;
+}
@@ -0,0 +1,49 @@
+#pragma once
+/*
+ * Byte streams the codecs and the patch readers and writers work on:
+ * a FILE, a span of memory, or a caller's callbacks.
+ */
+
+#include <stdio.h>
+
+#define STREAM_FILE	0
+#define STREAM_SPAN	1
+#define STREAM_CALLBACK	2
+
+/* Read up to len bytes at off; returns the number read, or -1 */
+typedef long (*stream_readfn)(void *arg, long off, void *buf, long len);
+/* Take the next len bytes of output; returns 0, or nonzero to fail */
+typedef int (*stream_writefn)(void *arg, const void *buf, long len);
+
+typedef struct stream {
+	int kind;
+	FILE *f;
+	unsigned char *p;	/* a span's bytes */
+	long pos;		/* position in a span or callback stream */
+	long size;		/* its size, -1 if not known */
+	stream_readfn read;
+	stream_writefn write;
+	void *arg;
+} stream;
+
+/* Read and write f from its current position */
+void stream_file(stream *s, FILE *f);
+/* Read the size bytes at p, or write at most size bytes there */
+void stream_span(stream *s, const void *p, long size);
+/* Read through read, which gets the offset, and write through write,
+   which gets the output in order; either may be NULL if not needed,
+   and size may be -1 if the read side does not know it */
+void stream_callback(stream *s, stream_readfn read, stream_writefn write,
+	void *arg, long size);
+
+/* Returns the number of bytes read, less than len only at the end, or
+   -1 on error */
+long stream_read(stream *s, void *buf, long len);
+/* Returns 0 if all of buf was written, or -1 */
+int stream_write(stream *s, const void *buf, long len);
+/* Move to off; returns 0, or -1 */
+int stream_seek(stream *s, long off);
+/* Returns the position, or -1 */
+long stream_tell(stream *s);
+/* Returns the size of what can be read, or -1 if it cannot be told */
+long stream_size(stream *s);
@@ -0,0 +1,152 @@
+/*
+ * Minimal threads: Win32 threads on Windows, POSIX threads elsewhere.
+ */
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+#include "thread.h"
+
+#ifdef _WIN32
+static unsigned __stdcall trampoline(void *p)
+{
+	thread *t = (thread *)p;
+
+	t->fn(t->arg);
+	return 0;
+}
+
+int thread_start(thread *t, void (*fn)(void *), void *arg)
+{
+	t->fn = fn;
+	t->arg = arg;
+	t->handle = (HANDLE)_beginthreadex(NULL, 0, trampoline, t, 0, NULL);
+
+	return (t->handle != NULL) ? 0 : -1;
+}
+
+void thread_join(thread *t)
+{
+	WaitForSingleObject(t->handle, INFINITE);
+	CloseHandle(t->handle);
+}
+
+int thread_cpus(void)
+{
+	SYSTEM_INFO si;
+
+	GetSystemInfo(&si);
+	return (si.dwNumberOfProcessors > 0) ? (int)si.dwNumberOfProcessors : 1;
+}
+
+void mutex_init(mutex *m)
+{
+	InitializeCriticalSection(m);
+}
+
+void mutex_lock(mutex *m)
+{
+	EnterCriticalSection(m);
+}
+
+void mutex_unlock(mutex *m)
+{
+	LeaveCriticalSection(m);
+}
+
+void mutex_destroy(mutex *m)
+{
+	DeleteCriticalSection(m);
+}
+
+void cond_init(cond *c)
+{
+	InitializeConditionVariable(c);
+}
+
+void cond_wait(cond *c, mutex *m)
+{
+	SleepConditionVariableCS(c, m, INFINITE);
+}
+
+void cond_broadcast(cond *c)
+{
+	WakeAllConditionVariable(c);
+}
+
+void cond_destroy(cond *c)
+{
+	(void)c;
+}
+#else
+static void *trampoline(void *p)
+{
+	thread *t = (thread *)p;
+
+	t->fn(t->arg);
+	return NULL;
+}
+
+int thread_start(thread *t, void (*fn)(void *), void *arg)
+{
+	t->fn = fn;
+	t->arg = arg;
+
+	return pthread_create(&t->handle, NULL, trampoline, t) ? -1 : 0;
+}
+
+void thread_join(thread *t)
+{
+	pthread_join(t->handle, NULL);
+}
+
+int thread_cpus(void)
+{
+	long n;
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	return (n > 0) ? (int)n : 1;
+}
+
+void mutex_init(mutex *m)
+{
+	pthread_mutex_init(m, NULL);
+}
+
+void mutex_lock(mutex *m)
+{
+	pthread_mutex_lock(m);
+}
+
+void mutex_unlock(mutex *m)
+{
+	pthread_mutex_unlock(m);
+}
+
+void mutex_destroy(mutex *m)
+{
+	pthread_mutex_destroy(m);
+}
+
+void cond_init(cond *c)
+{
+	pthread_cond_init(c, NULL);
+}
+
+void cond_wait(cond *c, mutex *m)
+{
+	pthread_cond_wait(c, m);
+}
+
+void cond_broadcast(cond *c)
+{
+	pthread_cond_broadcast(c);
+}
+
+void cond_destroy(cond *c)
+{
+	pthread_cond_destroy(c);
+}
+#endif
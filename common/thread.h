@@ -0,0 +1,46 @@
+#pragma once
+/*
+ * Minimal threads: Win32 threads on Windows, POSIX threads elsewhere.
+ */
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+typedef struct thread {
+	void (*fn)(void *);
+	void *arg;
+#ifdef _WIN32
+	HANDLE handle;
+#else
+	pthread_t handle;
+#endif
+} thread;
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION mutex;
+typedef CONDITION_VARIABLE cond;
+#else
+typedef pthread_mutex_t mutex;
+typedef pthread_cond_t cond;
+#endif
+
+/* Run fn(arg) on a new thread; returns 0, or -1 if none could be made */
+int thread_start(thread *t, void (*fn)(void *), void *arg);
+/* Wait for the thread to return */
+void thread_join(thread *t);
+/* The processors the system has online, at least 1 */
+int thread_cpus(void);
+
+void mutex_init(mutex *m);
+void mutex_lock(mutex *m);
+void mutex_unlock(mutex *m);
+void mutex_destroy(mutex *m);
+
+void cond_init(cond *c);
+/* Release m, wait for a signal, and take m again; may wake spuriously */
+void cond_wait(cond *c, mutex *m);
+void cond_broadcast(cond *c);
+void cond_destroy(cond *c);
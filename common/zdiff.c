@@ -0,0 +1,630 @@
+/*
+ * A codec for bsdiff's diff block.
+ *
+ * The diff block holds bytewise differences between matched regions
+ * of the old and new files, so it is mostly zeros with short runs of
+ * small nonzero deltas, and the same runs recur whenever a shifted
+ * pointer or displacement is fixed up again.  Each frame of up to
+ * ZD_FRAMESIZE bytes is split into alternating zero runs and nonzero
+ * runs, and stored as
+ *
+ *	0	4	raw length R (little endian)
+ *	4	4	number of (zero run, nonzero run) pairs K
+ *	8	4	length L of the range coded stream
+ *	12	L	per pair, the length of its zero run and the position
+ *		of its nonzero run in a list of the ZD_MTFSIZE most
+ *		recently seen runs, or ZD_NEWRUN; range coded
+ *	??	??	lengths of the new runs as varints, Huffman coded
+ *	??	??	bytes of the new runs, Huffman coded
+ *
+ * The Huffman coded streams are framed by huff_put.  The range coder
+ * is a binary one, as LZMA's, with probabilities that adapt as it
+ * goes; a zero run is coded as whether it is as long as the one
+ * before, else as its number of bits and then the bits below the top
+ * one, and a position as six bits.  Each takes as context the
+ * positions of the pair before, or the two before, so that the
+ * pattern in which fixups recur costs little, which order-0 coding
+ * could not see.
+ *
+ * Decoding is a memset per zero run and a memcpy per nonzero run.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "codec.h"
+#include "huff.h"
+
+#define ZD_FRAMESIZE	(8 << 20)
+#define ZD_MTFSIZE	63
+#define ZD_NEWRUN	63
+
+/* Probabilities are of a zero bit, in ZD_PROBBITS bits, and move a
+   1 / (1 << ZD_ADAPT) of the way towards each bit coded */
+#define ZD_PROBBITS	12
+#define ZD_ADAPT	4
+#define ZD_TOP		(1U << 24)
+
+/* Room kept in the range coded stream for a pair, at most 35 bits
+   coded at up to 8.1 bits each, and for flushing after the last */
+#define ZD_PAIRMAX	48
+
+typedef struct zdstate {
+	stream *f;
+	long left;		/* compressed bytes left in the block */
+	long rawlen;		/* bytes in raw */
+	long rawpos;		/* next byte of raw to return */
+	unsigned char *raw;
+} zdstate;
+
+/* The adaptive probabilities of a frame, in contexts of the positions
+   of the pair before (p1) and the one before that (p2), each as 0, 1,
+   2 or more, and of the bits of the zero run before (nb) */
+typedef struct zdmodel {
+	unsigned short same[4][32];		/* [p1][nb] */
+	unsigned short bits[4][32][32];		/* [p1][nb], 5-bit tree */
+	unsigned short low[32][7][8];		/* [bits][place][above] */
+	unsigned short pos[4][4][64];		/* [p1][p2], 6-bit tree */
+} zdmodel;
+
+static unsigned int get32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static void put32(unsigned char *p, unsigned int x)
+{
+	p[0] = (unsigned char)x;
+	p[1] = (unsigned char)(x >> 8);
+	p[2] = (unsigned char)(x >> 16);
+	p[3] = (unsigned char)(x >> 24);
+}
+
+static long putvarint(unsigned long y, unsigned char *buf)
+{
+	long n = 0;
+
+	while (y >= 0x80) {
+		buf[n++] = (unsigned char)(y | 0x80);
+		y >>= 7;
+	};
+	buf[n++] = (unsigned char)y;
+
+	return n;
+}
+
+static int getvarint(const unsigned char **pp, const unsigned char *end,
+	long *y)
+{
+	const unsigned char *p = *pp;
+	unsigned long v = 0;
+	int shift;
+
+	for (shift = 0;shift < 28;shift += 7) {
+		if (p == end)
+			return -1;
+		v |= (unsigned long)(*p & 0x7F) << shift;
+		if ((*p++ & 0x80) == 0) {
+			*pp = p;
+			*y = (long)v;
+			return 0;
+		};
+	};
+
+	return -1;
+}
+
+static void zd_initmodel(zdmodel *m)
+{
+	unsigned short *p = (unsigned short *)m;
+	size_t i;
+
+	for (i = 0;i < sizeof(zdmodel) / sizeof(unsigned short);i++)
+		p[i] = 1 << (ZD_PROBBITS - 1);
+}
+
+/* The bits of x, 0 for 0 */
+static int zd_nbits(long x)
+{
+	int n;
+
+	for (n = 0;x > 0;x >>= 1)
+		n++;
+	return n;
+}
+
+/* The context a run's position gives the pairs after it */
+#define ZD_CTX(pos)	((pos) < 3 ? (int)(pos) : 3)
+
+/* The range encoder, writing at op */
+typedef struct rcenc {
+	unsigned char *op;
+	unsigned long long low;
+	unsigned int range;
+	unsigned char cache;
+	long pending;
+} rcenc;
+
+static void rc_shift(rcenc *e)
+{
+	unsigned char carry;
+
+	if (((unsigned int)e->low < 0xFF000000U) || (e->low >> 32)) {
+		carry = (unsigned char)(e->low >> 32);
+		*e->op++ = e->cache + carry;
+		for (;e->pending > 0;e->pending--)
+			*e->op++ = 0xFF + carry;
+		e->cache = (unsigned char)(e->low >> 24);
+	} else
+		e->pending++;
+	e->low = (e->low & 0x00FFFFFF) << 8;
+}
+
+static void rc_bit(rcenc *e, unsigned short *p, int bit)
+{
+	unsigned int bound = (e->range >> ZD_PROBBITS) * *p;
+
+	if (bit == 0) {
+		e->range = bound;
+		*p += ((1 << ZD_PROBBITS) - *p) >> ZD_ADAPT;
+	} else {
+		e->low += bound;
+		e->range -= bound;
+		*p -= *p >> ZD_ADAPT;
+	};
+	for (;e->range < ZD_TOP;e->range <<= 8)
+		rc_shift(e);
+}
+
+/* The n low bits of x, top first, through the tree of probabilities
+   at p */
+static void rc_tree(rcenc *e, unsigned short *p, int n, unsigned int x)
+{
+	unsigned int node;
+	int bit;
+
+	for (node = 1;n > 0;n--) {
+		bit = (x >> (n - 1)) & 1;
+		rc_bit(e, p + node, bit);
+		node = 2 * node + bit;
+	};
+}
+
+static void rc_flush(rcenc *e)
+{
+	int i;
+
+	for (i = 0;i < 5;i++)
+		rc_shift(e);
+}
+
+/* The range decoder, reading from ip to iend; past the end it reads
+   zeros, which the frame's checks then catch */
+typedef struct rcdec {
+	const unsigned char *ip, *iend;
+	unsigned int code, range;
+} rcdec;
+
+static unsigned char rc_next(rcdec *d)
+{
+	return (d->ip < d->iend) ? *d->ip++ : 0;
+}
+
+static void rc_start(rcdec *d, const unsigned char *ip,
+	const unsigned char *iend)
+{
+	int i;
+
+	d->ip = ip;
+	d->iend = iend;
+	d->code = 0;
+	d->range = 0xFFFFFFFFU;
+	for (i = 0;i < 5;i++)
+		d->code = (d->code << 8) | rc_next(d);
+}
+
+static int rc_getbit(rcdec *d, unsigned short *p)
+{
+	unsigned int bound = (d->range >> ZD_PROBBITS) * *p;
+	int bit;
+
+	if (d->code < bound) {
+		d->range = bound;
+		*p += ((1 << ZD_PROBBITS) - *p) >> ZD_ADAPT;
+		bit = 0;
+	} else {
+		d->code -= bound;
+		d->range -= bound;
+		*p -= *p >> ZD_ADAPT;
+		bit = 1;
+	};
+	for (;d->range < ZD_TOP;d->range <<= 8)
+		d->code = (d->code << 8) | rc_next(d);
+
+	return bit;
+}
+
+static unsigned int rc_gettree(rcdec *d, unsigned short *p, int n)
+{
+	unsigned int node;
+
+	for (node = 1;n > 0;n--)
+		node = 2 * node + rc_getbit(d, p + node);
+
+	return node;
+}
+
+/* Runs */
+
+/* The place of bit b of a zero run of nb bits among the contexts of
+   model.low: the three lowest each have their own, with the three
+   bits above them, and the rest go by how far they are from the top */
+#define ZD_PLACE(b, nb)	((b) < 3 ? (b) : 3 + ((nb) - 2 - (b) < 3 ? \
+				(nb) - 2 - (b) : 3))
+
+static void zd_putgap(rcenc *e, zdmodel *m, long gap, long *prev, int p1)
+{
+	int nb, pnb, b;
+
+	nb = zd_nbits(gap);
+	pnb = zd_nbits(*prev);
+	rc_bit(e, &m->same[p1][pnb], gap != *prev);
+	if (gap != *prev) {
+		rc_tree(e, m->bits[p1][pnb], 5, nb);
+		for (b = nb - 2;b >= 0;b--)
+			rc_bit(e, &m->low[nb][ZD_PLACE(b, nb)][(b < 3) ?
+				(gap >> (b + 1)) & 7 : 0], (gap >> b) & 1);
+	};
+	*prev = gap;
+}
+
+static long zd_getgap(rcdec *d, zdmodel *m, long *prev, int p1)
+{
+	long gap;
+	int nb, pnb, b;
+
+	pnb = zd_nbits(*prev);
+	if (rc_getbit(d, &m->same[p1][pnb])) {
+		nb = rc_gettree(d, m->bits[p1][pnb], 5) - 32;
+		for (gap = (nb > 0), b = nb - 2;b >= 0;b--)
+			gap = 2 * gap + rc_getbit(d,
+				&m->low[nb][ZD_PLACE(b, nb)][(b < 3) ? gap & 7 : 0]);
+		*prev = gap;
+	};
+
+	return *prev;
+}
+
+/* Frames */
+
+/* Encode n bytes of src; returns a malloc()ed frame, or NULL */
+static unsigned char *zd_encode(const unsigned char *src, long n, long *lenp)
+{
+	unsigned char *rc, *newlen, *newbytes, *frame, *op, *p;
+	long mpos[ZD_MTFSIZE], mlen[ZD_MTFSIZE];
+	long npairs, nnewlen, nnew, mcount, alloc, prev, i, j, k, rlen;
+	zdmodel m;
+	rcenc e;
+	int p1, p2;
+
+	frame = NULL;
+	alloc = 4096;
+	rc = (unsigned char *)malloc(alloc);
+	newlen = (unsigned char *)malloc(5 * n + 5);
+	newbytes = (unsigned char *)malloc(n + 1);
+	if ((rc == NULL) || (newlen == NULL) || (newbytes == NULL))
+		goto out;
+
+	zd_initmodel(&m);
+	e.op = rc;
+	e.low = 0;
+	e.range = 0xFFFFFFFFU;
+	e.cache = 0;
+	e.pending = 0;
+	npairs = nnewlen = nnew = mcount = prev = 0;
+	p1 = p2 = 0;
+	for (i = 0;i < n;i = j) {
+		if (e.op - rc + e.pending + ZD_PAIRMAX > alloc) {
+			if ((p = (unsigned char *)realloc(rc, 2 * alloc)) == NULL)
+				goto out;
+			e.op = p + (e.op - rc);
+			rc = p;
+			alloc *= 2;
+		};
+
+		for (j = i;(j < n) && (src[j] == 0);j++);
+		zd_putgap(&e, &m, j - i, &prev, p1);
+		for (i = j;(j < n) && (src[j] != 0);j++);
+		rlen = j - i;
+
+		for (k = 0;k < mcount;k++)
+			if ((mlen[k] == rlen) &&
+				(memcmp(src + mpos[k], src + i, rlen) == 0))
+				break;
+		if (k < mcount) {
+			rc_tree(&e, m.pos[p1][p2], 6, (unsigned int)k);
+			p2 = p1;
+			p1 = ZD_CTX(k);
+			rlen = mpos[k];
+		} else {
+			rc_tree(&e, m.pos[p1][p2], 6, ZD_NEWRUN);
+			p2 = p1;
+			p1 = ZD_CTX(ZD_NEWRUN);
+			nnewlen += putvarint(rlen, newlen + nnewlen);
+			memcpy(newbytes + nnew, src + i, rlen);
+			nnew += rlen;
+			if (mcount < ZD_MTFSIZE)
+				mcount++;
+			k = mcount - 1;
+			rlen = i;
+		};
+		npairs++;
+
+		/* Move the run to the front; rlen holds its position */
+		memmove(mpos + 1, mpos, k * sizeof(long));
+		memmove(mlen + 1, mlen, k * sizeof(long));
+		mpos[0] = rlen;
+		mlen[0] = j - i;
+	};
+	rc_flush(&e);
+
+	if ((frame = (unsigned char *)malloc(12 + (e.op - rc) +
+		HUFF_PUTBOUND(nnewlen) + HUFF_PUTBOUND(nnew))) == NULL)
+		goto out;
+	put32(frame, (unsigned int)n);
+	put32(frame + 4, (unsigned int)npairs);
+	put32(frame + 8, (unsigned int)(e.op - rc));
+	memcpy(frame + 12, rc, e.op - rc);
+	op = frame + 12 + (e.op - rc);
+	op = huff_put(op, newlen, nnewlen);
+	op = huff_put(op, newbytes, nnew);
+	*lenp = (long)(op - frame);
+
+out:
+	free(rc);
+	free(newlen);
+	free(newbytes);
+	return frame;
+}
+
+/* Decode a frame of len bytes into dst; returns 0, or -1 if corrupt */
+static int zd_decode(const unsigned char *src, long len, unsigned char *dst,
+	long n)
+{
+	const unsigned char *ip, *iend, *ln, *nb;
+	unsigned char *newlen, *newbytes, *op, *oend;
+	long mpos[ZD_MTFSIZE], mlen[ZD_MTFSIZE];
+	long npairs, rclen, nnewlen, nnew, mcount, k, m, gap, prev, rlen, pos;
+	zdmodel model;
+	rcdec d;
+	int p1, p2, rc = -1;
+
+	if ((len < 12) || ((rclen = get32(src + 8)) > len - 12))
+		return -1;
+	npairs = get32(src + 4);
+	ip = src + 12 + rclen;iend = src + len;
+	newlen = huff_get(&ip, iend, 5 * n + 5, &nnewlen);
+	newbytes = huff_get(&ip, iend, n, &nnew);
+	if ((newlen == NULL) || (newbytes == NULL) || (ip != iend))
+		goto out;
+
+	zd_initmodel(&model);
+	rc_start(&d, src + 12, src + 12 + rclen);
+	op = dst;oend = dst + n;
+	ln = newlen;nb = newbytes;
+	mcount = prev = 0;
+	p1 = p2 = 0;
+	for (k = 0;k < npairs;k++) {
+		if ((gap = zd_getgap(&d, &model, &prev, p1)) > oend - op)
+			goto out;
+		memset(op, 0, gap);
+		op += gap;
+
+		m = rc_gettree(&d, model.pos[p1][p2], 6) - 64;
+		p2 = p1;
+		p1 = ZD_CTX(m);
+		if (m == ZD_NEWRUN) {
+			if (getvarint(&ln, newlen + nnewlen, &rlen) ||
+				(rlen > newbytes + nnew - nb) || (rlen > oend - op))
+				goto out;
+			memcpy(op, nb, rlen);
+			nb += rlen;
+			if (mcount < ZD_MTFSIZE)
+				mcount++;
+			m = mcount - 1;
+			pos = (long)(op - dst);
+		} else {
+			if ((m >= mcount) || (mlen[m] > oend - op))
+				goto out;
+			rlen = mlen[m];
+			pos = mpos[m];
+			memcpy(op, dst + pos, rlen);
+		};
+		op += rlen;
+
+		memmove(mpos + 1, mpos, m * sizeof(long));
+		memmove(mlen + 1, mlen, m * sizeof(long));
+		mpos[0] = pos;
+		mlen[0] = rlen;
+	};
+	if ((op == oend) && (d.ip == d.iend) && (ln == newlen + nnewlen) &&
+		(nb == newbytes + nnew))
+		rc = 0;
+
+out:
+	free(newlen);
+	free(newbytes);
+	return rc;
+}
+
+/* Codec glue */
+
+static zdstate *zd_alloc(stream *f)
+{
+	zdstate *s;
+
+	if ((s = (zdstate *)malloc(sizeof(zdstate))) == NULL)
+		return NULL;
+	if ((s->raw = (unsigned char *)malloc(ZD_FRAMESIZE)) == NULL) {
+		free(s);
+		return NULL;
+	};
+	s->f = f;
+	s->left = 0;
+	s->rawlen = 0;
+	s->rawpos = 0;
+
+	return s;
+}
+
+static void zd_free(zdstate *s)
+{
+	free(s->raw);
+	free(s);
+}
+
+static void *zd_wopen(stream *f, int level)
+{
+	return zd_alloc(f);
+}
+
+static int zd_flush(void *p)
+{
+	zdstate *s = (zdstate *)p;
+	unsigned char *frame;
+	unsigned char hdr[4];
+	long len;
+
+	if (s->rawlen == 0)
+		return 0;
+
+	if ((frame = zd_encode(s->raw, s->rawlen, &len)) == NULL)
+		return -1;
+	put32(hdr, (unsigned int)len);
+	if (stream_write(s->f, hdr, 4) || stream_write(s->f, frame, len)) {
+		free(frame);
+		return -1;
+	};
+	free(frame);
+	s->rawlen = 0;
+
+	return 0;
+}
+
+static int zd_write(void *p, const void *buf, long len)
+{
+	zdstate *s = (zdstate *)p;
+	long n;
+
+	while (len > 0) {
+		n = ZD_FRAMESIZE - s->rawlen;
+		if (n > len)
+			n = len;
+		memcpy(s->raw + s->rawlen, buf, n);
+		s->rawlen += n;
+		buf = (const unsigned char *)buf + n;
+		len -= n;
+		if ((s->rawlen == ZD_FRAMESIZE) && zd_flush(s))
+			return -1;
+	};
+
+	return 0;
+}
+
+static int zd_wclose(void *p)
+{
+	int rc;
+
+	rc = zd_flush(p);
+	zd_free((zdstate *)p);
+
+	return rc;
+}
+
+static void *zd_ropen(stream *f, long len)
+{
+	zdstate *s;
+
+	if ((s = zd_alloc(f)) != NULL)
+		s->left = len;
+
+	return s;
+}
+
+/* Read and decode the next frame into raw; returns 0, or -1 if corrupt */
+static int zd_nextframe(zdstate *s)
+{
+	unsigned char hdr[4];
+	unsigned char *frame;
+	long len, n;
+
+	if ((s->left < 4) || (stream_read(s->f, hdr, 4) != 4))
+		return -1;
+	len = get32(hdr);
+	s->left -= 4;
+	if ((len < 8) || (len > s->left) ||
+		((frame = (unsigned char *)malloc(len)) == NULL))
+		return -1;
+	if (stream_read(s->f, frame, len) != len) {
+		free(frame);
+		return -1;
+	};
+	s->left -= len;
+	n = get32(frame);
+	if ((n == 0) || (n > ZD_FRAMESIZE) || zd_decode(frame, len, s->raw, n)) {
+		free(frame);
+		return -1;
+	};
+	free(frame);
+	s->rawlen = n;
+	s->rawpos = 0;
+
+	return 0;
+}
+
+static long zd_read(void *p, void *buf, long len)
+{
+	zdstate *s = (zdstate *)p;
+	long n, done;
+
+	for (done = 0;done < len;done += n) {
+		if (s->rawpos == s->rawlen) {
+			if (s->left == 0)
+				break;
+			if (zd_nextframe(s))
+				return -1;
+		};
+		n = s->rawlen - s->rawpos;
+		if (n > len - done)
+			n = len - done;
+		memcpy((unsigned char *)buf + done, s->raw + s->rawpos, n);
+		s->rawpos += n;
+	};
+
+	return done;
+}
+
+static void zd_rclose(void *p)
+{
+	zd_free((zdstate *)p);
+}
+
+/* A frame of n bytes is held with the lengths and bytes of its new
+   runs, 6 bytes for each of its own, and the range coded stream and
+   the frame it is copied into, taken to be no larger than n each */
+static size_t zd_wmemory(int level, long len, long dictlen)
+{
+	size_t n;
+
+	n = (len < ZD_FRAMESIZE) ? len : ZD_FRAMESIZE;
+	return sizeof(zdstate) + ZD_FRAMESIZE + 9 * n;
+}
+
+const codec zdiff_codec = {
+	CODEC_ZDIFF, "zdiff",
+	zd_wopen, zd_write, zd_flush, zd_wclose, zd_wmemory,
+	zd_ropen, zd_read, zd_rclose,
+	NULL,
+	NULL,
+	NULL,
+	NULL
+};
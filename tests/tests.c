@@ -0,0 +1,614 @@
+/*
+ * Round trips through bsdifflib and bspatchlib on generated data, and
+ * through the bspatch tool's own files for what only it does.
+ * Prints a line for each test and exits nonzero if any failed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include "bsdifflib.h"
+#include "bspatchlib.h"
+#include "codec.h"
+#include "bspatch.h"
+
+typedef unsigned char u_char;
+
+/* The bspatch tool's files report failures through err(), which exits
+   in bspatch; here it jumps back to the test that called them */
+static jmp_buf toolfailed;
+
+void err(int exitcode, const char *fmt, ...)
+{
+	longjmp(toolfailed, 1);
+}
+
+/* A patch collected in memory */
+typedef struct patchbuf {
+	u_char *buf;
+	long len, alloc;
+} patchbuf;
+
+static int collect(void *arg, const void *buf, long len)
+{
+	patchbuf *pb = (patchbuf *)arg;
+	u_char *p;
+
+	if (pb->len + len > pb->alloc) {
+		if ((p = (u_char *)realloc(pb->buf, 2 * (pb->len + len))) == NULL)
+			return -1;
+		pb->buf = p;
+		pb->alloc = 2 * (pb->len + len);
+	};
+	memcpy(pb->buf + pb->len, buf, len);
+	pb->len += len;
+
+	return 0;
+}
+
+/* Write the n bytes at p to name; returns 0, or -1 */
+static int putfile(const char *name, const void *p, long n)
+{
+	FILE *f;
+	int rc;
+
+	if ((f = fopen(name, "wb")) == NULL)
+		return -1;
+	rc = (fwrite(p, 1, n, f) != (size_t)n) ? -1 : 0;
+	if (fclose(f) != 0)
+		rc = -1;
+
+	return rc;
+}
+
+/* Read name whole into pb; returns 0, or -1 */
+static int getfile(const char *name, patchbuf *pb)
+{
+	FILE *f;
+	int rc;
+
+	pb->len = 0;
+	if ((f = fopen(name, "rb")) == NULL)
+		return -1;
+	if ((fseek(f, 0, SEEK_END) != 0) || ((pb->len = ftell(f)) < 0) ||
+		(fseek(f, 0, SEEK_SET) != 0))
+		rc = -1;
+	else if ((pb->len > pb->alloc) &&
+		((pb->buf = (u_char *)realloc(pb->buf, pb->len + 1)) == NULL))
+		rc = -1;
+	else
+		rc = (fread(pb->buf, 1, pb->len, f) != (size_t)pb->len) ? -1 : 0;
+	if (pb->len > pb->alloc)
+		pb->alloc = pb->len;
+	fclose(f);
+
+	return rc;
+}
+
+/* The same pseudo-random bytes on every run, from xorshift32 */
+static void fill(u_char *p, long n, unsigned int *seed)
+{
+	unsigned int x = *seed;
+	long i;
+
+	for (i = 0;i < n;i++) {
+		x ^= x << 13;x ^= x >> 17;x ^= x << 5;
+		p[i] = (u_char)x;
+	};
+	*seed = x;
+}
+
+/* Make new from the n bytes of old, with 300 bytes put in at at and
+   every 997th byte changed after; returns its size, n + 300 */
+static long edit(const u_char *old, long n, long at, u_char *new,
+	unsigned int *seed)
+{
+	long i;
+
+	memcpy(new, old, at);
+	fill(new + at, 300, seed);
+	memcpy(new + at + 300, old + at, n - at);
+	for (i = at;i < n + 300;i += 997)
+		new[i] ^= 0x55;
+
+	return n + 300;
+}
+
+/* Diff old to new with opts into pb; returns a BSDIFF_* code */
+static int diff(const u_char *old, long oldsize, const u_char *new,
+	long newsize, const bsdiff_opts *opts, patchbuf *pb)
+{
+	bsdiff_ctx *ctx;
+	int rc;
+
+	pb->len = 0;
+	if ((ctx = bsdiff_new()) == NULL)
+		return BSDIFF_ENOMEM;
+	rc = bsdiff_diff(ctx, old, oldsize, new, newsize, opts, collect, pb,
+		NULL);
+	bsdiff_free(ctx);
+
+	return rc;
+}
+
+/* Apply pb to old into a buffer and compare it with new */
+static int patchspan(const u_char *old, long oldsize, const u_char *new,
+	long newsize, const patchbuf *pb)
+{
+	bspatch_ctx *ctx;
+	bspatch_source os = { old, oldsize, NULL, NULL };
+	bspatch_source ps = { pb->buf, pb->len, NULL, NULL };
+	bspatch_sink out = { NULL, newsize, NULL, NULL };
+	long size;
+	int rc;
+
+	if (((ctx = bspatch_new()) == NULL) ||
+		((out.data = malloc(newsize + 1)) == NULL)) {
+		bspatch_free(ctx);
+		return -1;
+	};
+	rc = bspatch_apply(ctx, &os, &ps, &out, &size);
+	if ((rc == BSPATCH_OK) && ((size != newsize) ||
+		(memcmp(out.data, new, newsize) != 0)))
+		rc = -1;
+	free(out.data);
+	bspatch_free(ctx);
+
+	return rc;
+}
+
+/* A patch whose triples have both diff and extra bytes, applied into
+   a buffer */
+static int spansink(void)
+{
+	u_char *old, *new;
+	unsigned int seed = 1;
+	patchbuf pb = { NULL, 0, 0 };
+	long i;
+	int rc;
+
+	old = (u_char *)malloc(65536);
+	new = (u_char *)malloc(65536 + 3000);
+	if ((old == NULL) || (new == NULL))
+		return -1;
+	fill(old, 65536, &seed);
+	memcpy(new, old, 20000);
+	fill(new + 20000, 3000, &seed);
+	memcpy(new + 23000, old + 20000, 65536 - 20000);
+	for (i = 100;i < 65536 + 3000;i += 997)
+		new[i] ^= 0x55;
+
+	if ((rc = diff(old, 65536, new, 65536 + 3000, NULL, &pb)) == BSDIFF_OK)
+		rc = patchspan(old, 65536, new, 65536 + 3000, &pb);
+	free(pb.buf);
+	free(old);
+	free(new);
+
+	return rc;
+}
+
+/* Data with a 4-byte change every 2 KB or so, which no chunk survives,
+   and a 50 KB block moved, diffed in 64 KB windows: the patch has to
+   stay within three times the size of one made without windows */
+static int windowfallback(void)
+{
+	u_char *old, *new;
+	unsigned int seed = 2;
+	patchbuf pb = { NULL, 0, 0 };
+	bsdiff_opts o;
+	long i, plain;
+	int rc;
+
+	old = (u_char *)malloc(1 << 20);
+	new = (u_char *)malloc(1 << 20);
+	if ((old == NULL) || (new == NULL))
+		return -1;
+	fill(old, 1 << 20, &seed);
+	memcpy(new, old, 300000);
+	memcpy(new + 300000, old + 350000, 500000);
+	memcpy(new + 800000, old + 300000, 50000);
+	memcpy(new + 850000, old + 850000, (1 << 20) - 850000);
+	for (i = 1000;i + 4 <= 1 << 20;i += 2000 + i % 199)
+		fill(new + i, 4, &seed);
+
+	bsdiff_defaults(&o);
+	if ((rc = diff(old, 1 << 20, new, 1 << 20, &o, &pb)) == BSDIFF_OK) {
+		plain = pb.len;
+		o.window = 65536;
+		if (((rc = diff(old, 1 << 20, new, 1 << 20, &o, &pb)) ==
+			BSDIFF_OK) && ((rc = patchspan(old, 1 << 20, new, 1 << 20,
+			&pb)) == BSPATCH_OK) && (pb.len > 3 * plain))
+			rc = -1;
+	};
+	free(pb.buf);
+	free(old);
+	free(new);
+
+	return rc;
+}
+
+/* A diff block of pointers shifted by a few values, coded with zdiff
+   and applied into a buffer */
+static int zdiffblock(void)
+{
+	u_char *old, *new;
+	unsigned int seed = 4;
+	patchbuf pb = { NULL, 0, 0 };
+	bsdiff_opts o;
+	long i;
+	int rc;
+
+	old = (u_char *)malloc(1 << 18);
+	new = (u_char *)malloc(1 << 18);
+	if ((old == NULL) || (new == NULL))
+		return -1;
+	fill(old, 1 << 18, &seed);
+	memcpy(new, old, 1 << 18);
+	for (i = 1;i < 1 << 18;i += 8 + 4 * (old[i] & 7))
+		new[i] += 0x10 * (1 + (old[i - 1] & 3));
+
+	bsdiff_defaults(&o);
+	o.codecs[1] = CODEC_ZDIFF;
+	if ((rc = diff(old, 1 << 18, new, 1 << 18, &o, &pb)) == BSDIFF_OK)
+		rc = patchspan(old, 1 << 18, new, 1 << 18, &pb);
+	free(pb.buf);
+	free(old);
+	free(new);
+
+	return rc;
+}
+
+/* A patch from A to B and one from B to C, each applying, composed
+   into one from A to C that gives the same C; the first patch is then
+   BSDIFF40, and then both are */
+static int composed(void)
+{
+	u_char *a, *b, *c;
+	long nb, nc;
+	unsigned int seed = 5;
+	patchbuf pb = { NULL, 0, 0 };
+	bsdiff_opts o;
+	int rc, legacy;
+
+	a = (u_char *)malloc(65536);
+	b = (u_char *)malloc(65536 + 300);
+	c = (u_char *)malloc(65536 + 600);
+	if ((a == NULL) || (b == NULL) || (c == NULL))
+		return -1;
+	fill(a, 65536, &seed);
+	nb = edit(a, 65536, 20000, b, &seed);
+	nc = edit(b, nb, 40000, c, &seed);
+
+	bsdiff_defaults(&o);
+	for (rc = 0, legacy = 0;(rc == 0) && (legacy < 3);legacy++) {
+		o.legacy = (legacy > 0);
+		if (((rc = diff(a, 65536, b, nb, &o, &pb)) != BSDIFF_OK) ||
+			((rc = patchspan(a, 65536, b, nb, &pb)) != BSPATCH_OK) ||
+			((rc = putfile("tests-1.tmp", pb.buf, pb.len)) != 0))
+			break;
+		o.legacy = (legacy > 1);
+		if (((rc = diff(b, nb, c, nc, &o, &pb)) != BSDIFF_OK) ||
+			((rc = patchspan(b, nb, c, nc, &pb)) != BSPATCH_OK) ||
+			((rc = putfile("tests-2.tmp", pb.buf, pb.len)) != 0))
+			break;
+		if (setjmp(toolfailed) == 0)
+			rc = compose("tests-1.tmp", "tests-2.tmp", "tests-3.tmp");
+		else
+			rc = -1;
+		if ((rc == 0) && ((rc = getfile("tests-3.tmp", &pb)) == 0))
+			rc = patchspan(a, 65536, c, nc, &pb);
+	};
+	remove("tests-1.tmp");
+	remove("tests-2.tmp");
+	remove("tests-3.tmp");
+	free(pb.buf);
+	free(a);
+	free(b);
+	free(c);
+
+	return rc;
+}
+
+/* Patches from A to B, B to C and C to D applied in one chain, and the
+   same chain with the last two swapped, which is refused before
+   anything is written */
+static int chained(void)
+{
+	static char *names[3] = { "tests-1.tmp", "tests-2.tmp", "tests-3.tmp" };
+	static char *swapped[3] = { "tests-1.tmp", "tests-3.tmp",
+		"tests-2.tmp" };
+	u_char *v[4];
+	long n[4];
+	unsigned int seed = 6;
+	patchbuf pb = { NULL, 0, 0 };
+	char name[16];
+	FILE *f;
+	int rc, k;
+
+	for (k = 0;k < 4;k++)
+		if ((v[k] = (u_char *)malloc(65536 + 300 * k)) == NULL)
+			return -1;
+	fill(v[0], 65536, &seed);
+	n[0] = 65536;
+	for (k = 1;k < 4;k++)
+		n[k] = edit(v[k - 1], n[k - 1], 10000 * k, v[k], &seed);
+
+	rc = putfile("tests-0.tmp", v[0], n[0]);
+	for (k = 0;(rc == 0) && (k < 3);k++)
+		if ((rc = diff(v[k], n[k], v[k + 1], n[k + 1], NULL, &pb)) ==
+			BSDIFF_OK)
+			rc = putfile(names[k], pb.buf, pb.len);
+	if (rc == 0) {
+		if (setjmp(toolfailed) == 0)
+			rc = chain("tests-0.tmp", "tests-4.tmp", 3, names);
+		else
+			rc = -1;
+	};
+	if ((rc == 0) && ((rc = getfile("tests-4.tmp", &pb)) == 0) &&
+		((pb.len != n[3]) || (memcmp(pb.buf, v[3], n[3]) != 0)))
+		rc = -1;
+	if (rc == 0) {
+		remove("tests-4.tmp");
+		if (setjmp(toolfailed) == 0) {
+			chain("tests-0.tmp", "tests-4.tmp", 3, swapped);
+			rc = -1;
+		}
+		else if ((f = fopen("tests-4.tmp", "rb")) != NULL) {
+			fclose(f);
+			rc = -1;
+		};
+	};
+	for (k = 0;k < 5;k++) {
+		sprintf(name, "tests-%d.tmp", k);
+		remove(name);
+	};
+	free(pb.buf);
+	for (k = 0;k < 4;k++)
+		free(v[k]);
+
+	return rc;
+}
+
+/* New data that is the old with its halves swapped and a few bytes
+   changed, so that each half's copy reads what the other's writes,
+   diffed for --in-place with no scratch, which stores copy bytes in
+   the patch to break the cycle, and with 1 MB, which holds them there
+   instead; either patch has to turn the file into the new data */
+static int inplacecycle(void)
+{
+	u_char *old, *new;
+	unsigned int seed = 7;
+	patchbuf pb = { NULL, 0, 0 };
+	bsdiff_opts o;
+	bsdiff_stats st;
+	bsdiff_ctx *ctx;
+	long i;
+	int rc, k;
+
+	old = (u_char *)malloc(1 << 18);
+	new = (u_char *)malloc(1 << 18);
+	if ((old == NULL) || (new == NULL) || ((ctx = bsdiff_new()) == NULL))
+		return -1;
+	fill(old, 1 << 18, &seed);
+	memcpy(new, old + (1 << 17), 1 << 17);
+	memcpy(new + (1 << 17), old, 1 << 17);
+	for (i = 500;i < 1 << 18;i += 4093)
+		new[i] ^= 0x55;
+
+	bsdiff_defaults(&o);
+	o.inplace = 1;
+	for (rc = 0, k = 0;(rc == 0) && (k < 2);k++) {
+		o.scratch = k ? 1L << 20 : 0;
+		pb.len = 0;
+		if ((rc = bsdiff_diff(ctx, old, 1 << 18, new, 1 << 18, &o, collect,
+			&pb, &st)) != BSDIFF_OK)
+			break;
+		if ((k ? (st.converted != 0) : (st.converted == 0)) ||
+			(putfile("tests-1.tmp", old, 1 << 18) != 0) ||
+			(putfile("tests-2.tmp", pb.buf, pb.len) != 0)) {
+			rc = -1;
+			break;
+		};
+		if (setjmp(toolfailed) == 0)
+			rc = inplace("tests-1.tmp", NULL, "tests-2.tmp");
+		else
+			rc = -1;
+		if ((rc == 0) && ((rc = getfile("tests-1.tmp", &pb)) == 0) &&
+			((pb.len != 1 << 18) || (memcmp(pb.buf, new, 1 << 18) != 0)))
+			rc = -1;
+	};
+	remove("tests-1.tmp");
+	remove("tests-2.tmp");
+	bsdiff_free(ctx);
+	free(pb.buf);
+	free(old);
+	free(new);
+
+	return rc;
+}
+
+/* Output written three blocks at a time over a file of the old data,
+   which it differs from in two neighbouring blocks and one further on,
+   and ends 1000 bytes sooner: only those blocks are written, and the
+   file is cut; then the same, comparing with the old data in memory as
+   when newfile is the old file */
+static int updateblocks(void)
+{
+	u_char *old, *new;
+	unsigned int seed = 8;
+	patchbuf pb = { NULL, 0, 0 };
+	updater u;
+	long i, n;
+	int rc, k;
+
+	old = (u_char *)malloc(1 << 18);
+	new = (u_char *)malloc(1 << 18);
+	if ((old == NULL) || (new == NULL))
+		return -1;
+	fill(old, 1 << 18, &seed);
+	memcpy(new, old, 1 << 18);
+	new[3 * 4096 + 100] ^= 1;
+	new[4 * 4096] ^= 1;
+	new[40 * 4096 + 4095] ^= 1;
+	n = (1 << 18) - 1000;
+
+	for (rc = 0, k = 0;(rc == 0) && (k < 2);k++) {
+		if ((rc = putfile("tests-1.tmp", old, 1 << 18)) != 0)
+			break;
+		if (setjmp(toolfailed) == 0) {
+			update_open(&u, "tests-1.tmp", k ? old : NULL, 1 << 18);
+			for (i = 0;i < n;i += 3 * 4096)
+				update_write(&u, new + i, (n - i < 3 * 4096) ? n - i :
+					3 * 4096);
+			update_close(&u);
+			rc = (u.written == 3 * 4096) ? 0 : -1;
+		}
+		else
+			rc = -1;
+		if ((rc == 0) && ((rc = getfile("tests-1.tmp", &pb)) == 0) &&
+			((pb.len != n) || (memcmp(pb.buf, new, n) != 0)))
+			rc = -1;
+	};
+	remove("tests-1.tmp");
+	free(pb.buf);
+	free(old);
+	free(new);
+
+	return rc;
+}
+
+/* 512 KB of old data and new data that keeps its start and end, puts
+   5 KB of its own after the start and swaps two blocks between, and
+   changes a byte every 20 KB or so, diffed with o and applied */
+static int roundtrip(const bsdiff_opts *o)
+{
+	u_char *old, *new;
+	unsigned int seed = 9;
+	patchbuf pb = { NULL, 0, 0 };
+	long i;
+	int rc;
+
+	old = (u_char *)malloc(1 << 19);
+	new = (u_char *)malloc((1 << 19) + 5000);
+	if ((old == NULL) || (new == NULL))
+		return -1;
+	fill(old, 1 << 19, &seed);
+	memcpy(new, old, 100000);
+	fill(new + 100000, 5000, &seed);
+	memcpy(new + 105000, old + 300000, 100000);
+	memcpy(new + 205000, old + 100000, 200000);
+	memcpy(new + 405000, old + 400000, (1 << 19) - 400000);
+	for (i = 150000;i < (1 << 19) - 50000;i += 20011)
+		new[i] ^= 0x55;
+
+	if ((rc = diff(old, 1 << 19, new, (1 << 19) + 5000, o, &pb)) ==
+		BSDIFF_OK)
+		rc = patchspan(old, 1 << 19, new, (1 << 19) + 5000, &pb);
+	free(pb.buf);
+	free(old);
+	free(new);
+
+	return rc;
+}
+
+/* Every fourth suffix of the old data indexed */
+static int sparse(void)
+{
+	bsdiff_opts o;
+
+	bsdiff_defaults(&o);
+	o.sparse = 4;
+	return roundtrip(&o);
+}
+
+/* Matches found with an FM-index of the old data */
+static int fmindex(void)
+{
+	bsdiff_opts o;
+
+	bsdiff_defaults(&o);
+	o.fmindex = 1;
+	return roundtrip(&o);
+}
+
+/* Only what lies between the shared start and end indexed and scanned */
+static int trimmed(void)
+{
+	bsdiff_opts o;
+
+	bsdiff_defaults(&o);
+	o.trim = 1;
+	return roundtrip(&o);
+}
+
+/* The swapped blocks' chunks anchored, and only the gaps between them
+   indexed and scanned */
+static int anchored(void)
+{
+	bsdiff_opts o;
+
+	bsdiff_defaults(&o);
+	o.anchors = 1;
+	return roundtrip(&o);
+}
+
+/* A memory limit of 3 MB, which the encoders of small inputs fit in */
+static int smallbudget(void)
+{
+	u_char old[4096], new[4096];
+	unsigned int seed = 3;
+	patchbuf pb = { NULL, 0, 0 };
+	bsdiff_opts o;
+	int rc;
+
+	fill(old, sizeof(old), &seed);
+	memcpy(new, old, sizeof(new));
+	fill(new + 1000, 100, &seed);
+
+	bsdiff_defaults(&o);
+	o.maxmemory = (size_t)3 << 20;
+	if (((rc = diff(old, 0, new, 0, &o, &pb)) == BSDIFF_OK) &&
+		((rc = patchspan(old, 0, new, 0, &pb)) == BSPATCH_OK) &&
+		((rc = diff(old, sizeof(old), new, sizeof(new), &o, &pb)) ==
+		BSDIFF_OK))
+		rc = patchspan(old, sizeof(old), new, sizeof(new), &pb);
+	free(pb.buf);
+
+	return rc;
+}
+
+static const struct {
+	const char *name;
+	int (*fn)(void);
+} tests[] = {
+	{ "span sink", spansink },
+	{ "window fallback", windowfallback },
+	{ "small budget", smallbudget },
+	{ "zdiff block", zdiffblock },
+	{ "compose", composed },
+	{ "chain", chained },
+	{ "in-place cycle", inplacecycle },
+	{ "update blocks", updateblocks },
+	{ "sparse", sparse },
+	{ "fm-index", fmindex },
+	{ "trim", trimmed },
+	{ "anchors", anchored },
+};
+
+int main(void)
+{
+	size_t i;
+	int failed;
+
+	for (failed = 0, i = 0;i < sizeof(tests) / sizeof(tests[0]);i++) {
+		if (tests[i].fn() == 0)
+			printf("ok %s\n", tests[i].name);
+		else {
+			printf("FAIL %s\n", tests[i].name);
+			failed++;
+		};
+	};
+
+	return failed ? 1 : 0;
+}